@@ -9,611 +9,7094 @@
 
 #include <ncurses.h>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <fstream>
 #include <iostream>
 #include <algorithm>
 #include <sstream>
 #include <iomanip>
-#include <stack>
+#include <cstdint>
+#include <climits>
+#include <cstring>
+#include <cmath>
+#include <charconv>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-class TextEditor {
+// Groups consecutive buffer lines into chunks so that per-chunk summaries
+// can be refreshed one chunk at a time after an edit instead of rescanning
+// the whole buffer.
+template <typename Summary>
+class LineChunks {
 public:
-    // Editor modes
-    enum class EditorMode {
-        NORMAL,
-        INSERT,
-        COMMAND,
-        VISUAL,
-        VISUAL_LINE,
-        VISUAL_BLOCK
+    struct Chunk {
+        int lines;
+        bool dirty;
+        Summary summary;
     };
 
-    TextEditor(const std::string &fileName) 
-        : cursorX(0), cursorY(0), offsetY(0), fileName(fileName), 
-          mode(EditorMode::NORMAL), commandBuffer(""), 
-          visualStartX(0), visualStartY(0), 
-          repeatCount(0), lastCommand('\0') {
-        initscr(); 
-        raw();     
-        keypad(stdscr, TRUE); 
-        noecho();  
-        start_color(); 
-        initColors(); 
-        if (!loadFile()) {
-            lines.push_back(""); 
+    explicit LineChunks(int target) : target(target), layoutVersion(0) {}
+
+    void reset(int lineCount) {
+        chunks.clear();
+        for (int y = 0; y < lineCount; y += target) {
+            chunks.push_back({std::min(target, lineCount - y), true, Summary()});
         }
+        if (chunks.empty()) chunks.push_back({0, true, Summary()});
+        starts.clear();
+        layoutVersion++;
     }
 
-    ~TextEditor() {
-        endwin(); 
+    int count() const { return chunks.size(); }
+    int targetLines() const { return target; }
+    unsigned version() const { return layoutVersion; }
+    Chunk &operator[](int c) { return chunks[c]; }
+    const Chunk &operator[](int c) const { return chunks[c]; }
+
+    int firstLine(int c) {
+        buildStarts();
+        return starts[c];
     }
 
-    void run() {
-        while (true) {
-            display();
-            int ch = getch();
+    int chunkOf(int y) {
+        buildStarts();
+        int c = std::upper_bound(starts.begin(), starts.end(), y) - starts.begin() - 1;
+        return std::max(0, c);
+    }
 
-            // Mode-dependent input handling
-            switch(mode) {
-                case EditorMode::NORMAL:
-                    handleNormalModeInput(ch);
-                    break;
-                case EditorMode::INSERT:
-                    handleInsertModeInput(ch);
-                    break;
-                case EditorMode::COMMAND:
-                    handleCommandModeInput(ch);
-                    break;
-                case EditorMode::VISUAL:
-                case EditorMode::VISUAL_LINE:
-                case EditorMode::VISUAL_BLOCK:
-                    handleVisualModeInput(ch);
-                    break;
+    void markDirty(int y, int n) {
+        if (n <= 0) return;
+        for (int c = chunkOf(y); c < count() && starts[c] < y + n; ++c) {
+            chunks[c].dirty = true;
+        }
+    }
+
+    void linesInserted(int y, int n) {
+        if (n <= 0) return;
+        int c = chunkOf(y);
+        chunks[c].lines += n;
+        chunks[c].dirty = true;
+        starts.clear();
+    }
+
+    void linesErased(int y, int n) {
+        int c = chunkOf(y);
+        int offset = y - starts[c];
+        while (n > 0 && c < count()) {
+            int removed = std::min(n, chunks[c].lines - offset);
+            chunks[c].lines -= removed;
+            chunks[c].dirty = true;
+            n -= removed;
+            offset = 0;
+            if (chunks[c].lines == 0 && count() > 1) {
+                chunks.erase(chunks.begin() + c);
+                layoutVersion++;
+            } else {
+                c++;
+            }
+        }
+        starts.clear();
+    }
+
+    // Breaks up chunks that have grown well past the target size
+    void split() {
+        for (int c = 0; c < count(); ++c) {
+            if (chunks[c].lines > 2 * target) {
+                int rest = chunks[c].lines - target;
+                chunks[c].lines = target;
+                chunks[c].dirty = true;
+                chunks.insert(chunks.begin() + c + 1, {rest, true, Summary()});
+                starts.clear();
+                layoutVersion++;
             }
         }
     }
 
 private:
-    int cursorX, cursorY, offsetY;
-    std::string fileName;
-    std::vector<std::string> lines;
-    EditorMode mode;
-    std::string commandBuffer;
-    
-    // Visual mode selection tracking
-    int visualStartX, visualStartY;
-    
-    // Repeat count and last command for . repeat functionality
-    int repeatCount;
-    char lastCommand;
+    int target;
+    unsigned layoutVersion;
+    std::vector<Chunk> chunks;
+    std::vector<int> starts;
 
-    // Undo/Redo functionality
-    std::stack<std::vector<std::string>> undoStack;
-    std::stack<std::vector<std::string>> redoStack;
+    void buildStarts() {
+        if (!starts.empty()) return;
+        starts.resize(chunks.size());
+        int y = 0;
+        for (int c = 0; c < (int)chunks.size(); ++c) {
+            starts[c] = y;
+            y += chunks[c].lines;
+        }
+    }
+};
 
-    // Color pair IDs
-    const int LINE_NUMBER_COLOR = 1;
-    const int STATUS_BAR_COLOR = 2;
-    const int COMMAND_COLOR = 3;
-    const int VISUAL_COLOR = 4;
+// Identifies the on-disk file an index was built from
+struct FileKey {
+    uint64_t size;
+    int64_t mtimeSec, mtimeNsec;
+    uint64_t hash;
 
-    void initColors() {
-        init_pair(LINE_NUMBER_COLOR, COLOR_BLUE, COLOR_BLACK);
-        init_pair(STATUS_BAR_COLOR, COLOR_GREEN, COLOR_BLACK);
-        init_pair(COMMAND_COLOR, COLOR_BLACK, COLOR_BLUE);
-        init_pair(VISUAL_COLOR, COLOR_WHITE, COLOR_CYAN);
+    bool operator==(const FileKey &o) const {
+        return sameStat(o) && hash == o.hash;
     }
 
-    void handleNormalModeInput(int ch);
-    void handleInsertModeInput(int ch);
-    void handleCommandModeInput(int ch);
-    void handleVisualModeInput(int ch);
+    bool sameStat(const FileKey &o) const {
+        return size == o.size && mtimeSec == o.mtimeSec && mtimeNsec == o.mtimeNsec;
+    }
+};
 
-    // New methods for enhanced Vi functionality
-    void yankText();
-    void deleteText();
-    void pasteText();
-    void changeText();
-    void indentLine();
-    void unindentLine();
-    void searchText();
-    void jumpToMatchingBracket();
+// Per-chunk trigram signatures for search.  Each chunk keeps a hashed bitmap
+// of the case-folded trigrams of its lines, so a search only scans chunks
+// whose bitmap holds every trigram of the pattern.  Dirty chunks are always
+// scanned until they are rebuilt.
+class TrigramIndex {
+public:
+    static const int CHUNK_LINES = 2048;
+    static const int SIGNATURE_SHIFT = 17;
+    static const int SIGNATURE_BITS = 1 << SIGNATURE_SHIFT;
+    typedef std::vector<uint64_t> Signature;
 
-    bool loadFile() {
-        std::ifstream file(fileName);
-        if (!file.is_open()) return false;
+    bool enabled;
+    long long lookups, chunksChecked, chunksSkipped, chunksScanned, chunksMatched;
 
-        lines.clear();
-        std::string line;
-        while (std::getline(file, line)) {
-            lines.push_back(line);
+    TrigramIndex() 
+        : enabled(false), lookups(0), chunksChecked(0), chunksSkipped(0), 
+          chunksScanned(0), chunksMatched(0), chunks(CHUNK_LINES), 
+          complete(false) {}
+
+    LineChunks<Signature> &layout() { return chunks; }
+    bool isComplete() const { return complete; }
+
+    void reset(int lineCount) {
+        chunks.reset(lineCount);
+        complete = false;
+    }
+
+    void clear() {
+        chunks.reset(0);
+        chunks[0].dirty = false;
+        complete = true;
+    }
+
+    void linesChanged(int y, int n) { chunks.markDirty(y, n); complete = false; }
+    void linesInserted(int y, int n) { chunks.linesInserted(y, n); complete = false; }
+    void linesErased(int y, int n) { chunks.linesErased(y, n); complete = false; }
+
+    // Rebuilds dirty chunks until the deadline, returns true once all are clean
+    bool refresh(const std::vector<std::string> &lines, 
+                 std::chrono::steady_clock::time_point deadline) {
+        if (complete) return true;
+        chunks.split();
+        for (int c = 0; c < chunks.count(); ++c) {
+            if (!chunks[c].dirty) continue;
+            if (std::chrono::steady_clock::now() > deadline) return false;
+            build(lines, c);
         }
-        file.close();
+        complete = true;
         return true;
     }
 
-    void saveCurrentStateForUndo() {
-        undoStack.push(lines);
-        // Clear redo stack when a new action is performed
-        while (!redoStack.empty()) redoStack.pop();
+    static std::vector<uint32_t> patternHashes(const std::string &pattern) {
+        std::vector<uint32_t> hashes;
+        uint32_t t = 0;
+        for (size_t i = 0; i < pattern.length(); ++i) {
+            t = ((t << 8) | fold(pattern[i])) & 0xFFFFFF;
+            if (i >= 2) hashes.push_back(hash(t));
+        }
+        std::sort(hashes.begin(), hashes.end());
+        hashes.erase(std::unique(hashes.begin(), hashes.end()), hashes.end());
+        return hashes;
     }
 
-    void undo() {
-        if (!undoStack.empty()) {
-            // Save current state to redo stack
-            redoStack.push(lines);
-            
-            // Restore previous state
-            lines = undoStack.top();
-            undoStack.pop();
+    bool mayContain(int c, const std::vector<uint32_t> &hashes) const {
+        const Chunk &chunk = chunks[c];
+        if (chunk.dirty) return true;
+        for (uint32_t h : hashes) {
+            if (!(chunk.summary[h >> 6] & (1ULL << (h & 63)))) return false;
+        }
+        return true;
+    }
 
-            // Adjust cursor if needed
-            cursorY = std::min(cursorY, (int)lines.size() - 1);
-            cursorX = std::min(cursorX, (int)lines[cursorY].length());
+    size_t memoryBytes() const {
+        size_t bytes = 0;
+        for (int c = 0; c < chunks.count(); ++c) {
+            bytes += sizeof(Chunk) + chunks[c].summary.size() * sizeof(uint64_t);
         }
+        return bytes;
     }
 
-    void redo() {
-        if (!redoStack.empty()) {
-            // Save current state to undo stack
-            undoStack.push(lines);
-            
-            // Restore next state
-            lines = redoStack.top();
-            redoStack.pop();
+    int builtChunks() const {
+        int built = 0;
+        for (int c = 0; c < chunks.count(); ++c) {
+            if (!chunks[c].dirty) built++;
+        }
+        return built;
+    }
 
-            // Adjust cursor if needed
-            cursorY = std::min(cursorY, (int)lines.size() - 1);
-            cursorX = std::min(cursorX, (int)lines[cursorY].length());
+    // Only the layout reset() makes, full chunks but the last, is stored,
+    // so load() can check it against the file; an index edited out of it
+    // is built again next time.  Written to a temp file and renamed, so a
+    // crash leaves no half-written index.
+    bool save(const std::string &path, const FileKey &key) const {
+        for (int c = 0; c + 1 < chunks.count(); ++c) {
+            if (chunks[c].lines != CHUNK_LINES) return false;
+        }
+        std::string temp = path + ".pbtmp";
+        std::ofstream out(temp, std::ios::binary);
+        if (!out.is_open()) return false;
+        uint32_t header[3] = { CHUNK_LINES, SIGNATURE_BITS, (uint32_t)chunks.count() };
+        out.write(MAGIC, sizeof(MAGIC));
+        out.write((const char *)&key, sizeof(key));
+        out.write((const char *)header, sizeof(header));
+        for (int c = 0; c < chunks.count(); ++c) {
+            uint32_t lineCount = chunks[c].lines;
+            out.write((const char *)&lineCount, sizeof(lineCount));
+            out.write((const char *)chunks[c].summary.data(), SIGNATURE_BITS / 8);
+        }
+        out.close();
+        if (!out.good() || rename(temp.c_str(), path.c_str()) != 0) {
+            unlink(temp.c_str());
+            return false;
         }
+        return true;
     }
 
-    bool saveFile() {
-        std::ofstream file(fileName);
-        if (!file.is_open()) {
-            statusMessage("Error saving file!");
+    bool load(const std::string &path, const FileKey &key, int lineCount) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in.is_open()) return false;
+
+        char magic[sizeof(MAGIC)];
+        FileKey stored;
+        uint32_t header[3];
+        in.read(magic, sizeof(magic));
+        in.read((char *)&stored, sizeof(stored));
+        in.read((char *)header, sizeof(header));
+        uint32_t expected = std::max(1, (lineCount + CHUNK_LINES - 1) / CHUNK_LINES);
+        if (!in || std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 || !(stored == key) ||
+            header[0] != CHUNK_LINES || header[1] != SIGNATURE_BITS || header[2] != expected) {
             return false;
         }
 
-        for (const auto &line : lines) {
-            file << line << '\n';
+        LineChunks<Signature> loaded(CHUNK_LINES);
+        loaded.reset(lineCount);
+        int total = 0;
+        for (int c = 0; c < (int)header[2]; ++c) {
+            uint32_t lines;
+            in.read((char *)&lines, sizeof(lines));
+            if (!in || lines > CHUNK_LINES) return false;
+            loaded[c].lines = lines;
+            loaded[c].summary.resize(SIGNATURE_BITS / 64);
+            in.read((char *)loaded[c].summary.data(), SIGNATURE_BITS / 8);
+            loaded[c].dirty = false;
+            total += lines;
         }
-        file.close();
-        statusMessage("File saved successfully.");
+        if (!in || total != lineCount) return false;
+
+        chunks = loaded;
+        complete = true;
         return true;
     }
 
-    void insertChar(int ch) {
-        lines[cursorY].insert(cursorX, 1, ch);
-        cursorX++;
+private:
+    typedef LineChunks<Signature>::Chunk Chunk;
+    static constexpr char MAGIC[8] = { 'P', 'B', 'T', 'R', 'I', 'G', '0', '1' };
+
+    LineChunks<Signature> chunks;
+    bool complete;
+
+    static unsigned char fold(char ch) {
+        unsigned char c = ch;
+        return (c >= 'A' && c <= 'Z') ? c + 32 : c;
     }
 
-    void backspace() {
-        if (cursorX > 0) {
-            lines[cursorY].erase(cursorX - 1, 1);
-            cursorX--;
-        } else if (cursorY > 0) {
-            cursorX = lines[cursorY - 1].length();
-            lines[cursorY - 1] += lines[cursorY];
-            lines.erase(lines.begin() + cursorY);
-            cursorY--;
-            if (cursorY < offsetY) offsetY--;
+    static uint32_t hash(uint32_t trigram) {
+        return (trigram * 0x9E3779B1u) >> (32 - SIGNATURE_SHIFT);
+    }
+
+    void build(const std::vector<std::string> &lines, int c) {
+        Signature &sig = chunks[c].summary;
+        sig.assign(SIGNATURE_BITS / 64, 0);
+        int first = chunks.firstLine(c);
+        for (int y = first; y < first + chunks[c].lines; ++y) {
+            const std::string &line = lines[y];
+            uint32_t t = 0;
+            for (size_t i = 0; i < line.length(); ++i) {
+                t = ((t << 8) | fold(line[i])) & 0xFFFFFF;
+                if (i >= 2) {
+                    uint32_t h = hash(t);
+                    sig[h >> 6] |= 1ULL << (h & 63);
+                }
+            }
         }
+        chunks[c].dirty = false;
     }
+};
 
-    void newLine() {
-        std::string newLine = lines[cursorY].substr(cursorX);
-        lines[cursorY] = lines[cursorY].substr(0, cursorX);
-        lines.insert(lines.begin() + cursorY + 1, newLine);
-        cursorY++;
-        cursorX = 0;
-        if (cursorY >= offsetY + LINES - 2) offsetY++;
+// Read-only memory mapping of a whole file
+class MappedFile {
+public:
+    MappedFile() : data(nullptr), size(0) {}
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile() { close(); }
+
+    bool open(const std::string &path) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            ::close(fd);
+            return false;
+        }
+        size = st.st_size;
+        if (size > 0) {
+            void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                size = 0;
+                return false;
+            }
+            data = static_cast<const char *>(p);
+        }
+        ::close(fd);
+        return true;
     }
 
-    void moveUp() {
-        if (cursorY > 0) {
-            cursorY--;
-            cursorX = std::min(cursorX, (int)lines[cursorY].length());
-            if (cursorY < offsetY) offsetY--;
+    void close() {
+        if (data) munmap(const_cast<char *>(data), size);
+        data = nullptr;
+        size = 0;
+    }
+
+    const char *data;
+    size_t size;
+};
+
+// True if the buffer holds a NUL byte, which marks a file as binary
+static bool containsNul(const char *data, size_t n) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 64 <= n; i += 64) {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i)), zero);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 16)), zero);
+        __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 32)), zero);
+        __m128i d = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 48)), zero);
+        __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if (_mm_movemask_epi8(any)) return true;
+    }
+#endif
+    return std::memchr(data + i, 0, n - i) != nullptr;
+}
+
+// Character classes for word motions, as in vi: blanks, punctuation and
+// keyword characters (letters, digits, '_' and any byte of a UTF-8 sequence)
+enum CharClass { CLASS_BLANK, CLASS_PUNCT, CLASS_WORD };
+
+struct CharClassTable {
+    unsigned char cls[256];
+
+    CharClassTable() {
+        for (int c = 0; c < 256; ++c) {
+            if (c == ' ' || c == '\t') cls[c] = CLASS_BLANK;
+            else if (std::isalnum(c) || c == '_' || c >= 0x80) cls[c] = CLASS_WORD;
+            else cls[c] = CLASS_PUNCT;
         }
     }
+};
 
-    void moveDown() {
-        if (cursorY < (int)lines.size() - 1) {
-            cursorY++;
-            cursorX = std::min(cursorX, (int)lines[cursorY].length());
-            if (cursorY >= offsetY + LINES - 2) offsetY++;
+static const CharClassTable charClasses;
+
+// Class of a byte; for WORD motions everything but blanks is one class
+static inline int charClass(char c, bool bigWord) {
+    int cls = charClasses.cls[(unsigned char)c];
+    return bigWord && cls != CLASS_BLANK ? CLASS_WORD : cls;
+}
+
+#ifdef __SSE2__
+// Bit i is set when byte i of the 16 at p belongs to `cls`
+static inline unsigned classMask16(const char *p, int cls, bool bigWord) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i blank = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), 
+                                 _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+    if (cls == CLASS_BLANK) return _mm_movemask_epi8(blank);
+    if (bigWord) return ~_mm_movemask_epi8(blank) & 0xFFFF;
+
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), 
+                                  _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)), 
+                                  _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+    __m128i word = _mm_or_si128(_mm_or_si128(alpha, digit), 
+                                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('_')), 
+                                             _mm_cmplt_epi8(v, _mm_setzero_si128())));
+    unsigned mask = _mm_movemask_epi8(word);
+    if (cls == CLASS_WORD) return mask;
+    return ~(mask | _mm_movemask_epi8(blank)) & 0xFFFF;
+}
+#endif
+
+// First index at or after i whose byte is not of class `cls`
+static size_t classRunEnd(const std::string &s, size_t i, int cls, bool bigWord) {
+    const char *p = s.data();
+#ifdef __SSE2__
+    for (; i + 16 <= s.length(); i += 16) {
+        unsigned outside = ~classMask16(p + i, cls, bigWord) & 0xFFFF;
+        if (outside) return i + __builtin_ctz(outside);
+    }
+#endif
+    while (i < s.length() && charClass(p[i], bigWord) == cls) i++;
+    return i;
+}
+
+// First index of the run of class `cls` that ends at i
+static size_t classRunStart(const std::string &s, size_t i, int cls, bool bigWord) {
+    const char *p = s.data();
+#ifdef __SSE2__
+    while (i >= 16) {
+        unsigned outside = ~classMask16(p + i - 16, cls, bigWord) & 0xFFFF;
+        if (outside) return i - 16 + (32 - __builtin_clz(outside));
+        i -= 16;
+    }
+#endif
+    while (i > 0 && charClass(p[i - 1], bigWord) == cls) i--;
+    return i;
+}
+
+// Runs work(begin, end) over [0, n) split into one slice per core; small
+// inputs stay on the calling thread
+template <typename F>
+static void parallelFor(size_t n, F work) {
+    size_t slices = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), n / 16384 + 1);
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < slices; ++i) {
+        pool.emplace_back(work, n * i / slices, n * (i + 1) / slices);
+    }
+    work(0, n / slices);
+    for (std::thread &t : pool) t.join();
+}
+
+// Stable sort on all cores: every slice is sorted on its own thread, then
+// neighbouring runs are merged pairwise, in parallel, until one is left
+template <typename T, typename Compare>
+static void parallelSort(std::vector<T> &items, Compare less) {
+    size_t n = items.size();
+    size_t slices = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), n / 16384 + 1);
+    std::vector<size_t> bounds;
+    for (size_t i = 0; i <= slices; ++i) bounds.push_back(n * i / slices);
+
+    std::vector<std::thread> pool;
+    for (size_t i = 0; i < slices; ++i) {
+        pool.emplace_back([&, i] { 
+            std::stable_sort(items.begin() + bounds[i], items.begin() + bounds[i + 1], less); 
+        });
+    }
+    for (std::thread &t : pool) t.join();
+
+    for (size_t width = 1; width < slices; width *= 2) {
+        pool.clear();
+        for (size_t i = 0; i + width < slices; i += 2 * width) {
+            size_t end = bounds[std::min(i + 2 * width, slices)];
+            pool.emplace_back([&, i, width, end] {
+                std::inplace_merge(items.begin() + bounds[i], items.begin() + bounds[i + width], 
+                                   items.begin() + end, less);
+            });
         }
+        for (std::thread &t : pool) t.join();
     }
+}
 
-    void moveLeft() {
-        if (cursorX > 0) {
-            cursorX--;
-        } else if (cursorY > 0) {
-            cursorY--;
-            cursorX = lines[cursorY].length();
-            if (cursorY < offsetY) offsetY--;
+// Searches a directory tree on all cores for `:grep`.  Every worker owns a
+// deque of pending directories and files and steals from the others once it
+// runs dry.  Matches are handed over through a locked queue so the quickfix
+// list fills in while the search is still running.
+class ParallelGrep {
+public:
+    struct Match {
+        std::string file;
+        int line, col;
+        std::string text;
+    };
+
+    std::atomic<long long> filesSearched, filesSkipped, matchCount;
+
+    ParallelGrep() : filesSearched(0), filesSkipped(0), matchCount(0), 
+                     pending(0), cancelled(false), finished(true) {}
+    ~ParallelGrep() { cancel(); join(); }
+
+    void start(const std::string &needle, const std::string &root) {
+        cancel();
+        join();
+        pattern = needle;
+        filesSearched = filesSkipped = matchCount = 0;
+        cancelled = false;
+        finished = false;
+        results.clear();
+
+        int count = std::max(1u, std::thread::hardware_concurrency());
+        queues.clear();
+        for (int i = 0; i < count; ++i) queues.emplace_back(new TaskQueue());
+        pending = 1;
+        // A file as the root is searched on its own
+        struct stat st;
+        queues[0]->tasks.push_back({root, stat(root.c_str(), &st) != 0 || S_ISDIR(st.st_mode)});
+        for (int i = 0; i < count; ++i) {
+            workers.emplace_back(&ParallelGrep::work, this, i);
+        }
+    }
+
+    void cancel() {
+        cancelled = true;
+        wake(true);
+    }
+
+    bool running() const { return !finished; }
+    bool wasCancelled() const { return cancelled; }
+
+    // Moves the matches found so far to `out`, joining the workers once done
+    void drain(std::vector<Match> &out) {
+        {
+            std::lock_guard<std::mutex> guard(resultLock);
+            for (auto &m : results) out.push_back(std::move(m));
+            results.clear();
+        }
+        if (!finished && (pending == 0 || cancelled)) {
+            join();
+            finished = true;
+        }
+    }
+
+private:
+    struct Task {
+        std::string path;
+        bool directory;
+    };
+
+    struct TaskQueue {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    std::string pattern;
+    std::vector<std::unique_ptr<TaskQueue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<long long> pending;
+    std::atomic<bool> cancelled, finished;
+    // Idle workers sleep here until there is work or the search is over
+    std::mutex idleLock;
+    std::condition_variable idle;
+    std::mutex resultLock;
+    std::vector<Match> results;
+
+    void join() {
+        for (auto &t : workers) t.join();
+        workers.clear();
+        pending = 0;
+    }
+
+    void push(int id, Task task) {
+        pending++;
+        {
+            std::lock_guard<std::mutex> guard(queues[id]->lock);
+            queues[id]->tasks.push_back(std::move(task));
+        }
+        wake(false);
+    }
+
+    // Taking idleLock first means a worker between checking for work and
+    // waiting cannot miss the notification
+    void wake(bool all) {
+        std::lock_guard<std::mutex> guard(idleLock);
+        if (all) idle.notify_all();
+        else idle.notify_one();
+    }
+
+    bool queued() {
+        for (auto &q : queues) {
+            std::lock_guard<std::mutex> guard(q->lock);
+            if (!q->tasks.empty()) return true;
+        }
+        return false;
+    }
+
+    // Own queue is used LIFO, others are robbed from the front
+    bool take(int id, Task &task) {
+        for (size_t i = 0; i < queues.size(); ++i) {
+            TaskQueue &q = *queues[(id + i) % queues.size()];
+            std::lock_guard<std::mutex> guard(q.lock);
+            if (q.tasks.empty()) continue;
+            if (i == 0) {
+                task = std::move(q.tasks.back());
+                q.tasks.pop_back();
+            } else {
+                task = std::move(q.tasks.front());
+                q.tasks.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void work(int id) {
+        Task task;
+        while (!cancelled && pending > 0) {
+            if (!take(id, task)) {
+                std::unique_lock<std::mutex> guard(idleLock);
+                idle.wait(guard, [this] { return cancelled || pending == 0 || queued(); });
+                continue;
+            }
+            if (task.directory) {
+                listDirectory(id, task.path);
+            } else {
+                searchFile(task.path);
+            }
+            // The last task done lets every worker finish
+            if (--pending == 0) wake(true);
+        }
+    }
+
+    void listDirectory(int id, const std::string &path) {
+        DIR *dir = opendir(path.c_str());
+        if (!dir) return;
+        while (struct dirent *entry = readdir(dir)) {
+            // Hidden entries (.git and friends) are skipped like in most grep tools
+            if (entry->d_name[0] == '.') continue;
+            std::string child = path == "/" ? "/" + std::string(entry->d_name) 
+                                            : path + "/" + entry->d_name;
+            unsigned char type = entry->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                if (lstat(child.c_str(), &st) != 0) continue;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+            }
+            if (type == DT_DIR) {
+                push(id, {child, true});
+            } else if (type == DT_REG) {
+                push(id, {child, false});
+            }
+        }
+        closedir(dir);
+    }
+
+    void searchFile(const std::string &path) {
+        MappedFile file;
+        if (!file.open(path)) return;
+        if (containsNul(file.data, std::min<size_t>(file.size, 64 * 1024))) {
+            filesSkipped++;
+            return;
+        }
+        filesSearched++;
+
+        std::vector<Match> found;
+        const char *begin = file.data, *end = file.data + file.size;
+        const char *counted = begin;
+        int line = 1;
+        const char *p = begin;
+        while (!cancelled && p < end) {
+            const char *hit = static_cast<const char *>(
+                memmem(p, end - p, pattern.data(), pattern.size()));
+            if (!hit) break;
+            line += std::count(counted, hit, '\n');
+            counted = hit;
+
+            const char *lineStart = hit;
+            while (lineStart > begin && lineStart[-1] != '\n') lineStart--;
+            const char *lineEnd = static_cast<const char *>(std::memchr(hit, '\n', end - hit));
+            if (!lineEnd) lineEnd = end;
+
+            std::string text(lineStart, std::min<size_t>(lineEnd - lineStart, 200));
+            found.push_back({path, line, (int)(hit - lineStart), text});
+            p = lineEnd + 1;
+        }
+
+        if (!found.empty()) {
+            matchCount += found.size();
+            std::lock_guard<std::mutex> guard(resultLock);
+            for (auto &m : found) results.push_back(std::move(m));
+        }
+    }
+};
+
+// Bracket depth summaries for `%` and match highlighting.  Every chunk
+// records, for both lexer states it can start in (code or inside a block
+// comment), the net depth change and the lowest prefix and highest suffix
+// depth of each bracket kind.  A segment tree over the chunks finds the
+// chunk where the depth returns to a bracket's level in O(log n), so only
+// two chunks are ever scanned.  Brackets in strings and comments are ignored.
+class BracketIndex {
+public:
+    static const int CHUNK_LINES = 256;
+    static const int KINDS = 3;
+
+    BracketIndex() : chunks(CHUNK_LINES), treeVersion(~0u), treeSize(0) {}
+
+    void reset(int lineCount) { chunks.reset(lineCount); }
+    void linesChanged(int y, int n) { chunks.markDirty(y, n); }
+    void linesInserted(int y, int n) { chunks.linesInserted(y, n); }
+    void linesErased(int y, int n) { chunks.linesErased(y, n); }
+
+    // Bracket kind (0-2) of a character and whether it opens, -1 if none
+    static int kindOf(char c, int &dir) {
+        const char *opens = "([{", *closes = ")]}";
+        for (int k = 0; k < KINDS; ++k) {
+            if (c == opens[k]) { dir = 1; return k; }
+            if (c == closes[k]) { dir = -1; return k; }
+        }
+        return -1;
+    }
+
+    // Reports the code brackets of a line, skipping string literals and
+    // comments; returns whether the line ends inside a block comment
+    template <typename F>
+    static bool lexLine(const std::string &line, bool inComment, F onBracket) {
+        size_t n = line.length();
+        for (size_t i = 0; i < n; ++i) {
+            char c = line[i];
+            if (inComment) {
+                if (c == '*' && i + 1 < n && line[i + 1] == '/') {
+                    inComment = false;
+                    i++;
+                }
+                continue;
+            }
+            int dir, kind;
+            switch (c) {
+                case '/':
+                    if (i + 1 < n && line[i + 1] == '/') return false;
+                    if (i + 1 < n && line[i + 1] == '*') {
+                        inComment = true;
+                        i++;
+                    }
+                    break;
+                case '"':
+                    for (i++; i < n && line[i] != '"'; ++i) {
+                        if (line[i] == '\\') i++;
+                    }
+                    break;
+                case '\'':
+                    // Only short character literals, so apostrophes in prose are harmless
+                    if (i + 2 < n && line[i + 1] != '\\' && line[i + 2] == '\'') {
+                        i += 2;
+                    } else if (i + 1 < n && line[i + 1] == '\\') {
+                        size_t close = line.find('\'', i + 3);
+                        if (close != std::string::npos && close <= i + 8) i = close;
+                    }
+                    break;
+                default:
+                    kind = kindOf(c, dir);
+                    if (kind >= 0) onBracket((int)i, kind, dir);
+            }
+        }
+        return inComment;
+    }
+
+    // Moves y/x to the bracket matching the one at y/x
+    bool findMatch(const std::vector<std::string> &lines, int &y, int &x) {
+        int dir, kind = kindOf(lines[y][x], dir);
+        if (kind < 0) return false;
+        refresh(lines);
+
+        int c = chunks.chunkOf(y);
+        bool state = stateBefore(c);
+        std::vector<Event> events;
+        bool exitState = collect(lines, c, state, kind, events);
+        int at = -1;
+        for (int i = 0; i < (int)events.size(); ++i) {
+            if (events[i].y == y && events[i].x == x) at = i;
+        }
+        if (at < 0) return false;  // inside a string or comment
+
+        if (dir > 0) {
+            int depth = 0;
+            for (int i = at; i < (int)events.size(); ++i) {
+                depth += events[i].dir;
+                if (depth == 0) return found(events[i], y, x);
+            }
+            int acc = 0;
+            int j = descendForward(1, 0, treeSize, c + 1, exitState, acc, kind, depth);
+            if (j < 0 || j >= chunks.count()) return false;
+            collect(lines, j, exitState, kind, events);
+            depth += acc;
+            for (const Event &e : events) {
+                depth += e.dir;
+                if (depth == 0) return found(e, y, x);
+            }
+        } else {
+            int unmatched = 0;
+            for (int i = at; i >= 0; --i) {
+                unmatched -= events[i].dir;
+                if (unmatched == 0) return found(events[i], y, x);
+            }
+            int acc = 0;
+            int j = descendBackward(1, 0, treeSize, c, acc, kind, unmatched);
+            if (j < 0) return false;
+            collect(lines, j, stateBefore(j), kind, events);
+            unmatched -= acc;
+            for (int i = events.size() - 1; i >= 0; --i) {
+                unmatched -= events[i].dir;
+                if (unmatched == 0) return found(events[i], y, x);
+            }
+        }
+        return false;
+    }
+
+private:
+    static constexpr int INF = 1 << 29;
+
+    struct Depths {
+        int delta, minPrefix, maxSuffix;
+    };
+
+    struct Side {
+        bool exitComment;
+        Depths kind[KINDS];
+    };
+
+    struct Summary {
+        Side side[2];
+    };
+
+    struct Event {
+        int y, x, dir;
+    };
+
+    LineChunks<Summary> chunks;
+    std::vector<Summary> tree;
+    unsigned treeVersion;
+    int treeSize;
+
+    static bool found(const Event &e, int &y, int &x) {
+        y = e.y;
+        x = e.x;
+        return true;
+    }
+
+    static Summary identity() {
+        Summary s;
+        for (int st = 0; st < 2; ++st) {
+            s.side[st].exitComment = st;
+            for (int k = 0; k < KINDS; ++k) s.side[st].kind[k] = {0, INF, -INF};
+        }
+        return s;
+    }
+
+    static Summary combine(const Summary &a, const Summary &b) {
+        Summary s;
+        for (int st = 0; st < 2; ++st) {
+            const Side &l = a.side[st];
+            const Side &r = b.side[l.exitComment];
+            s.side[st].exitComment = r.exitComment;
+            for (int k = 0; k < KINDS; ++k) {
+                const Depths &dl = l.kind[k], &dr = r.kind[k];
+                s.side[st].kind[k] = { dl.delta + dr.delta,
+                                       std::min(dl.minPrefix, dl.delta + dr.minPrefix),
+                                       std::max(dr.maxSuffix, dr.delta + dl.maxSuffix) };
+            }
+        }
+        return s;
+    }
+
+    Summary summarize(const std::vector<std::string> &lines, int c) {
+        Summary s;
+        int first = chunks.firstLine(c);
+        for (int st = 0; st < 2; ++st) {
+            int depth[KINDS] = {0}, lowest[KINDS], lowestBefore[KINDS];
+            std::fill(lowest, lowest + KINDS, INF);
+            std::fill(lowestBefore, lowestBefore + KINDS, INF);
+            bool state = st;
+            for (int y = first; y < first + chunks[c].lines; ++y) {
+                state = lexLine(lines[y], state, [&](int, int k, int dir) {
+                    lowestBefore[k] = std::min(lowestBefore[k], depth[k]);
+                    depth[k] += dir;
+                    lowest[k] = std::min(lowest[k], depth[k]);
+                });
+            }
+            s.side[st].exitComment = state;
+            for (int k = 0; k < KINDS; ++k) {
+                int highestSuffix = lowestBefore[k] == INF ? -INF : depth[k] - lowestBefore[k];
+                s.side[st].kind[k] = {depth[k], lowest[k], highestSuffix};
+            }
+        }
+        return s;
+    }
+
+    // Brackets of one kind in chunk c, returns the lexer state after it
+    bool collect(const std::vector<std::string> &lines, int c, bool state, int kind, 
+                 std::vector<Event> &events) {
+        events.clear();
+        int first = chunks.firstLine(c);
+        for (int y = first; y < first + chunks[c].lines; ++y) {
+            state = lexLine(lines[y], state, [&](int x, int k, int dir) {
+                if (k == kind) events.push_back({y, x, dir});
+            });
+        }
+        return state;
+    }
+
+    void refresh(const std::vector<std::string> &lines) {
+        chunks.split();
+        bool rebuild = treeVersion != chunks.version();
+        if (rebuild) {
+            treeSize = 1;
+            while (treeSize < chunks.count()) treeSize *= 2;
+            tree.assign(2 * treeSize, identity());
+            treeVersion = chunks.version();
+        }
+
+        for (int c = 0; c < chunks.count(); ++c) {
+            if (!chunks[c].dirty && !rebuild) continue;
+            if (chunks[c].dirty) {
+                chunks[c].summary = summarize(lines, c);
+                chunks[c].dirty = false;
+            }
+            tree[treeSize + c] = chunks[c].summary;
+            if (!rebuild) {
+                for (int node = (treeSize + c) / 2; node >= 1; node /= 2) {
+                    tree[node] = combine(tree[2 * node], tree[2 * node + 1]);
+                }
+            }
+        }
+
+        if (rebuild) {
+            for (int node = treeSize - 1; node >= 1; --node) {
+                tree[node] = combine(tree[2 * node], tree[2 * node + 1]);
+            }
+        }
+    }
+
+    // Lexer state at the start of chunk c
+    bool stateBefore(int c) {
+        bool state = false;
+        int node = 1, lo = 0, hi = treeSize;
+        while (hi - lo > 1) {
+            int mid = (lo + hi) / 2;
+            if (c < mid) {
+                node = 2 * node;
+                hi = mid;
+            } else {
+                state = tree[2 * node].side[state].exitComment;
+                node = 2 * node + 1;
+                lo = mid;
+            }
+        }
+        return state;
+    }
+
+    // First chunk at or after `from` where the running depth, starting at
+    // `need` unmatched openers, drops to zero
+    int descendForward(int node, int lo, int hi, int from, bool &state, int &acc, 
+                       int kind, int need) {
+        if (hi <= from) return -1;
+        if (lo >= from) {
+            const Side &side = tree[node].side[state];
+            if (acc + side.kind[kind].minPrefix > -need) {
+                acc += side.kind[kind].delta;
+                state = side.exitComment;
+                return -1;
+            }
+            if (hi - lo == 1) return lo;
+        }
+        int mid = (lo + hi) / 2;
+        int j = descendForward(2 * node, lo, mid, from, state, acc, kind, need);
+        if (j >= 0) return j;
+        return descendForward(2 * node + 1, mid, hi, from, state, acc, kind, need);
+    }
+
+    // Last chunk before `before` where `need` unmatched closers are balanced
+    int descendBackward(int node, int lo, int hi, int before, int &acc, int kind, int need) {
+        if (lo >= before) return -1;
+        if (hi <= before) {
+            const Side &side = tree[node].side[stateBefore(lo)];
+            if (acc + side.kind[kind].maxSuffix < need) {
+                acc += side.kind[kind].delta;
+                return -1;
+            }
+            if (hi - lo == 1) return lo;
+        }
+        int mid = (lo + hi) / 2;
+        int j = descendBackward(2 * node + 1, mid, hi, before, acc, kind, need);
+        if (j >= 0) return j;
+        return descendBackward(2 * node, lo, mid, before, acc, kind, need);
+    }
+};
+
+// Sparse index from log timestamps to lines for :time.  Every chunk keeps
+// the stamp of its first stamped line, so a lookup binary-searches the
+// chunks and then scans one of them: it reads one line per chunk whose
+// summary is stale plus one chunk, however long the log.  The stamp format
+// is detected from the first stamped line: ISO 8601 ("2026-10-16T14:32:05"
+// or with a space), syslog ("Oct 16 14:32:05") or a bare time, each
+// optionally inside [ ].
+class TimeIndex {
+public:
+    static const int CHUNK_LINES = 512;   // about 64 KB of a typical log
+    static const uint64_t NONE = ~0ULL;
+    static const uint64_t DAY = 1000000000ULL;   // hhmmssfff
+
+    enum Format { UNKNOWN, ISO, SYSLOG, CLOCK };
+
+    TimeIndex() : chunks(CHUNK_LINES), format(UNKNOWN) {}
+
+    void reset(int lineCount) {
+        chunks.reset(lineCount);
+        format = UNKNOWN;
+    }
+    void linesChanged(int y, int n) { chunks.markDirty(y, n); }
+    void linesInserted(int y, int n) { chunks.linesInserted(y, n); }
+    void linesErased(int y, int n) { chunks.linesErased(y, n); }
+
+    Format detected() const { return format; }
+
+    // Reads a stamp at the start of s as YYYYMMDDhhmmssfff, so that keys
+    // compare as the times do; fields it lacks are 0.  With `format`
+    // UNKNOWN any format is accepted and the one found stored there.
+    static bool parse(const std::string &s, Format &format, uint64_t &key) {
+        const char *start = s.data() + (!s.empty() && s[0] == '['), *end = s.data() + s.length();
+        const char *p = start;
+        int year = 0, month = 0, day = 0;
+        bool found = false;
+        if (format == UNKNOWN || format == ISO) {
+            found = digits(p, end, 4, year) && lit(p, end, '-') && digits(p, end, 2, month) && 
+                    lit(p, end, '-') && digits(p, end, 2, day);
+            if (found) {
+                format = ISO;
+                if (p < end && (*p == 'T' || *p == ' ')) ++p;
+            }
+        }
+        if (!found && (format == UNKNOWN || format == SYSLOG)) {
+            p = start;
+            found = monthName(p, end, month);
+            while (found && p < end && *p == ' ') ++p;
+            found = found && (digits(p, end, 2, day) || digits(p, end, 1, day)) && lit(p, end, ' ');
+            if (found) format = SYSLOG;
+        }
+        if (!found && (format == UNKNOWN || format == CLOCK)) {
+            p = start;
+            const char *q = p;
+            int hour, minute;
+            found = digits(q, end, 2, hour) && lit(q, end, ':') && digits(q, end, 2, minute);
+            if (found) format = CLOCK;
+        }
+        if (!found) return false;
+
+        int hour = 0, minute = 0, second = 0, millis = 0;
+        if (digits(p, end, 2, hour) && lit(p, end, ':') && digits(p, end, 2, minute) && 
+            lit(p, end, ':') && digits(p, end, 2, second) && (lit(p, end, '.') || lit(p, end, ','))) {
+            for (int place = 100; place > 0 && p < end && std::isdigit((unsigned char)*p); place /= 10) {
+                millis += (*p++ - '0') * place;
+            }
+        }
+        key = ((((uint64_t)year * 100 + month) * 100 + day) * 100 + hour) * 100 + minute;
+        key = (key * 100 + second) * 1000 + millis;
+        return true;
+    }
+
+    // First line stamped at or after `key`, -1 if every stamp is before it
+    int find(const std::vector<std::string> &lines, uint64_t key) {
+        refresh(lines);
+        if (format == UNKNOWN) return -1;
+        std::vector<int> stamped;
+        for (int c = 0; c < chunks.count(); ++c) {
+            if (chunks[c].summary != NONE) stamped.push_back(c);
+        }
+        if (stamped.empty()) return -1;
+        auto after = std::partition_point(stamped.begin(), stamped.end(), 
+                                          [&](int c) { return chunks[c].summary < key; });
+        // The line is in the last chunk starting before the key, or else it
+        // is the first stamp of the next one
+        int y = chunks.firstLine(after == stamped.begin() ? *after : after[-1]);
+        int stop = after == stamped.end() ? lines.size() : chunks.firstLine(*after) + chunks[*after].lines;
+        for (; y < stop; ++y) {
+            uint64_t stamp;
+            if (parse(lines[y], format, stamp) && stamp >= key) return y;
+        }
+        return -1;
+    }
+
+    // Stamp of line y, or of the closest stamped line above it
+    bool stampBefore(const std::vector<std::string> &lines, int y, uint64_t &key) {
+        refresh(lines);
+        if (format == UNKNOWN) return false;
+        for (int c = chunks.chunkOf(y); c >= 0; --c) {
+            if (chunks[c].summary == NONE) continue;
+            int first = chunks.firstLine(c);
+            for (int line = std::min(y, first + chunks[c].lines - 1); line >= first; --line) {
+                if (parse(lines[line], format, key)) return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    LineChunks<uint64_t> chunks;
+    Format format;
+
+    void refresh(const std::vector<std::string> &lines) {
+        if (format == UNKNOWN) {
+            // Detected on the first stamped line near the top
+            uint64_t key;
+            for (int y = 0; y < (int)lines.size() && y < 1000 && !parse(lines[y], format, key); ++y) {}
+            if (format == UNKNOWN) return;
+            chunks.reset(lines.size());
+        }
+        chunks.split();
+        for (int c = 0; c < chunks.count(); ++c) {
+            if (!chunks[c].dirty) continue;
+            int y = chunks.firstLine(c), end = y + chunks[c].lines;
+            chunks[c].summary = NONE;
+            for (uint64_t key; y < end; ++y) {
+                if (parse(lines[y], format, key)) {
+                    chunks[c].summary = key;
+                    break;
+                }
+            }
+            chunks[c].dirty = false;
+        }
+    }
+
+    static bool digits(const char *&p, const char *end, int n, int &value) {
+        if (end - p < n) return false;
+        int v = 0;
+        for (int i = 0; i < n; ++i) {
+            if (!std::isdigit((unsigned char)p[i])) return false;
+            v = v * 10 + (p[i] - '0');
+        }
+        value = v;
+        p += n;
+        return true;
+    }
+
+    static bool lit(const char *&p, const char *end, char c) {
+        if (p >= end || *p != c) return false;
+        ++p;
+        return true;
+    }
+
+    static bool monthName(const char *&p, const char *end, int &month) {
+        static const char names[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+        if (end - p < 4 || p[3] != ' ') return false;
+        for (int m = 0; m < 12; ++m) {
+            if (memcmp(p, names + 3 * m, 3) == 0) {
+                month = m + 1;
+                p += 3;
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// Field boundaries of delimited lines (CSV, TSV, ...) for :csv.  A line
+// is scanned 16 bytes at a time: quotes and delimiters become bitmasks, a
+// prefix XOR of the quote mask marks the bytes inside quotes, and the
+// delimiters there are dropped without a branch per byte.  A doubled quote
+// toggles twice, so "" needs no special case.  Only the lines on screen
+// and those an edit or sort touches are ever split; a quoted field is
+// taken to end at its line break.
+class ColumnLayout {
+public:
+    static constexpr int MAX_WIDTH = 40;      // wider fields are cut on screen
+    static constexpr int SAMPLE_LINES = 100;  // lines the delimiter is guessed from
+
+    ColumnLayout() : delimiter(0), quote(0) {}
+
+    bool active() const { return delimiter != 0; }
+    char separator() const { return delimiter; }
+    char quoting() const { return quote; }
+
+    void set(char d, char q) {
+        delimiter = d;
+        quote = q;
+    }
+    void clear() { delimiter = 0; }
+
+    // Picks the delimiter that splits most of the first lines into the same
+    // number of fields, and quoting if a field there starts with a quote
+    bool detect(const std::vector<std::string> &lines) {
+        static const char candidates[] = {',', '\t', ';', '|'};
+        int sample = std::min<int>(lines.size(), SAMPLE_LINES);
+        char best = 0;
+        size_t bestAgreeing = 0;
+        std::vector<int> starts, counts;
+        for (char c : candidates) {
+            ColumnLayout trial;
+            trial.set(c, '"');
+            counts.clear();
+            for (int y = 0; y < sample; ++y) {
+                if (lines[y].empty()) continue;
+                trial.fieldStarts(lines[y], starts);
+                counts.push_back(starts.size());
+            }
+            std::sort(counts.begin(), counts.end());
+            // The most common field count and how many lines have it
+            size_t agreeing = 0;
+            int common = 0;
+            for (size_t i = 0, j; i < counts.size(); i = j) {
+                for (j = i; j < counts.size() && counts[j] == counts[i]; ++j) {}
+                if (j - i > agreeing) {
+                    agreeing = j - i;
+                    common = counts[i];
+                }
+            }
+            if (common > 1 && 2 * agreeing > counts.size() && agreeing > bestAgreeing) {
+                best = c;
+                bestAgreeing = agreeing;
+            }
+        }
+        if (!best) return false;
+        set(best, detectQuote(lines, best));
+        return true;
+    }
+
+    // '"' if a field of the first lines starts with one, else no quoting
+    static char detectQuote(const std::vector<std::string> &lines, char d) {
+        int sample = std::min<int>(lines.size(), SAMPLE_LINES);
+        for (int y = 0; y < sample; ++y) {
+            const std::string &line = lines[y];
+            for (size_t i = 0; i < line.length(); ++i) {
+                if (line[i] == '"' && (i == 0 || line[i - 1] == d)) return '"';
+            }
+        }
+        return 0;
+    }
+
+    // Offsets where the fields of `line` start, the first always 0
+    void fieldStarts(const std::string &line, std::vector<int> &starts) const {
+        starts.assign(1, 0);
+        const char *p = line.data();
+        size_t n = line.length(), i = 0;
+        bool inside = false;
+#ifdef __SSE2__
+        const __m128i delimiters = _mm_set1_epi8(delimiter), quotes = _mm_set1_epi8(quote);
+        for (; i + 16 <= n; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+            unsigned found = _mm_movemask_epi8(_mm_cmpeq_epi8(v, delimiters));
+            unsigned quoted = quote ? _mm_movemask_epi8(_mm_cmpeq_epi8(v, quotes)) : 0;
+            // Bit k: an odd number of quotes up to byte k, counting the
+            // blocks before
+            quoted ^= quoted << 1;
+            quoted ^= quoted << 2;
+            quoted ^= quoted << 4;
+            quoted ^= quoted << 8;
+            if (inside) quoted = ~quoted;
+            quoted &= 0xFFFF;
+            inside = quoted >> 15;
+            for (found &= ~quoted; found; found &= found - 1) starts.push_back(i + __builtin_ctz(found) + 1);
+        }
+#endif
+        for (; i < n; ++i) {
+            if (p[i] == quote && quote) inside = !inside;
+            else if (p[i] == delimiter && !inside) starts.push_back(i + 1);
+        }
+    }
+
+    // Field holding byte x, given the line's field starts
+    static int fieldAt(const std::vector<int> &starts, int x) {
+        return std::upper_bound(starts.begin(), starts.end(), x) - starts.begin() - 1;
+    }
+
+    // End of field f, before the delimiter that follows it
+    static int fieldEnd(const std::string &line, const std::vector<int> &starts, size_t f) {
+        return f + 1 < starts.size() ? starts[f + 1] - 1 : line.length();
+    }
+
+    // Text of field f without its quotes, empty when the line is shorter
+    std::string_view fieldText(const std::string &line, const std::vector<int> &starts, size_t f) const {
+        if (f >= starts.size()) return std::string_view();
+        int begin = starts[f], end = fieldEnd(line, starts, f);
+        if (quote && end - begin >= 2 && line[begin] == quote && line[end - 1] == quote) {
+            begin++;
+            end--;
+        }
+        return std::string_view(line.data() + begin, end - begin);
+    }
+
+    // Widens `widths` to fit the fields of `line`
+    void measure(const std::string &line, std::vector<int> &widths) const {
+        std::vector<int> starts;
+        fieldStarts(line, starts);
+        if (widths.size() < starts.size()) widths.resize(starts.size(), 0);
+        for (size_t f = 0; f < starts.size(); ++f) {
+            widths[f] = std::max(widths[f], std::min(fieldEnd(line, starts, f) - starts[f], MAX_WIDTH));
+        }
+    }
+
+    // The line as shown: fields padded to `widths` with " | " between
+    // them; a field cut short ends in '>', the last one is never cut
+    std::string render(const std::string &line, const std::vector<int> &widths) const {
+        std::vector<int> starts;
+        fieldStarts(line, starts);
+        std::string shown;
+        for (size_t f = 0; f < starts.size(); ++f) {
+            int length = fieldEnd(line, starts, f) - starts[f];
+            if (f + 1 == starts.size()) {
+                shown.append(line, starts[f], length);
+                break;
+            }
+            int width = shownWidth(widths, f, length);
+            shown.append(line, starts[f], std::min(length, width));
+            if (length > width && width > 0) shown.back() = '>';
+            shown.append(width - std::min(length, width), ' ');
+            shown += " | ";
+        }
+        return shown;
+    }
+
+    // Column of byte x of `line` in render(); the delimiter after a field
+    // is shown as its '|'
+    int screenX(const std::string &line, int x, const std::vector<int> &widths) const {
+        std::vector<int> starts;
+        fieldStarts(line, starts);
+        int column = 0;
+        for (size_t f = 0; f < starts.size(); ++f) {
+            if (f + 1 == starts.size()) return column + x - starts[f];
+            int length = fieldEnd(line, starts, f) - starts[f];
+            int width = shownWidth(widths, f, length);
+            if (x < starts[f + 1]) {
+                int offset = x - starts[f];
+                if (offset == length) return column + width + 1;
+                return column + std::min(offset, std::max(0, width - 1));
+            }
+            column += width + 3;
+        }
+        return column;
+    }
+
+private:
+    char delimiter, quote;
+
+    static int shownWidth(const std::vector<int> &widths, size_t f, int length) {
+        return f < widths.size() ? widths[f] : std::min(length, MAX_WIDTH);
+    }
+};
+
+// Positions that follow the text as it is edited: marks, the jump list and
+// later cursors.  Anchors sit in a treap ordered by (line, column) and
+// every node carries a pending shift for its subtree, so an edit moves all
+// anchors behind it with a split, one lazy update and a merge - O(log n)
+// however many anchors there are.
+class AnchorTree {
+public:
+    typedef int Handle;
+
+    AnchorTree() : root(-1), freeList(-1), seed(0x9E3779B9u), count(0) {}
+
+    int size() const { return count; }
+
+    Handle add(int y, int x) {
+        Handle h;
+        if (freeList >= 0) {
+            h = freeList;
+            freeList = nodes[h].left;
+        } else {
+            h = nodes.size();
+            nodes.emplace_back();
+        }
+        Node &n = nodes[h];
+        seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+        n.priority = seed;
+        n.left = n.right = n.parent = -1;
+        n.shift = Shift();
+        n.live = true;
+        insert(h, y, x);
+        count++;
+        return h;
+    }
+
+    void remove(Handle h) {
+        if (h < 0 || !nodes[h].live) return;
+        unlink(h);
+        nodes[h].live = false;
+        nodes[h].left = freeList;
+        freeList = h;
+        count--;
+    }
+
+    void get(Handle h, int &y, int &x) {
+        pushPath(h);
+        y = nodes[h].y;
+        x = nodes[h].x;
+    }
+
+    void set(Handle h, int y, int x) {
+        unlink(h);
+        insert(h, y, x);
+    }
+
+    // Lines inserted before line y push everything at or after it down
+    void insertLines(int y, int n) {
+        int a, b;
+        split(root, y, 0, a, b);
+        applyShift(b, Shift::move(n, 0));
+        root = join(a, b);
+    }
+
+    // Anchors inside the erased lines collapse onto the start of line y
+    void eraseLines(int y, int n) {
+        int a, b, c;
+        split(root, y, 0, a, b);
+        split(b, y + n, 0, b, c);
+        applyShift(b, Shift::place(y, 0));
+        applyShift(c, Shift::move(-n, 0));
+        root = join(join(a, b), c);
+    }
+
+    void insertColumns(int y, int x, int n) {
+        int a, b, c;
+        split(root, y, x, a, b);
+        split(b, y + 1, 0, b, c);
+        applyShift(b, Shift::move(0, n));
+        root = join(join(a, b), c);
+    }
+
+    void eraseColumns(int y, int x, int n) {
+        int a, b, c, d;
+        split(root, y, x, a, b);
+        split(b, y, x + n, b, c);
+        split(c, y + 1, 0, c, d);
+        applyShift(b, Shift::placeColumn(x));
+        applyShift(c, Shift::move(0, -n));
+        root = join(join(a, b), join(c, d));
+    }
+
+    // Moves anchors at or right of y/x to line toY, adding dx to their
+    // columns; toY must not hold anchors that would end up out of order
+    void moveTail(int y, int x, int toY, int dx) {
+        int a, b, c;
+        split(root, y, x, a, b);
+        split(b, y + 1, 0, b, c);
+        applyShift(b, Shift::move(toY - y, dx));
+        root = join(join(a, b), c);
+    }
+
+    // Passes every anchor through f(y, x) in one walk, for edits made in
+    // many places at once.  f must keep the anchors in order, which any
+    // edit mapping old positions to new ones does, so the treap is untouched
+    template <typename F>
+    void remap(F f) {
+        std::vector<int> pending;
+        if (root >= 0) pending.push_back(root);
+        while (!pending.empty()) {
+            int t = pending.back();
+            pending.pop_back();
+            push(t);
+            f(nodes[t].y, nodes[t].x);
+            if (nodes[t].left >= 0) pending.push_back(nodes[t].left);
+            if (nodes[t].right >= 0) pending.push_back(nodes[t].right);
+        }
+    }
+
+    // Like remap, for edits that change the order of lines as :m does: the
+    // anchors are taken out and inserted again at their new places
+    template <typename F>
+    void reorder(F f) {
+        std::vector<int> handles;
+        if (root >= 0) handles.push_back(root);
+        for (size_t i = 0; i < handles.size(); ++i) {
+            int t = handles[i];
+            push(t);
+            if (nodes[t].left >= 0) handles.push_back(nodes[t].left);
+            if (nodes[t].right >= 0) handles.push_back(nodes[t].right);
+        }
+        root = -1;
+        for (int h : handles) {
+            int y = nodes[h].y, x = nodes[h].x;
+            f(y, x);
+            nodes[h].shift = Shift();
+            insert(h, y, x);
+        }
+    }
+
+private:
+    // y' = setY ? y : old y + dy, likewise for x
+    struct Shift {
+        bool setY = false, setX = false;
+        int y = 0, x = 0;
+
+        static Shift move(int dy, int dx) { Shift s; s.y = dy; s.x = dx; return s; }
+        static Shift place(int y, int x) { Shift s; s.setY = s.setX = true; s.y = y; s.x = x; return s; }
+        static Shift placeColumn(int x) { Shift s; s.setX = true; s.x = x; return s; }
+
+        bool identity() const { return !setY && !setX && y == 0 && x == 0; }
+
+        // This shift followed by `next`
+        Shift then(const Shift &next) const {
+            Shift s;
+            s.setY = setY || next.setY;
+            s.y = next.setY ? next.y : y + next.y;
+            s.setX = setX || next.setX;
+            s.x = next.setX ? next.x : x + next.x;
+            return s;
+        }
+    };
+
+    struct Node {
+        int y, x;
+        unsigned priority;
+        int left, right, parent;
+        Shift shift;  // pending for the children
+        bool live;
+    };
+
+    std::vector<Node> nodes;
+    int root, freeList;
+    unsigned seed;
+    int count;
+
+    void applyShift(int t, const Shift &s) {
+        if (t < 0 || s.identity()) return;
+        Node &n = nodes[t];
+        n.y = s.setY ? s.y : n.y + s.y;
+        n.x = s.setX ? s.x : n.x + s.x;
+        n.shift = n.shift.then(s);
+    }
+
+    void push(int t) {
+        Node &n = nodes[t];
+        if (n.shift.identity()) return;
+        applyShift(n.left, n.shift);
+        applyShift(n.right, n.shift);
+        n.shift = Shift();
+    }
+
+    // Applies the pending shifts of every ancestor of h
+    void pushPath(int h) {
+        int parent = nodes[h].parent;
+        if (parent < 0) return;
+        pushPath(parent);
+        push(parent);
+    }
+
+    void setLeft(int t, int child) {
+        nodes[t].left = child;
+        if (child >= 0) nodes[child].parent = t;
+    }
+
+    void setRight(int t, int child) {
+        nodes[t].right = child;
+        if (child >= 0) nodes[child].parent = t;
+    }
+
+    // a gets the anchors before (y, x), b the rest
+    void split(int t, int y, int x, int &a, int &b) {
+        if (t < 0) {
+            a = b = -1;
+            return;
+        }
+        push(t);
+        Node &n = nodes[t];
+        if (n.y < y || (n.y == y && n.x < x)) {
+            int r;
+            split(n.right, y, x, r, b);
+            setRight(t, r);
+            a = t;
+        } else {
+            int l;
+            split(n.left, y, x, a, l);
+            setLeft(t, l);
+            b = t;
+        }
+        if (a >= 0) nodes[a].parent = -1;
+        if (b >= 0) nodes[b].parent = -1;
+    }
+
+    int join(int a, int b) {
+        if (a < 0) return b;
+        if (b < 0) return a;
+        if (nodes[a].priority > nodes[b].priority) {
+            push(a);
+            setRight(a, join(nodes[a].right, b));
+            nodes[a].parent = -1;
+            return a;
+        }
+        push(b);
+        setLeft(b, join(a, nodes[b].left));
+        nodes[b].parent = -1;
+        return b;
+    }
+
+    void insert(int h, int y, int x) {
+        nodes[h].y = y;
+        nodes[h].x = x;
+        nodes[h].left = nodes[h].right = nodes[h].parent = -1;
+        int a, b;
+        split(root, y, x, a, b);
+        root = join(join(a, h), b);
+    }
+
+    void unlink(int h) {
+        pushPath(h);
+        push(h);
+        int parent = nodes[h].parent;
+        int merged = join(nodes[h].left, nodes[h].right);
+        if (parent < 0) {
+            root = merged;
+            if (merged >= 0) nodes[merged].parent = -1;
+        } else if (nodes[parent].left == h) {
+            setLeft(parent, merged);
+        } else {
+            setRight(parent, merged);
+        }
+    }
+};
+
+// Folded regions of a buffer: line intervals in a treap ordered by first
+// line (outer folds before inner ones starting on the same line), where
+// every subtree knows the furthest last line of its folds and of its
+// closed folds.  The outermost closed fold around a line, all drawing and
+// j/k need to skip it, is a split and one descent: O(log n).  Edits shift
+// whole subtrees lazily, as in AnchorTree, and zR/zM open or close every
+// fold with one pending flag on the root.  Folds nest; add() refuses one
+// that would cross another.
+class FoldTree {
+public:
+    struct Fold {
+        int start, end;
+        bool closed;
+    };
+
+    FoldTree() : root(-1), freeList(-1), seed(0x2545F491u), count(0) {}
+
+    bool empty() const { return count == 0; }
+    int size() const { return count; }
+
+    void clear() {
+        nodes.clear();
+        root = freeList = -1;
+        count = 0;
+    }
+
+    // False if the fold would cross one already there; a fold with the
+    // same lines as an existing one just sets its state
+    bool add(int start, int end, bool closed) {
+        std::vector<Fold> around;
+        foldsAt(start, around);
+        for (const Fold &f : around) {
+            if (f.start == start && f.end == end) {
+                setClosed(start, end, closed);
+                return true;
+            }
+            if (f.start < start && f.end < end) return false;
+        }
+        foldsAt(end, around);
+        for (const Fold &f : around) {
+            if (f.start > start && f.end > end) return false;
+        }
+        int h = allocate(start, end, closed);
+        int a, b;
+        split(root, start, end, a, b);
+        root = join(join(a, h), b);
+        return true;
+    }
+
+    // Drops the fold with these lines
+    void remove(int start, int end) {
+        int a, b, c;
+        split(root, start, end, a, b);
+        split(b, start, end - 1, b, c);
+        release(b);
+        root = join(a, c);
+    }
+
+    void setClosed(int start, int end, bool closed) { setState(root, start, end, closed); }
+
+    void setAll(bool closed) { applyState(root, closed ? CLOSE : OPEN); }
+
+    // The outermost closed fold holding line y; false if y is shown
+    bool closedAt(int y, Fold &fold) {
+        int a, b;
+        split(root, y + 1, INT_MAX, a, b);
+        bool found = false;
+        for (int t = a; t >= 0;) {
+            push(t);
+            const Node &n = nodes[t];
+            if (n.left >= 0 && nodes[n.left].closedEnd >= y) {
+                t = n.left;
+            } else if (n.closed && n.end >= y) {
+                fold = {n.start, n.end, true};
+                found = true;
+                break;
+            } else {
+                t = n.right >= 0 && nodes[n.right].closedEnd >= y ? n.right : -1;
+            }
+        }
+        root = join(a, b);
+        return found;
+    }
+
+    // Every fold holding line y, outermost first
+    void foldsAt(int y, std::vector<Fold> &out) {
+        out.clear();
+        int a, b;
+        split(root, y + 1, INT_MAX, a, b);
+        collect(a, y, out);
+        root = join(a, b);
+    }
+
+    // Lines inserted at y push the folds from y on down and grow the
+    // folds around y
+    void linesInserted(int y, int n) {
+        int a, b;
+        split(root, y, INT_MAX, a, b);
+        applyShift(b, n);
+        stretch(a, y, n);
+        root = join(a, b);
+    }
+
+    // Folds inside the erased lines go, the others lose the erased lines
+    void linesErased(int y, int n) {
+        int a, b, c;
+        split(root, y, INT_MAX, a, b);
+        split(b, y + n, INT_MAX, b, c);
+        applyShift(c, -n);
+        stretch(a, y, -n);
+
+        // Folds starting in the erased lines and ending after them now
+        // start at y; they nest, so they stay in order
+        std::vector<int> starting;
+        flatten(b, starting);
+        int kept = -1;
+        for (int h : starting) {
+            Node &node = nodes[h];
+            if (node.end < y + n) {
+                discard(h);
+                continue;
+            }
+            node.start = y;
+            node.end -= n;
+            node.left = node.right = -1;
+            update(h);
+            kept = join(kept, h);
+        }
+        root = join(join(a, kept), c);
+    }
+
+private:
+    enum State { KEEP, OPEN, CLOSE };
+
+    struct Node {
+        int start, end;
+        bool closed;
+        unsigned priority;
+        int left, right;
+        int maxEnd, closedEnd;  // over the subtree; closedEnd INT_MIN without closed folds
+        int shift;              // pending for the children
+        State state;            // likewise
+    };
+
+    std::vector<Node> nodes;
+    int root, freeList;
+    unsigned seed;
+    int count;
+
+    int allocate(int start, int end, bool closed) {
+        int h;
+        if (freeList >= 0) {
+            h = freeList;
+            freeList = nodes[h].left;
+        } else {
+            h = nodes.size();
+            nodes.emplace_back();
+        }
+        Node &n = nodes[h];
+        seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+        n.priority = seed;
+        n.start = start;
+        n.end = end;
+        n.closed = closed;
+        n.left = n.right = -1;
+        n.shift = 0;
+        n.state = KEEP;
+        update(h);
+        count++;
+        return h;
+    }
+
+    void discard(int h) {
+        nodes[h].left = freeList;
+        freeList = h;
+        count--;
+    }
+
+    void release(int t) {
+        if (t < 0) return;
+        release(nodes[t].left);
+        release(nodes[t].right);
+        discard(t);
+    }
+
+    void update(int t) {
+        Node &n = nodes[t];
+        n.maxEnd = n.end;
+        n.closedEnd = n.closed ? n.end : INT_MIN;
+        for (int child : {n.left, n.right}) {
+            if (child < 0) continue;
+            n.maxEnd = std::max(n.maxEnd, nodes[child].maxEnd);
+            n.closedEnd = std::max(n.closedEnd, nodes[child].closedEnd);
+        }
+    }
+
+    void applyShift(int t, int d) {
+        if (t < 0 || d == 0) return;
+        Node &n = nodes[t];
+        n.start += d;
+        n.end += d;
+        n.maxEnd += d;
+        if (n.closedEnd != INT_MIN) n.closedEnd += d;
+        n.shift += d;
+    }
+
+    void applyState(int t, State s) {
+        if (t < 0 || s == KEEP) return;
+        Node &n = nodes[t];
+        n.closed = s == CLOSE;
+        n.closedEnd = n.closed ? n.maxEnd : INT_MIN;
+        n.state = s;
+    }
+
+    void push(int t) {
+        Node &n = nodes[t];
+        applyShift(n.left, n.shift);
+        applyShift(n.right, n.shift);
+        applyState(n.left, n.state);
+        applyState(n.right, n.state);
+        n.shift = 0;
+        n.state = KEEP;
+    }
+
+    // Whether a node comes before the fold start..end
+    static bool before(const Node &n, int start, int end) {
+        return n.start < start || (n.start == start && n.end > end);
+    }
+
+    // a gets the folds before start..end, b the rest
+    void split(int t, int start, int end, int &a, int &b) {
+        if (t < 0) {
+            a = b = -1;
+            return;
+        }
+        push(t);
+        if (before(nodes[t], start, end)) {
+            split(nodes[t].right, start, end, nodes[t].right, b);
+            a = t;
+        } else {
+            split(nodes[t].left, start, end, a, nodes[t].left);
+            b = t;
+        }
+        update(t);
+    }
+
+    int join(int a, int b) {
+        if (a < 0) return b;
+        if (b < 0) return a;
+        if (nodes[a].priority > nodes[b].priority) {
+            push(a);
+            nodes[a].right = join(nodes[a].right, b);
+            update(a);
+            return a;
+        }
+        push(b);
+        nodes[b].left = join(a, nodes[b].left);
+        update(b);
+        return b;
+    }
+
+    bool setState(int t, int start, int end, bool closed) {
+        if (t < 0) return false;
+        push(t);
+        Node &n = nodes[t];
+        bool found;
+        if (n.start == start && n.end == end) {
+            n.closed = closed;
+            found = true;
+        } else {
+            found = setState(before(n, start, end) ? n.right : n.left, start, end, closed);
+        }
+        update(t);
+        return found;
+    }
+
+    // Folds of the subtree, all starting at or before y, that reach y
+    void collect(int t, int y, std::vector<Fold> &out) {
+        if (t < 0 || nodes[t].maxEnd < y) return;
+        push(t);
+        collect(nodes[t].left, y, out);
+        if (nodes[t].end >= y) out.push_back({nodes[t].start, nodes[t].end, nodes[t].closed});
+        collect(nodes[t].right, y, out);
+    }
+
+    // Moves the ends at or after line y of folds starting before it by n,
+    // not past y - 1 when lines are erased
+    void stretch(int t, int y, int n) {
+        if (t < 0 || nodes[t].maxEnd < y) return;
+        push(t);
+        Node &node = nodes[t];
+        if (node.end >= y) node.end = n > 0 || node.end >= y - n ? node.end + n : y - 1;
+        stretch(node.left, y, n);
+        stretch(node.right, y, n);
+        update(t);
+    }
+
+    // The subtree's nodes in order, pending updates applied
+    void flatten(int t, std::vector<int> &out) {
+        if (t < 0) return;
+        push(t);
+        flatten(nodes[t].left, out);
+        out.push_back(t);
+        flatten(nodes[t].right, out);
+    }
+};
+
+// Yank and delete registers: "a-"z ("A-"Z append), "0 for the last yank,
+// "1-"9 for the delete history, "- for deletes within a line and "_,
+// which discards.  The text of a register is shared and never modified,
+// so shifting the delete history or pasting copies no text up front, and
+// appending builds a new copy.  Once the registers together outgrow the
+// budget the biggest ones are written to temporary files and read back
+// when they are next used.
+class Registers {
+public:
+    enum Kind { CHARS, LINES, BLOCK };
+    typedef std::shared_ptr<const std::vector<std::string>> Text;
+
+    static const size_t MEMORY_BUDGET = 64 << 20;
+
+    Registers() : unnamed('0') {}
+
+    // Curses keys are above 255, so check the range before isalnum
+    static bool valid(int name) {
+        return name == '_' || name == '"' || name == '-' || (name > 0 && name < 128 && std::isalnum(name));
+    }
+
+    // Stores text under `name`, or as the last yank or delete when it is 0
+    void store(char name, Kind kind, std::vector<std::string> &&lines, bool deleted) {
+        if (name == '_') return;
+        if (name == 0 || name == '"') {
+            if (deleted && kind == CHARS) {
+                name = '-';
+            } else if (deleted) {
+                for (int i = 9; i > 1; --i) slots[i + '0'] = std::move(slots[i - 1 + '0']);
+                name = '1';
+            } else {
+                name = '0';
+            }
+        }
+
+        Slot slot;
+        slot.kind = kind;
+        if (std::isupper((unsigned char)name)) {
+            // Appending makes a new copy, readers of the old text keep theirs
+            name = std::tolower((unsigned char)name);
+            Kind oldKind;
+            Text old = get(name, oldKind);
+            if (old) {
+                std::vector<std::string> joined(*old);
+                joined.insert(joined.end(), std::make_move_iterator(lines.begin()), 
+                              std::make_move_iterator(lines.end()));
+                lines.swap(joined);
+                if (oldKind == LINES) slot.kind = LINES;
+            }
+        }
+        for (const std::string &line : lines) slot.bytes += line.length() + 1;
+        slot.text = std::make_shared<const std::vector<std::string>>(std::move(lines));
+        slots[(unsigned char)name] = std::move(slot);
+        unnamed = name;
+        enforceBudget(name);
+    }
+
+    // Stores keys recorded by q, leaving p pasting what it did before
+    void storeKeys(char name, const std::string &keys) {
+        char last = unnamed;
+        store(name, CHARS, std::vector<std::string>(1, keys), false);
+        unnamed = last;
+    }
+
+    // The text of a register, 0 meaning the last one written; null if empty
+    Text get(char name, Kind &kind) {
+        if (name == 0 || name == '"') name = unnamed;
+        Slot &slot = slots[std::tolower((unsigned char)name)];
+        if (!slot.text && slot.spill) {
+            reload(slot);
+            enforceBudget(std::tolower((unsigned char)name));
+        }
+        kind = slot.kind;
+        return slot.text;
+    }
+
+    // One line per register for :registers
+    std::string list() const {
+        std::ostringstream out;
+        out << "registers:";
+        for (int c = 0; c < 256; ++c) {
+            const Slot &slot = slots[c];
+            if (!slot.text && !slot.spill) continue;
+            out << " \"" << (char)c << " " << slot.bytes << "B";
+            if (!slot.text) out << "(disk)";
+        }
+        return out.str();
+    }
+
+private:
+    struct Slot {
+        Kind kind = LINES;
+        Text text;                    // null while spilled to disk
+        std::shared_ptr<FILE> spill;  // temporary file with the text
+        size_t bytes = 0;
+    };
+
+    Slot slots[256];
+    char unnamed;
+
+    // Spills the largest registers in memory until the rest fit the budget,
+    // keeping the one just written if it can
+    void enforceBudget(char keep) {
+        for (;;) {
+            size_t total = 0;
+            Slot *largest = nullptr;
+            for (int c = 0; c < 256; ++c) {
+                Slot &slot = slots[c];
+                if (!slot.text) continue;
+                total += slot.bytes;
+                if (c != keep && (!largest || slot.bytes > largest->bytes)) largest = &slot;
+            }
+            if (total <= MEMORY_BUDGET || !largest) return;
+            if (!spill(*largest)) return;
+        }
+    }
+
+    static bool spill(Slot &slot) {
+        if (!slot.spill) {
+            std::shared_ptr<FILE> file(std::tmpfile(), [](FILE *f) { if (f) fclose(f); });
+            if (!file) return false;
+            for (const std::string &line : *slot.text) {
+                if (fwrite(line.data(), 1, line.length(), file.get()) != line.length() || 
+                    fputc('\n', file.get()) == EOF) return false;
+            }
+            if (fflush(file.get()) != 0) return false;
+            slot.spill = file;
+        }
+        slot.text.reset();
+        return true;
+    }
+
+    static void reload(Slot &slot) {
+        std::vector<std::string> lines;
+        std::string data(slot.bytes, '\0');
+        rewind(slot.spill.get());
+        if (fread(&data[0], 1, data.size(), slot.spill.get()) != data.size()) return;
+        size_t start = 0;
+        for (size_t end; (end = data.find('\n', start)) != std::string::npos; start = end + 1) {
+            lines.emplace_back(data, start, end - start);
+        }
+        slot.text = std::make_shared<const std::vector<std::string>>(std::move(lines));
+    }
+};
+
+// Appends the lines of [from, to) containing `needle`, or with `invert`
+// those without it, testing them on all cores
+static void findLines(const std::vector<std::string> &lines, int from, int to, 
+                      const std::string &needle, bool invert, std::vector<int> &out) {
+    std::vector<char> found(to - from);
+    parallelFor(found.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            found[i] = (lines[from + i].find(needle) != std::string::npos) != invert;
+        }
+    });
+    for (size_t i = 0; i < found.size(); ++i) {
+        if (found[i]) out.push_back(from + i);
+    }
+}
+
+// Lines shown by a filtered view: the buffer lines containing a pattern
+// (or, inverted, those not containing it) as a sorted index.  It is built
+// on all cores once, then patched by the edit hooks: only the lines an
+// edit touched are tested again and the indexes after it shifted.
+class LineFilter {
+public:
+    bool active() const { return enabled; }
+    bool inverted() const { return invert; }
+    const std::string &pattern() const { return needle; }
+    int matches() const { return visible.size(); }
+
+    void clear() {
+        enabled = false;
+        needle.clear();
+        std::vector<int>().swap(visible);
+    }
+
+    void reset(const std::vector<std::string> &lines, const std::string &pattern, bool inverse) {
+        enabled = true;
+        needle = pattern;
+        invert = inverse;
+        visible.clear();
+        scan(lines, 0, lines.size(), visible);
+    }
+
+    // Scans again, as after undo or when an unloaded buffer is read back
+    void rebuild(const std::vector<std::string> &lines) {
+        if (enabled) reset(lines, needle, invert);
+    }
+
+    // Drops the index of an unloaded buffer, keeping the pattern
+    void release() { std::vector<int>().swap(visible); }
+
+    void linesChanged(const std::vector<std::string> &lines, int y, int n) {
+        n = std::min<int>(n, lines.size() - y);
+        auto first = std::lower_bound(visible.begin(), visible.end(), y);
+        auto last = std::lower_bound(first, visible.end(), y + n);
+        std::vector<int> found;
+        scan(lines, y, y + n, found);
+        if (found.size() == size_t(last - first)) {
+            std::copy(found.begin(), found.end(), first);
+            return;
+        }
+        first = visible.erase(first, last);
+        visible.insert(first, found.begin(), found.end());
+    }
+
+    void linesInserted(const std::vector<std::string> &lines, int y, int n) {
+        auto at = std::lower_bound(visible.begin(), visible.end(), y);
+        for (auto i = at; i != visible.end(); ++i) *i += n;
+        std::vector<int> found;
+        scan(lines, y, y + n, found);
+        visible.insert(at, found.begin(), found.end());
+    }
+
+    void linesErased(int y, int n) {
+        auto first = std::lower_bound(visible.begin(), visible.end(), y);
+        auto last = std::lower_bound(first, visible.end(), y + n);
+        for (auto i = last; i != visible.end(); ++i) *i -= n;
+        visible.erase(first, last);
+    }
+
+    // Rows are counted over the matching lines plus `pin`, the cursor's
+    // line, which stays shown while the cursor is on it even if it does
+    // not match (-1 for no pin)
+    int rows(int pin) const { return visible.size() + pinned(pin); }
+
+    int rank(int y, int pin) const {
+        int r = std::lower_bound(visible.begin(), visible.end(), y) - visible.begin();
+        return r + (pin < y && pinned(pin));
+    }
+
+    // Line shown at row r, -1 past the last
+    int lineAt(int r, int pin) const {
+        if (pinned(pin)) {
+            int k = std::lower_bound(visible.begin(), visible.end(), pin) - visible.begin();
+            if (r == k) return pin;
+            if (r > k) r--;
+        }
+        return r >= 0 && r < (int)visible.size() ? visible[r] : -1;
+    }
+
+private:
+    bool enabled = false, invert = false;
+    std::string needle;
+    std::vector<int> visible;
+
+    bool pinned(int pin) const {
+        return pin >= 0 && !std::binary_search(visible.begin(), visible.end(), pin);
+    }
+
+    void scan(const std::vector<std::string> &lines, int from, int to, std::vector<int> &out) const {
+        findLines(lines, from, to, needle, invert, out);
+    }
+};
+
+// The buffer as a ring of linked lines for :g, so that deleting, moving
+// or copying a line is O(1) however many lines the command runs on, and
+// the vector is rebuilt once at the end.  Nodes below `size` are the
+// original lines, node `size` stands for line 0 and closes the ring, and
+// copies are added after it.
+class LineList {
+public:
+    explicit LineList(int lineCount) : size(lineCount), next(size + 1), prev(size + 1), alive(size + 1, 1) {
+        for (int i = 0; i <= size; ++i) {
+            next[i] = i == size ? 0 : i + 1;
+            prev[i] = i == 0 ? size : i - 1;
+        }
+    }
+
+    int zero() const { return size; }
+    int first() const { return next[size]; }
+    int last() const { return prev[size]; }
+    bool live(int node) const { return alive[node]; }
+    bool empty() const { return next[size] == size; }
+
+    // The node k lines after `node` (before it for k < 0), line 0 included;
+    // -1 past either end
+    int step(int node, int k) const {
+        for (; k > 0 && node >= 0; --k) node = next[node] == size ? -1 : next[node];
+        for (; k < 0 && node >= 0; ++k) node = node == size ? -1 : prev[node];
+        return node;
+    }
+
+    // The n-th line, 0 for line 0; -1 past the end
+    int line(int n) const { return step(size, n); }
+
+    // Whether b is a or comes after it
+    bool ordered(int a, int b) const {
+        for (int node = a; node != size; node = next[node]) {
+            if (node == b) return true;
+        }
+        return false;
+    }
+
+    // The first node from `from` on (wrapping around, `from` itself last)
+    // whose line `match` accepts, -1 if none
+    template <typename F>
+    int find(int from, bool forward, F match) const {
+        for (int node = forward ? next[from] : prev[from]; node != from; 
+             node = forward ? next[node] : prev[node]) {
+            if (node != size && match(node)) return node;
+        }
+        return from != size && match(from) ? from : -1;
+    }
+
+    const std::string &text(int node, const std::vector<std::string> &lines) const {
+        return node < size ? lines[node] : copies[node - size - 1];
+    }
+
+    // Unlinks lines a..b
+    void erase(int a, int b) {
+        int before = prev[a], after = next[b];
+        for (int node = a;; node = next[node]) {
+            alive[node] = 0;
+            if (node == b) break;
+        }
+        link(before, after);
+    }
+
+    // Puts lines a..b after `dest`; false if dest is inside them
+    bool move(int a, int b, int dest) {
+        for (int node = a; node != b; node = next[node]) {
+            if (node == dest) return false;
+        }
+        if (dest == b || dest == prev[a]) return true;
+        link(prev[a], next[b]);
+        link(b, next[dest]);
+        link(dest, a);
+        return true;
+    }
+
+    // Puts copies of lines a..b after `dest`, returns the last copy
+    int copy(int a, int b, int dest, const std::vector<std::string> &lines) {
+        std::vector<int> span;
+        for (int node = a;; node = next[node]) {
+            span.push_back(node);
+            if (node == b) break;
+        }
+        for (int node : span) {
+            int added = next.size();
+            copies.push_back(text(node, lines));
+            next.push_back(-1);
+            prev.push_back(-1);
+            alive.push_back(1);
+            link(added, next[dest]);
+            link(dest, added);
+            dest = added;
+        }
+        return dest;
+    }
+
+    // Puts the lines in their new order and returns the old vector, its
+    // lines copied rather than moved when it is to be kept.  `index` gets
+    // the new line of every node, -1 for the erased ones.
+    std::vector<std::string> rebuild(std::vector<std::string> &lines, std::vector<int> &index, bool keep) {
+        std::vector<std::string> result;
+        result.reserve(lines.size() + copies.size());
+        index.assign(next.size(), -1);
+        for (int node = next[size]; node != size; node = next[node]) {
+            index[node] = result.size();
+            std::string &text = node < size ? lines[node] : copies[node - size - 1];
+            if (keep) result.push_back(text);
+            else result.push_back(std::move(text));
+        }
+        lines.swap(result);
+        return result;
+    }
+
+private:
+    int size;
+    std::vector<int> next, prev;
+    std::vector<char> alive;
+    std::vector<std::string> copies;
+
+    void link(int a, int b) {
+        next[a] = b;
+        prev[b] = a;
+    }
+};
+
+// Line diff of two texts for diff mode.  Lines are compared as 64-bit
+// hashes.  A region is first cut at lines that occur exactly once on each
+// side (patience diff), and the gaps between those anchors are diffed
+// with Myers' O(ND) algorithm in linear space.  An edit turns the hunks it
+// touches into one coarse but still correct hunk marked dirty, and
+// refresh() diffs just those hunks again.
+class LineDiff {
+public:
+    struct Hunk {
+        int start[2], count[2];
+        int row;     // aligned row of its first line, the shorter side padded with filler rows
+        bool dirty;
+
+        int end(int side) const { return start[side] + count[side]; }
+        int rows() const { return std::max(count[0], count[1]); }
+    };
+    std::vector<Hunk> hunks;
+
+    // xxHash-style: 8 bytes at a time, then a final avalanche
+    static uint64_t hashText(const std::string &s) {
+        const uint64_t P1 = 0x9E3779B185EBCA87ULL, P2 = 0xC2B2AE3D27D4EB4FULL, P3 = 0x165667B19E3779F9ULL;
+        uint64_t h = P3 + s.length();
+        size_t i = 0;
+        for (; i + 8 <= s.length(); i += 8) {
+            uint64_t word;
+            memcpy(&word, s.data() + i, 8);
+            h ^= rotl(word * P2, 31) * P1;
+            h = rotl(h, 27) * P1 + P3;
+        }
+        for (; i < s.length(); ++i) h = rotl(h ^ (unsigned char)s[i] * P3, 11) * P1;
+        h ^= h >> 33;
+        h *= P2;
+        h ^= h >> 29;
+        h *= P3;
+        return h ^ (h >> 32);
+    }
+
+    void clear() {
+        hashes[0].clear();
+        hashes[1].clear();
+        hunks.clear();
+    }
+
+    // Hashes both texts and diffs them whole
+    void reset(const std::vector<std::string> &a, const std::vector<std::string> &b) {
+        rehash(0, a);
+        rehash(1, b);
+        hunks.clear();
+        diffRegion(0, hashes[0].size(), 0, hashes[1].size(), hunks, 0);
+        rowsValid = false;
+    }
+
+    // One side was replaced wholesale, as by undo
+    void replaced(int side, const std::vector<std::string> &text) {
+        rehash(side, text);
+        hunks.clear();
+        diffRegion(0, hashes[0].size(), 0, hashes[1].size(), hunks, 0);
+        rowsValid = false;
+    }
+
+    // Lines y..y+oldCount-1 of one side became newCount lines.  The hunks
+    // touching them merge into one dirty hunk; the text is hashed again
+    // when refresh() diffs it.
+    void edited(int side, int y, int oldCount, int newCount) {
+        int other = 1 - side;
+        size_t first = std::partition_point(hunks.begin(), hunks.end(), [&](const Hunk &h) { 
+            return h.end(side) < y; 
+        }) - hunks.begin();
+        size_t last = first;
+        while (last < hunks.size() && hunks[last].start[side] <= y + oldCount) ++last;
+
+        // Lines between hunks pair up at a fixed offset
+        auto offsetBefore = [&](size_t i) { return i == 0 ? 0 : hunks[i - 1].end(other) - hunks[i - 1].end(side); };
+        int begin = y, end = y + oldCount;
+        int otherBegin = begin + offsetBefore(first), otherEnd = end + offsetBefore(last);
+        if (first < last && hunks[first].start[side] <= begin) {
+            begin = hunks[first].start[side];
+            otherBegin = hunks[first].start[other];
+        }
+        if (first < last && hunks[last - 1].end(side) >= end) {
+            end = hunks[last - 1].end(side);
+            otherEnd = hunks[last - 1].end(other);
+        }
+
+        Hunk merged;
+        merged.start[side] = begin;
+        merged.count[side] = end - begin + newCount - oldCount;
+        merged.start[other] = otherBegin;
+        merged.count[other] = otherEnd - otherBegin;
+        merged.dirty = true;
+        hunks.erase(hunks.begin() + first, hunks.begin() + last);
+        hunks.insert(hunks.begin() + first, merged);
+        for (size_t i = first + 1; i < hunks.size(); ++i) hunks[i].start[side] += newCount - oldCount;
+
+        std::vector<uint64_t> &h = hashes[side];
+        if (newCount > oldCount) h.insert(h.begin() + y + oldCount, newCount - oldCount, 0);
+        else h.erase(h.begin() + y + newCount, h.begin() + y + oldCount);
+        rowsValid = false;
+    }
+
+    // Diffs the dirty hunks again; returns false when there were none
+    bool refresh(const std::vector<std::string> &a, const std::vector<std::string> &b) {
+        bool dirty = false;
+        for (const Hunk &h : hunks) dirty = dirty || h.dirty;
+        if (!dirty) return false;
+        const std::vector<std::string> *text[2] = {&a, &b};
+        std::vector<Hunk> refreshed;
+        refreshed.reserve(hunks.size());
+        for (const Hunk &h : hunks) {
+            if (!h.dirty) {
+                emit(refreshed, h.start[0], h.end(0), h.start[1], h.end(1));
+                continue;
+            }
+            for (int side = 0; side < 2; ++side) {
+                for (int y = h.start[side]; y < h.end(side); ++y) hashes[side][y] = hashText((*text[side])[y]);
+            }
+            diffRegion(h.start[0], h.end(0), h.start[1], h.end(1), refreshed, 0);
+        }
+        hunks.swap(refreshed);
+        rowsValid = false;
+        return true;
+    }
+
+    // Aligned row of a line
+    int lineToRow(int side, int y) {
+        updateRows();
+        size_t i = std::partition_point(hunks.begin(), hunks.end(), [&](const Hunk &h) { 
+            return h.start[side] <= y; 
+        }) - hunks.begin();
+        if (i == 0) return y;
+        const Hunk &h = hunks[i - 1];
+        if (y < h.end(side)) return h.row + y - h.start[side];
+        return h.row + h.rows() + y - h.end(side);
+    }
+
+    // Line shown on an aligned row.  On a filler row that is the next line
+    // of the side, and `filler` is set.
+    int rowToLine(int side, int row, bool &filler) {
+        updateRows();
+        filler = false;
+        size_t i = std::partition_point(hunks.begin(), hunks.end(), [&](const Hunk &h) { 
+            return h.row <= row; 
+        }) - hunks.begin();
+        if (i == 0) return row;
+        const Hunk &h = hunks[i - 1];
+        int offset = row - h.row;
+        if (offset >= h.rows()) return h.end(side) + offset - h.rows();
+        if (offset < h.count[side]) return h.start[side] + offset;
+        filler = true;
+        return h.end(side);
+    }
+
+    enum LineKind { SAME, CHANGED, ADDED };
+
+    LineKind kind(int side, int y) const {
+        size_t i = std::partition_point(hunks.begin(), hunks.end(), [&](const Hunk &h) { 
+            return h.end(side) <= y; 
+        }) - hunks.begin();
+        if (i == hunks.size() || hunks[i].start[side] > y) return SAME;
+        return hunks[i].count[1 - side] == 0 ? ADDED : CHANGED;
+    }
+
+    // First line of the next or previous hunk on a side, -1 if none
+    int nextHunk(int side, int y, bool forward) const {
+        if (forward) {
+            for (const Hunk &h : hunks) {
+                if (h.start[side] > y) return h.start[side];
+            }
+            return -1;
+        }
+        for (size_t i = hunks.size(); i-- > 0;) {
+            if (hunks[i].start[side] < y) return hunks[i].start[side];
+        }
+        return -1;
+    }
+
+private:
+    std::vector<uint64_t> hashes[2];
+    std::vector<int> forward, backward;  // Myers' V arrays, reused
+    bool rowsValid = false;
+
+    static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+    void rehash(int side, const std::vector<std::string> &text) {
+        hashes[side].resize(text.size());
+        parallelFor(text.size(), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) hashes[side][i] = hashText(text[i]);
+        });
+    }
+
+    void updateRows() {
+        if (rowsValid) return;
+        int padding = 0;  // filler rows on side 0 so far
+        for (Hunk &h : hunks) {
+            h.row = h.start[0] + padding;
+            padding += h.rows() - h.count[0];
+        }
+        rowsValid = true;
+    }
+
+    // Appends a hunk, joining it to the last one when they touch
+    static void emit(std::vector<Hunk> &out, int a0, int a1, int b0, int b1) {
+        if (a0 == a1 && b0 == b1) return;
+        if (!out.empty() && out.back().end(0) == a0 && out.back().end(1) == b0) {
+            out.back().count[0] += a1 - a0;
+            out.back().count[1] += b1 - b0;
+            return;
+        }
+        Hunk h;
+        h.start[0] = a0;
+        h.count[0] = a1 - a0;
+        h.start[1] = b0;
+        h.count[1] = b1 - b0;
+        h.row = 0;
+        h.dirty = false;
+        out.push_back(h);
+    }
+
+    // Patience step: pairs of lines unique on both sides, longest run in
+    // order on both, cut the region into smaller ones
+    void diffRegion(int a0, int a1, int b0, int b1, std::vector<Hunk> &out, int depth) {
+        const uint64_t *a = hashes[0].data(), *b = hashes[1].data();
+        while (a0 < a1 && b0 < b1 && a[a0] == b[b0]) ++a0, ++b0;
+        while (a0 < a1 && b0 < b1 && a[a1 - 1] == b[b1 - 1]) --a1, --b1;
+        if (a0 == a1 || b0 == b1) {
+            emit(out, a0, a1, b0, b1);
+            return;
+        }
+
+        // Reversed or shuffled text finds few anchors per step; Myers with
+        // its cost limit takes over before that turns quadratic
+        std::vector<std::pair<int, int>> anchors;
+        if (depth < 64) uniqueAnchors(a0, a1, b0, b1, anchors);
+        if (anchors.empty()) {
+            myers(a0, a1, b0, b1, out);
+            return;
+        }
+        for (const std::pair<int, int> &anchor : anchors) {
+            diffRegion(a0, anchor.first, b0, anchor.second, out, depth + 1);
+            a0 = anchor.first + 1;
+            b0 = anchor.second + 1;
+        }
+        diffRegion(a0, a1, b0, b1, out, depth + 1);
+    }
+
+    // Lines occurring once on each side, as the longest sequence that is
+    // in order on both
+    void uniqueAnchors(int a0, int a1, int b0, int b1, std::vector<std::pair<int, int>> &anchors) {
+        struct Slot {
+            uint64_t key;
+            int countA, countB, posA, posB;
+        };
+        size_t size = 16;
+        while (size < 2 * size_t(a1 - a0 + b1 - b0)) size *= 2;
+        std::vector<Slot> table(size, Slot{0, 0, 0, 0, 0});
+        auto find = [&](uint64_t key) -> Slot & {
+            size_t i = key & (size - 1);
+            while ((table[i].countA || table[i].countB) && table[i].key != key) i = (i + 1) & (size - 1);
+            table[i].key = key;
+            return table[i];
+        };
+        for (int i = a0; i < a1; ++i) {
+            Slot &s = find(hashes[0][i]);
+            s.countA++;
+            s.posA = i;
+        }
+        for (int i = b0; i < b1; ++i) {
+            Slot &s = find(hashes[1][i]);
+            s.countB++;
+            s.posB = i;
+        }
+
+        // Patience sorting: piles[k] ends the best run of length k + 1
+        std::vector<std::pair<int, int>> pairs;
+        for (int i = a0; i < a1; ++i) {
+            const Slot &s = find(hashes[0][i]);
+            if (s.countA == 1 && s.countB == 1) pairs.emplace_back(i, s.posB);
+        }
+        std::vector<int> piles, previous(pairs.size(), -1);
+        for (size_t i = 0; i < pairs.size(); ++i) {
+            size_t k = std::partition_point(piles.begin(), piles.end(), [&](int p) { 
+                return pairs[p].second < pairs[i].second; 
+            }) - piles.begin();
+            if (k > 0) previous[i] = piles[k - 1];
+            if (k == piles.size()) piles.push_back(i);
+            else piles[k] = i;
+        }
+        if (piles.empty()) return;
+        for (int i = piles.back(); i >= 0; i = previous[i]) anchors.push_back(pairs[i]);
+        std::reverse(anchors.begin(), anchors.end());
+    }
+
+    void myers(int a0, int a1, int b0, int b1, std::vector<Hunk> &out) {
+        const uint64_t *a = hashes[0].data(), *b = hashes[1].data();
+        while (a0 < a1 && b0 < b1 && a[a0] == b[b0]) ++a0, ++b0;
+        while (a0 < a1 && b0 < b1 && a[a1 - 1] == b[b1 - 1]) --a1, --b1;
+        if (a0 == a1 || b0 == b1) {
+            emit(out, a0, a1, b0, b1);
+            return;
+        }
+        int sx, sy, ex, ey;
+        if (!middleSnake(a0, a1, b0, b1, sx, sy, ex, ey)) {
+            // Too different to be worth the time: one hunk
+            emit(out, a0, a1, b0, b1);
+            return;
+        }
+        myers(a0, sx, b0, sy, out);
+        myers(sx, ex, sy, ey, out);  // at most one line added or deleted
+        myers(ex, a1, ey, b1, out);
+    }
+
+    // Middle snake of the box, searched from both corners at once; false
+    // once the edit distance passes a limit that grows with the square
+    // root of the box, as in xdiff
+    bool middleSnake(int left, int right, int top, int bottom, int &sx, int &sy, int &ex, int &ey) {
+        const uint64_t *a = hashes[0].data(), *b = hashes[1].data();
+        int width = right - left, height = bottom - top, delta = width - height;
+        int limit = std::min((width + height + 1) / 2, 
+                             std::max(256, (int)std::sqrt((double)width + height)));
+        int o = limit + 1;
+        forward.assign(2 * limit + 3, 0);
+        backward.assign(2 * limit + 3, 0);
+        forward[o + 1] = left;
+        backward[o + 1] = bottom;
+
+        for (int d = 0; d <= limit; ++d) {
+            for (int k = d; k >= -d; k -= 2) {
+                int x, px;
+                if (k == -d || (k != d && forward[o + k - 1] < forward[o + k + 1])) {
+                    px = x = forward[o + k + 1];
+                } else {
+                    px = forward[o + k - 1];
+                    x = px + 1;
+                }
+                int y = top + (x - left) - k;
+                int py = d == 0 || x != px ? y : y - 1;
+                while (x < right && y < bottom && a[x] == b[y]) ++x, ++y;
+                forward[o + k] = x;
+                int c = k - delta;
+                if ((delta & 1) && c >= -(d - 1) && c <= d - 1 && y >= backward[o + c]) {
+                    sx = px, sy = py, ex = x, ey = y;
+                    return true;
+                }
+            }
+            for (int c = d; c >= -d; c -= 2) {
+                int y, py;
+                if (c == -d || (c != d && backward[o + c - 1] > backward[o + c + 1])) {
+                    py = y = backward[o + c + 1];
+                } else {
+                    py = backward[o + c - 1];
+                    y = py - 1;
+                }
+                int k = c + delta;
+                int x = left + (y - top) + k;
+                int px = d == 0 || y != py ? x : x + 1;
+                while (x > left && y > top && a[x - 1] == b[y - 1]) --x, --y;
+                backward[o + c] = y;
+                if (!(delta & 1) && k >= -d && k <= d && x <= forward[o + k]) {
+                    sx = x, sy = y, ex = px, ey = py;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+};
+
+// Lines of the screen -s and --keys runs scroll and page by, as if on a
+// terminal; curses' LINES is 0 without one
+static const int HEADLESS_LINES = 24;
+
+class TextEditor {
+public:
+    // Editor modes
+    enum class EditorMode {
+        NORMAL,
+        INSERT,
+        COMMAND,
+        VISUAL,
+        VISUAL_LINE,
+        VISUAL_BLOCK
+    };
+
+    // A headless editor never touches the terminal, for -s and --keys
+    TextEditor(const std::string &fileName, bool headless = false) 
+        : headless(headless), quitRequested(false), failed(false), 
+          cursorX(0), cursorY(0), offsetY(0), fileName(fileName), 
+          mode(EditorMode::NORMAL), commandBuffer(""), 
+          visualStartX(0), visualStartY(0), visualTop(0), visualBottom(0), 
+          repeatCount(0), insertRecorded(false), insertUndoSaved(false), 
+          recordingRegister(0), lastMacro(0), replayPos(0), typedPos(0), macroDepth(0), macroCalls(0), undoSuspended(false), undoBytes(0), 
+          commandPrompt(':'), 
+          lastSearchForward(true), jumpIndex(0), 
+          currentBuffer(0), bufferClock(0), rootWindow(0), activeWindow(0), 
+          damageTop(0), damageBottom(INT_MAX), 
+          shiftWidth(4), tabStop(8), expandTab(true), modified(false), 
+          contentHash(0), noEndOfLine(false), indexSaved(false), diskKey(), diskChanged(false), 
+          following(false), followOpenLine(false), followOffset(0), followLimit(0), droppedLines(0), inotifyFd(-1), quickfixIndex(-1), pendingRegister(0) {
+        std::fill(marks, marks + 26, -1);
+        diffBuffers[0] = diffBuffers[1] = -1;
+        buffers.emplace_back();
+        buffers[0].fileName = fileName;
+        buffers[0].loaded = true;
+        windows.emplace_back();
+        if (headless) {
+            // Batch edits keep no undo history and build no search index
+            undoSuspended = true;
+            if (!loadFile()) errorMessage("Can't open file");
+            if (lines.empty()) lines.push_back("");
+            brackets.reset(lines.size());
+            timeIndex.reset(lines.size());
+            return;
+        }
+        initscr(); 
+        raw();     
+        keypad(stdscr, TRUE); 
+        noecho();  
+        start_color(); 
+        initColors(); 
+        if (!loadFile() || lines.empty()) {
+            lines.push_back(""); 
+        }
+        inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        watchFile(fileName);
+        openSearchIndex((int)lines.size() >= 4 * TrigramIndex::CHUNK_LINES);
+        brackets.reset(lines.size());
+        timeIndex.reset(lines.size());
+    }
+
+    ~TextEditor() {
+        if (inotifyFd >= 0) close(inotifyFd);
+        if (!headless) endwin(); 
+    }
+
+    // Runs normal-mode keys and then ex commands (with or without the ':')
+    // through the same handlers as the terminal, the keys as if typed.
+    // Without commands the buffer is written back if the keys changed it.
+    // Returns false if anything failed; firstError() tells what.
+    bool runBatch(const std::vector<std::string> &commands, const std::vector<int> &keys) {
+        if (failed) return false;
+        typedKeys = keys;
+        typedPos = 0;
+        while (!quitRequested && typedPos < typedKeys.size()) {
+            int ch = readKey();
+            if (recordingRegister) encodeKey(recordedKeys, ch);
+            handleKey(ch);
+        }
+        mode = EditorMode::NORMAL;
+
+        for (const std::string &command : commands) {
+            if (quitRequested) break;
+            mode = EditorMode::COMMAND;
+            commandPrompt = ':';
+            commandBuffer = command.compare(0, 1, ":") == 0 ? command.substr(1) : command;
+            handleCommandModeInput('\n');
+        }
+        if (commands.empty() && modified) saveFile();
+        return !failed;
+    }
+
+    // The first error of a run, which later messages do not replace
+    const std::string &firstError() const { return error; }
+
+    // Adds the other files named on the command line without reading them
+    void addBuffers(const std::vector<std::string> &names) {
+        for (const std::string &name : names) findBuffer(name);
+    }
+
+    // :follow [lines] - like tail -f, appends to the file are read as they
+    // come and the view stays at the end while the cursor is on the last line
+    void startFollow(size_t limit) {
+        if (modified) {
+            errorMessage("No write since last change");
+            return;
+        }
+        checkDisk();
+        FileKey now;
+        if (!fileKey(now)) {
+            errorMessage("Can't follow " + fileName);
+            return;
+        }
+        following = true;
+        followLimit = limit;
+        followOffset = now.size;
+        followOpenLine = true;
+        if (now.size > 0) {
+            // Whether the last line has its newline yet
+            int fd = open(fileName.c_str(), O_RDONLY);
+            char last = '\n';
+            if (fd >= 0 && pread(fd, &last, 1, now.size - 1) == 1) followOpenLine = last != '\n';
+            if (fd >= 0) close(fd);
+        }
+        diskKey = now;
+        trimFollowed();
+        cursorY = lines.size() - 1;
+        cursorX = 0;
+        scrollToCursor();
+        statusMessage("Following " + fileName + (limit ? ", keeping the last " + std::to_string(limit) + " lines" : ""));
+    }
+
+    // pbedit -d: the first two files side by side in diff mode
+    void startDiffMode() {
+        if (buffers.size() < 2) return;
+        diffThis();
+        splitWindow(true);
+        cycleWindow(1);
+        switchToBuffer(1);
+        diffThis();
+        cycleWindow(1);
+    }
+
+    void run() {
+        while (!quitRequested) {
+            display();
+            int ch = waitForKey();
+            if (ch == ERR) continue;
+            message.clear();
+            if (recordingRegister) encodeKey(recordedKeys, ch);
+            handleKey(ch);
+        }
+    }
+
+    // Mode-dependent input handling
+    void handleKey(int ch) {
+        if (mode != EditorMode::INSERT) insertUndoSaved = false;
+        switch(mode) {
+            case EditorMode::NORMAL:
+                handleNormalModeInput(ch);
+                break;
+            case EditorMode::INSERT:
+                handleInsertModeInput(ch);
+                break;
+            case EditorMode::COMMAND:
+                handleCommandModeInput(ch);
+                break;
+            case EditorMode::VISUAL:
+            case EditorMode::VISUAL_LINE:
+            case EditorMode::VISUAL_BLOCK:
+                handleVisualModeInput(ch);
+                break;
+        }
+    }
+
+private:
+    bool headless, quitRequested, failed;
+    int cursorX, cursorY, offsetY;
+    std::string fileName;
+    std::vector<std::string> lines;
+    EditorMode mode;
+    std::string commandBuffer;
+    
+    // Visual mode selection tracking; '< and '> are the lines of the last one
+    int visualStartX, visualStartY;
+    int visualTop, visualBottom;
+    
+    // Repeat count and the last change, which . repeats at the cursor
+    int repeatCount;
+    struct Change {
+        char command = 0;      // i a I A c (cc), d (dd), x, p, > <, or v for a visual operation
+        int count = 1;
+        char reg = 0;
+        std::string inserted;  // what the insert session left behind, '\n' for Enter
+        int erased = 0;        // characters backspaced over before the insert point
+
+        // Visual operations: the operator, selection mode and extent from the cursor
+        char op = 0;
+        EditorMode visualMode = EditorMode::VISUAL;
+        int height = 0, width = 0;
+    };
+    Change lastChange, insertChange;
+    bool insertRecorded;  // whether this insert session feeds lastChange
+    bool insertUndoSaved;  // whether this multi-cursor insert has its undo step
+
+    // Macros: keys recorded with q into a register, and the keys still to
+    // be replayed by @, which handlers read before the terminal
+    char recordingRegister, lastMacro;
+    std::string recordedKeys;
+    std::vector<int> replayKeys;
+    size_t replayPos;
+    // The keys of --keys, which a headless run reads instead of getch()
+    std::vector<int> typedKeys;
+    size_t typedPos;
+    // Nested @ and :normal runs, and the macros a top-level @ has called,
+    // so a macro that calls itself stops
+    int macroDepth, macroCalls;
+
+    // Set while a macro runs so its edits share one undo snapshot
+    bool undoSuspended;
+
+    // Undo/Redo functionality; undoBytes counts the text in both
+    std::deque<std::vector<std::string>> undoStack;
+    std::deque<std::vector<std::string>> redoStack;
+    size_t undoBytes;
+
+    // Search state; the prompt character tells ':' commands from '/' and '?'
+    char commandPrompt;
+    std::string lastSearch;
+    bool lastSearchForward;
+    TrigramIndex searchIndex;
+    BracketIndex brackets;
+    TimeIndex timeIndex;
+    ColumnLayout columns;
+    FoldTree folds;
+
+    // Marks a-z and the Ctrl-O / Ctrl-I jump list, all anchors that follow edits
+    AnchorTree anchors;
+    AnchorTree::Handle marks[26];
+    std::vector<AnchorTree::Handle> jumps;
+    int jumpIndex;
+
+    // Extra cursors for multi-cursor editing, the primary one is cursorX/Y
+    std::vector<AnchorTree::Handle> cursors;
+
+    // Per-file state of the buffers in the background.  The current buffer
+    // lives in the editor's own fields and is swapped in and out, so the
+    // rest of the code keeps working on `lines`, `cursorY` and so on.
+    struct Buffer {
+        std::string fileName;
+        std::vector<std::string> lines;
+        int cursorX = 0, cursorY = 0, offsetY = 0;
+        std::deque<std::vector<std::string>> undoStack, redoStack;
+        size_t undoBytes = 0;
+        TrigramIndex searchIndex;
+        BracketIndex brackets;
+        TimeIndex timeIndex;
+        ColumnLayout columns;
+        FoldTree folds;
+        AnchorTree anchors;
+        AnchorTree::Handle marks[26];
+        std::vector<AnchorTree::Handle> jumps;
+        int jumpIndex = 0;
+        std::vector<AnchorTree::Handle> cursors;
+        bool modified = false;
+        uint64_t contentHash = 0;
+        bool noEndOfLine = false;
+        bool indexSaved = false;
+        FileKey diskKey = {0, 0, 0, 0};
+        bool diskChanged = false;
+        bool following = false, followOpenLine = false;
+        uint64_t followOffset = 0;
+        size_t followLimit = 0, droppedLines = 0;
+        LineFilter filter;
+
+        bool loaded = false;        // the file is read when first shown
+        size_t bytes = 0;           // size of `lines` when it was left
+        unsigned long lastUsed = 0;
+
+        Buffer() { std::fill(marks, marks + 26, -1); }
+    };
+    std::vector<Buffer> buffers;
+    int currentBuffer;
+    unsigned long bufferClock;
+
+    // Windows are the leaves of a layout tree whose inner nodes split their
+    // area side by side (vertical) or one above the other.  The active
+    // window's cursor and scroll position are the editor's cursorX/Y and
+    // offsetY; the others keep their cursor as an anchor in their buffer,
+    // so it follows edits made through another window.
+    struct Window {
+        int buffer = 0;
+        AnchorTree::Handle cursor = -1;
+        int offsetY = 0;
+        bool vertical = false;
+        int children[2] = {-1, -1};
+        int parent = -1;
+        int top = 0, left = 0, height = 0, width = 0;  // the status line is the last row
+        int drawnOffset = -1, drawnBuffer = -1;       // what is on screen, -1 to repaint
+
+        // Field widths of a buffer in column mode, measured over the lines
+        // shown from widthsTop; -1 to measure again
+        std::vector<int> columnWidths;
+        int widthsTop = -1, widthsBuffer = -1, widthsRows = 0;
+
+        bool isLeaf() const { return children[0] < 0; }
+    };
+    std::vector<Window> windows;
+    int rootWindow, activeWindow;
+
+    // Lines of the current buffer edited since the last draw; other windows
+    // on the same buffer repaint just these rows
+    int damageTop, damageBottom;
+
+    // Background buffers share these: unmodified ones are unloaded and the
+    // oldest undo steps dropped, least recently used buffers first
+    static const size_t BUFFER_BUDGET = 256 << 20;
+    static const size_t UNDO_BUDGET = 256 << 20;
+
+    // Indentation settings for >>, << and :retab
+    int shiftWidth, tabStop;
+    bool expandTab;
+
+    // Message shown on the bottom line until the next key press, and the
+    // first error for a headless run to report
+    std::string message, error;
+
+    // Whether the buffer still matches the file on disk, and that file's hash
+    bool modified;
+    uint64_t contentHash;
+    bool noEndOfLine;  // the file's last line had no newline
+    bool indexSaved;
+
+    // Size and time of the file when it was last read or written, and
+    // whether someone else changed it since and the changes here were kept
+    FileKey diskKey;
+    bool diskChanged;
+
+    // Follow mode: bytes of the file read so far, whether its last line is
+    // still open, and the most lines kept (0 for all) with how many of the
+    // oldest were dropped to stay under it
+    bool following, followOpenLine;
+    uint64_t followOffset;
+    size_t followLimit, droppedLines;
+    static const size_t FOLLOW_SLICE = 16 << 20;
+
+    // Filtered view (:g/pat/ or :v/pat/): only these lines are shown
+    LineFilter filter;
+
+    // Directories watched with inotify for changes to the open files
+    int inotifyFd;
+    std::vector<std::pair<int, std::string>> watchedDirs;
+
+    // Diff mode between two buffers, -1 while fewer are in it
+    LineDiff diff;
+    int diffBuffers[2];
+
+    // Results of :grep, navigated with :cn and :cp
+    ParallelGrep grep;
+    std::vector<ParallelGrep::Match> quickfix;
+    int quickfixIndex;
+
+    // Color pair IDs
+    const int LINE_NUMBER_COLOR = 1;
+    const int STATUS_BAR_COLOR = 2;
+    const int COMMAND_COLOR = 3;
+    const int VISUAL_COLOR = 4;
+    const int MATCH_COLOR = 5;
+    const int DIFF_ADD_COLOR = 6;
+    const int DIFF_CHANGE_COLOR = 7;
+    const int DIFF_FILLER_COLOR = 8;
+    const int FOLD_COLOR = 9;
+
+    void initColors() {
+        init_pair(LINE_NUMBER_COLOR, COLOR_BLUE, COLOR_BLACK);
+        init_pair(STATUS_BAR_COLOR, COLOR_GREEN, COLOR_BLACK);
+        init_pair(COMMAND_COLOR, COLOR_BLACK, COLOR_BLUE);
+        init_pair(VISUAL_COLOR, COLOR_WHITE, COLOR_CYAN);
+        init_pair(MATCH_COLOR, COLOR_BLACK, COLOR_CYAN);
+        init_pair(DIFF_ADD_COLOR, COLOR_BLACK, COLOR_GREEN);
+        init_pair(DIFF_CHANGE_COLOR, COLOR_BLACK, COLOR_YELLOW);
+        init_pair(DIFF_FILLER_COLOR, COLOR_CYAN, COLOR_BLACK);
+        init_pair(FOLD_COLOR, COLOR_CYAN, COLOR_BLACK);
+    }
+
+    void handleNormalModeInput(int ch);
+    void handleInsertModeInput(int ch);
+    void handleCommandModeInput(int ch);
+    void handleVisualModeInput(int ch);
+
+    // New methods for enhanced Vi functionality
+    // Normal mode forms take a line or repeat count as their range
+    void yankText(int count = 1);
+    void deleteText(int count = 1);
+    void pasteText(int count = 1);
+    void changeText(int count = 1);
+    void shiftLines(int y, int n, int levels);
+    void deleteChars(int count);
+    void setMark(int name);
+    void jumpToMark(int name, bool exact);
+    void jumpOlder(int count);
+    void jumpNewer(int count);
+    void gotoByte(long long offset);
+    void showMarks();
+    bool gotoCommand(const std::string &command);
+    bool rangeCommand(const std::string &command);
+    template <typename Nav> int parseAddress(const std::string &command, size_t &pos, Nav &nav, int &line);
+    template <typename Nav> size_t parseRange(const std::string &command, Nav &nav, int &first, int &last);
+    void globalCommand(int first, int last, const std::string &args, bool invert);
+    void showFiltered(const std::string &pattern, bool invert);
+    void moveLines(int y, int last, int dest);
+    void copyLines(int y, int last, int dest);
+    void normalKeys(const std::string &keys);
+    void sortLines(int y, int n, const std::string &args, bool reverse);
+    void uniqLines(int y, int n, const std::string &args);
+    void deleteField(int first, int last, const std::string &args);
+    void replaceRange(int y, int n, const std::vector<uint32_t> &order);
+    void spliceLines(int y, int n, std::vector<std::string> &text);
+    bool pipeThrough(const std::string &command, int y, int n, std::vector<std::string> &output);
+    void filterLines(const std::string &command, int y, int n);
+    void readCommand(const std::string &command, int y);
+    void shellCommand(const std::string &command);
+    void addCursorsForBlock(bool append);
+    void addCursorAtNextMatch();
+    bool addCursorAt(int y, int x);
+    void addCursorsAtMatches(const std::string &pattern);
+    void clearCursors();
+    void mergeCursors();
+    void toggleRecording(int name);
+    void beginInsertChange(char command, int count);
+    void recordChange(char command, int count);
+    void recordVisualChange(char op, int count);
+    void replayInsert(const Change &change, int times);
+    void repeatChange(int count, bool hasCount);
+    void runMacro(int name, int count);
+    void multiCursorKey(int ch);
+    void eraseLines(int y, int n);
+    void searchText(char prompt);
+    void searchNext(bool reverse);
+    bool findPattern(const std::string &pattern, bool forward, int &y, int &x);
+    int scanLines(const std::string &pattern, int from, int to, bool forward);
+    void showSearchStats();
+    void setOption(const std::string &args);
+    void startGrep(const std::string &args);
+    void jumpToQuickfix(int index);
+    void jumpToMatchingBracket();
+    void foldCommand(int ch, int count);
+    void buildFolds(bool indent);
+    void gotoTime(const std::string &args);
+    bool reloadFile();
+
+    // Where ex addresses point: lines of the buffer, 0-based with -1 for
+    // line 0, or nodes of the LineList a :g edits.  `at` is the current
+    // line; a failed lookup leaves its reason in `error`.
+    struct BufferNav {
+        TextEditor &editor;
+        int at;
+        std::string error;
+
+        explicit BufferNav(TextEditor &e) : editor(e), at(e.cursorY) {}
+        int zero() const { return -1; }
+        int first() const { return 0; }
+        int last() const { return editor.lines.size() - 1; }
+        bool ordered(int a, int b) const { return a <= b; }
+
+        int fail(const std::string &text) {
+            if (error.empty()) error = text;
+            return -2;
+        }
+
+        int line(int n) { return n - 1 <= last() ? n - 1 : fail("Invalid range"); }
+        int step(int y, int k) { return y + k >= -1 && y + k <= last() ? y + k : fail("Invalid range"); }
+
+        int mark(char c) {
+            if (c == '<' || c == '>') return std::min(c == '<' ? editor.visualTop : editor.visualBottom, last());
+            if (c < 'a' || c > 'z' || editor.marks[c - 'a'] < 0) return fail("Mark not set");
+            int y, x;
+            editor.anchors.get(editor.marks[c - 'a'], y, x);
+            return std::min(y, last());
+        }
+
+        // Searches wrap around the end, as / and ? do
+        int search(int y, const std::string &pattern, bool forward) {
+            int total = editor.lines.size();
+            int found = forward ? editor.scanLines(pattern, y + 1, total, true) 
+                                : editor.scanLines(pattern, 0, std::max(y, 0), false);
+            if (found < 0) {
+                found = forward ? editor.scanLines(pattern, 0, y + 1, true) 
+                                : editor.scanLines(pattern, std::max(y, 0), total, false);
+            }
+            return found >= 0 ? found : fail("Pattern not found: " + pattern);
+        }
+    };
+
+    struct ListNav {
+        TextEditor &editor;
+        LineList &list;
+        int at;
+        std::string error;
+
+        ListNav(TextEditor &e, LineList &l) : editor(e), list(l), at(l.first()) {}
+        int zero() const { return list.zero(); }
+        int first() const { return list.first(); }
+        int last() const { return list.last(); }
+        bool ordered(int a, int b) const { return list.ordered(a, b); }
+
+        int fail(const std::string &text) {
+            if (error.empty()) error = text;
+            return -2;
+        }
+
+        int line(int n) {
+            int node = list.line(n);
+            return node >= 0 ? node : fail("Invalid range");
+        }
+
+        int step(int node, int k) {
+            node = list.step(node, k);
+            return node >= 0 ? node : fail("Invalid range");
+        }
+
+        // Marks are on the original lines, which are the first nodes
+        int mark(char c) {
+            BufferNav lines(editor);
+            int y = lines.mark(c);
+            if (y < 0) return fail(lines.error);
+            return list.live(y) ? y : fail("Mark line was deleted");
+        }
+
+        int search(int node, const std::string &pattern, bool forward) {
+            node = list.find(node, forward, [&](int n) { 
+                return list.text(n, editor.lines).find(pattern) != std::string::npos; 
+            });
+            return node >= 0 ? node : fail("Pattern not found: " + pattern);
+        }
+    };
+
+    // Runs f with the cursor at the start of each of the lines ys in turn,
+    // following them through the edits f makes, all as one undo step
+    template <typename F>
+    void forEachLine(const std::vector<int> &ys, F f) {
+        std::vector<AnchorTree::Handle> handles;
+        handles.reserve(ys.size());
+        for (int y : ys) handles.push_back(anchors.add(y, 0));
+        saveCurrentStateForUndo();
+        bool suspended = undoSuspended;
+        undoSuspended = true;
+        for (AnchorTree::Handle h : handles) {
+            int y, x;
+            anchors.get(h, y, x);
+            anchors.remove(h);
+            cursorY = std::max(0, std::min(y, (int)lines.size() - 1));
+            cursorX = 0;
+            f();
+        }
+        undoSuspended = suspended;
+        scrollToCursor();
+    }
+
+    bool loadFile() {
+        std::ifstream file(fileName);
+        if (!file.is_open()) return false;
+
+        lines.clear();
+        contentHash = HASH_SEED;
+        std::string line;
+        noEndOfLine = false;
+        while (std::getline(file, line)) {
+            contentHash = hashLine(contentHash, line);
+            lines.push_back(line);
+            // Only a last line without a newline runs into the end of file
+            noEndOfLine = file.eof();
+        }
+        file.close();
+        modified = false;
+        fileKey(diskKey);
+        diskChanged = false;
+        return true;
+    }
+
+    static const uint64_t HASH_SEED = 1469598103934665603ULL;
+
+    // FNV-1a over the line and its newline, as the file is written by saveFile
+    static uint64_t hashLine(uint64_t h, const std::string &line) {
+        for (unsigned char c : line) {
+            h = (h ^ c) * 1099511628211ULL;
+        }
+        return (h ^ '\n') * 1099511628211ULL;
+    }
+
+    bool fileKey(FileKey &key) {
+        struct stat st;
+        if (stat(fileName.c_str(), &st) != 0) return false;
+        key.size = st.st_size;
+        key.mtimeSec = st.st_mtim.tv_sec;
+        key.mtimeNsec = st.st_mtim.tv_nsec;
+        key.hash = contentHash;
+        return true;
+    }
+
+    // Sidecar file holding the search index, e.g. dir/.name.pbidx
+    std::string indexPath() {
+        size_t slash = fileName.find_last_of('/');
+        if (slash == std::string::npos) return "." + fileName + ".pbidx";
+        return fileName.substr(0, slash + 1) + "." + fileName.substr(slash + 1) + ".pbidx";
+    }
+
+    // Enables the trigram index, reusing the sidecar when it is still valid
+    void openSearchIndex(bool enable) {
+        searchIndex.enabled = enable;
+        indexSaved = false;
+        if (!enable) {
+            searchIndex.clear();
+            return;
+        }
+        FileKey key;
+        if (!modified && fileKey(key) && 
+            searchIndex.load(indexPath(), key, lines.size())) {
+            indexSaved = true;
+            return;
+        }
+        searchIndex.reset(lines.size());
+    }
+
+    // Edit notifications keep the per-buffer indexes in step with `lines`
+    void linesChanged(int y, int n = 1) {
+        modified = true;
+        damageTop = std::min(damageTop, y);
+        damageBottom = std::max(damageBottom, y + n);
+        if (diffSide(currentBuffer) >= 0) diff.edited(diffSide(currentBuffer), y, n, n);
+        if (searchIndex.enabled) searchIndex.linesChanged(y, n);
+        if (filter.active()) filter.linesChanged(lines, y, n);
+        brackets.linesChanged(y, n);
+        timeIndex.linesChanged(y, n);
+    }
+
+    // moveAnchors is false for an edit that has already remapped them
+    void linesInserted(int y, int n, bool moveAnchors = true) {
+        modified = true;
+        damageTop = std::min(damageTop, y);
+        damageBottom = INT_MAX;
+        if (diffSide(currentBuffer) >= 0) diff.edited(diffSide(currentBuffer), y, 0, n);
+        if (searchIndex.enabled) searchIndex.linesInserted(y, n);
+        if (filter.active()) filter.linesInserted(lines, y, n);
+        brackets.linesInserted(y, n);
+        timeIndex.linesInserted(y, n);
+        if (!folds.empty()) folds.linesInserted(y, n);
+        if (moveAnchors) anchors.insertLines(y, n);
+    }
+
+    void linesErased(int y, int n, bool moveAnchors = true) {
+        modified = true;
+        damageTop = std::min(damageTop, y);
+        damageBottom = INT_MAX;
+        if (diffSide(currentBuffer) >= 0) diff.edited(diffSide(currentBuffer), y, n, 0);
+        if (searchIndex.enabled) searchIndex.linesErased(y, n);
+        if (filter.active()) filter.linesErased(y, n);
+        brackets.linesErased(y, n);
+        timeIndex.linesErased(y, n);
+        if (!folds.empty()) folds.linesErased(y, n);
+        if (moveAnchors) anchors.eraseLines(y, n);
+    }
+
+    // Edits within a line also move the anchors to their right
+    void charsInserted(int y, int x, int n) {
+        linesChanged(y);
+        anchors.insertColumns(y, x, n);
+    }
+
+    void charsErased(int y, int x, int n) {
+        linesChanged(y);
+        anchors.eraseColumns(y, x, n);
+    }
+
+    void bufferReplaced() {
+        modified = true;
+        damageTop = 0;
+        damageBottom = INT_MAX;
+        if (diffSide(currentBuffer) >= 0) diff.replaced(diffSide(currentBuffer), lines);
+        if (searchIndex.enabled) searchIndex.reset(lines.size());
+        filter.rebuild(lines);
+        brackets.reset(lines.size());
+        timeIndex.reset(lines.size());
+        // Nothing says where the old lines went, so their folds go too
+        folds.clear();
+    }
+
+    // Which side of the diff a buffer is, -1 if it is not in one
+    int diffSide(int buffer) const {
+        if (diffBuffers[1] < 0) return -1;
+        return buffer == diffBuffers[0] ? 0 : buffer == diffBuffers[1] ? 1 : -1;
+    }
+
+    const std::vector<std::string> &bufferLines(int buffer) {
+        return buffer == currentBuffer ? lines : buffers[buffer].lines;
+    }
+
+    // The filter a buffer is shown through, if any; diff mode goes first
+    const LineFilter *bufferFilter(int buffer) {
+        const LineFilter &f = buffer == currentBuffer ? filter : buffers[buffer].filter;
+        return f.active() && diffSide(buffer) < 0 ? &f : nullptr;
+    }
+
+    bool filtered() { return bufferFilter(currentBuffer) != nullptr; }
+
+    const ColumnLayout *bufferColumns(int buffer) {
+        const ColumnLayout &c = buffer == currentBuffer ? columns : buffers[buffer].columns;
+        return c.active() ? &c : nullptr;
+    }
+
+    // The folds a buffer is drawn with; diff mode and filtered views show
+    // every line
+    FoldTree *bufferFolds(int buffer) {
+        FoldTree &f = buffer == currentBuffer ? folds : buffers[buffer].folds;
+        return !f.empty() && diffSide(buffer) < 0 && !bufferFilter(buffer) ? &f : nullptr;
+    }
+
+    bool folded() { return bufferFolds(currentBuffer) != nullptr; }
+
+    // First and last line of the closed fold that shows line y, or y
+    int foldTop(int y) {
+        FoldTree::Fold fold;
+        return folds.closedAt(y, fold) ? fold.start : y;
+    }
+
+    int foldBottom(int y) {
+        FoldTree::Fold fold;
+        return folds.closedAt(y, fold) ? fold.end : y;
+    }
+
+    // Moves the cursor to the first line of the closed fold it is in, its
+    // column kept inside that line
+    void cursorToFoldTop() {
+        cursorY = foldTop(cursorY);
+        cursorX = std::min(cursorX, (int)lines[cursorY].length());
+    }
+
+    // The line shown n rows below line y, or above it when n < 0
+    int stepFolded(int y, int n) {
+        y = foldTop(y);
+        for (; n > 0; --n) {
+            int next = foldBottom(y) + 1;
+            if (next >= (int)lines.size()) break;
+            y = foldTop(next);
+        }
+        for (; n < 0 && y > 0; ++n) y = foldTop(y - 1);
+        return y;
+    }
+
+    // Rows from shown line a down to shown line b, counting up to limit
+    int rowsBetween(int a, int b, int limit) {
+        int rows = 0;
+        for (int y = a; y < b && rows < limit; y = foldBottom(y) + 1) rows++;
+        return rows;
+    }
+
+    // The lines of N rows from the cursor, a closed fold being one row; the
+    // cursor goes to the first of them
+    int foldedCount(int count) {
+        if (!folded()) return count;
+        cursorToFoldTop();
+        return foldBottom(stepFolded(cursorY, count - 1)) - cursorY + 1;
+    }
+
+    // Opens the folds around the cursor, after a jump into one
+    void openFoldsAtCursor() {
+        if (folds.empty()) return;
+        std::vector<FoldTree::Fold> around;
+        folds.foldsAt(cursorY, around);
+        for (const FoldTree::Fold &f : around) {
+            if (f.closed) folds.setClosed(f.start, f.end, false);
+        }
+    }
+
+    // zf and :fold - a closed fold over lines a to b, and the cursor onto
+    // its first line
+    void makeFold(int a, int b) {
+        if (a > b) std::swap(a, b);
+        a = std::max(0, a);
+        b = std::min(b, lastLine());
+        if (!folds.add(a, b, true)) {
+            errorMessage("Folds can only nest, not overlap");
+            return;
+        }
+        cursorToFoldTop();
+        damageTop = 0;
+        damageBottom = INT_MAX;
+        scrollToCursor();
+    }
+
+    // Where the cursor is drawn in the active window's text
+    int cursorColumn() {
+        FoldTree::Fold fold;
+        if (folded() && folds.closedAt(cursorY, fold)) return 0;
+        if (!columns.active()) return cursorX;
+        return columns.screenX(lines[cursorY], cursorX, windows[activeWindow].columnWidths);
+    }
+
+    // The cursor column after moving from line `from` to cursorY: in
+    // column mode the same field and offset into it
+    int verticalColumn(int from, int x) {
+        int length = lines[cursorY].length();
+        if (!columns.active() || from == cursorY) return std::min(x, length);
+        std::vector<int> starts;
+        columns.fieldStarts(lines[from], starts);
+        size_t field = ColumnLayout::fieldAt(starts, x);
+        int offset = x - starts[field];
+        columns.fieldStarts(lines[cursorY], starts);
+        if (field >= starts.size()) return starts.back();
+        return starts[field] + std::min(offset, ColumnLayout::fieldEnd(lines[cursorY], starts, field) - starts[field]);
+    }
+
+    void clearFilter() {
+        filter.clear();
+        damageTop = 0;
+        damageBottom = INT_MAX;
+        scrollToCursor();
+    }
+
+    // Last line of the buffer, or of the filtered view
+    int lastLine() {
+        return filtered() && filter.matches() ? filter.lineAt(filter.matches() - 1, -1) : lines.size() - 1;
+    }
+
+    // How long to wait for a key: not at all while index work is queued,
+    // a short poll while :grep runs on other threads, forever otherwise
+    int idleTimeout() {
+        if (searchIndex.enabled && (!searchIndex.isComplete() || 
+                                    (!indexSaved && !modified))) return 0;
+        if (grep.running()) return 100;
+        if (following && followOffset < diskKey.size) return 0;
+        return -1;
+    }
+
+    // Background work done a slice at a time while no key is pending,
+    // returns true when the screen needs redrawing
+    bool doIdleWork() {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(15);
+        if (searchIndex.enabled && searchIndex.refresh(lines, deadline) && 
+            !indexSaved && !modified) {
+            FileKey key;
+            if (fileKey(key)) searchIndex.save(indexPath(), key);
+            indexSaved = true;
+        }
+
+        bool reloaded = inotifyFd >= 0 && readFileEvents();
+        if (following && followOffset < diskKey.size) reloaded = followFile() || reloaded;
+        if (grep.running()) {
+            grep.drain(quickfix);
+            if (!grep.running()) grepFinished();
+            return true;
+        }
+        return reloaded;
+    }
+
+    static std::string directoryOf(const std::string &path) {
+        size_t slash = path.rfind('/');
+        return slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    }
+
+    // Watches the file's directory rather than the file, so that a file
+    // replaced by rename, as many programs save, is still seen
+    void watchFile(const std::string &name) {
+        if (inotifyFd < 0) return;
+        std::string dir = directoryOf(name);
+        for (const auto &watched : watchedDirs) {
+            if (watched.second == dir) return;
+        }
+        int wd = inotify_add_watch(inotifyFd, dir.c_str(), 
+                                   IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+        if (wd >= 0) watchedDirs.emplace_back(wd, dir);
+    }
+
+    // Drains the inotify events.  The current buffer is checked at once,
+    // the others when they are next shown.  True if the view changed.
+    bool readFileEvents() {
+        alignas(inotify_event) char buffer[4096];
+        std::string dir = directoryOf(fileName);
+        std::string base = fileName.substr(fileName.rfind('/') + 1);
+        bool touched = false;
+        ssize_t got;
+        while ((got = read(inotifyFd, buffer, sizeof buffer)) > 0) {
+            for (char *p = buffer; p < buffer + got;) {
+                const inotify_event *event = reinterpret_cast<const inotify_event *>(p);
+                p += sizeof(inotify_event) + event->len;
+                if (event->len == 0 || base != event->name) continue;
+                for (const auto &watched : watchedDirs) {
+                    if (watched.first == event->wd && watched.second == dir) touched = true;
+                }
+            }
+        }
+        return touched && syncWithDisk();
+    }
+
+    bool syncWithDisk() {
+        return following ? followFile() : checkDisk();
+    }
+
+    // Reads what was appended to the followed file, a slice per call so the
+    // screen keeps up while a burst is read; true if the buffer changed
+    bool followFile() {
+        FileKey now;
+        if (!fileKey(now)) return false;
+        if (now.size < followOffset) {
+            // Truncated or replaced, as by log rotation: start over
+            saveCurrentStateForUndo();
+            lines.assign(1, "");
+            bufferReplaced();
+            followOffset = 0;
+            followOpenLine = true;
+            noEndOfLine = false;
+            droppedLines = 0;
+            cursorY = cursorX = offsetY = 0;
+        }
+        diskKey = now;
+        if (now.size == followOffset) return false;
+
+        int fd = open(fileName.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        uint64_t size = now.size - followOffset;
+        std::string bytes(size < FOLLOW_SLICE ? size : FOLLOW_SLICE, '\0');
+        ssize_t got = pread(fd, &bytes[0], bytes.size(), followOffset);
+        close(fd);
+        if (got <= 0) return false;
+        followOffset += got;
+
+        bool atEnd = cursorY >= lastLine(), wasModified = modified;
+        int oldSize = lines.size();
+        const char *p = bytes.data(), *end = p + got;
+        if (followOpenLine) {
+            const char *newline = (const char *)memchr(p, '\n', end - p);
+            const char *stop = newline ? newline : end;
+            lines.back().append(p, stop);
+            linesChanged(oldSize - 1);
+            p = newline ? newline + 1 : end;
+        }
+        while (p < end) {
+            const char *newline = (const char *)memchr(p, '\n', end - p);
+            const char *stop = newline ? newline : end;
+            lines.emplace_back(p, stop);
+            p = newline ? newline + 1 : end;
+        }
+        followOpenLine = bytes[got - 1] != '\n';
+        noEndOfLine = followOpenLine;
+        if ((int)lines.size() > oldSize) linesInserted(oldSize, lines.size() - oldSize);
+        trimFollowed();
+
+        // The buffer still mirrors the file, so only edits made here count
+        modified = wasModified;
+        contentHash = 0;
+        indexSaved = true;
+        if (atEnd) {
+            cursorY = lastLine();
+            cursorX = 0;
+            scrollToCursor();
+        }
+        return true;
+    }
+
+    // Drops the oldest lines once there are an eighth more than the limit,
+    // so the erase is paid once per many appends
+    void trimFollowed() {
+        if (!followLimit || lines.size() <= followLimit + followLimit / 8) return;
+        int excess = lines.size() - followLimit;
+        lines.erase(lines.begin(), lines.begin() + excess);
+        bool wasModified = modified;
+        linesErased(0, excess);
+        modified = wasModified;
+        droppedLines += excess;
+        cursorY = std::max(0, cursorY - excess);
+        offsetY = std::max(0, offsetY - excess);
+    }
+
+    // Brings the buffer up to date with its file if someone else changed
+    // it: at once when there is nothing to lose, else after asking
+    bool checkDisk() {
+        FileKey now;
+        if (diskChanged || !fileKey(now) || now.sameStat(diskKey)) return false;
+        if (modified) {
+            int answer = 'k';
+            if (!headless) {
+                statusMessage("\"" + fileName + "\" changed on disk: [l]oad it and lose your changes, "
+                              "or [k]eep yours? ");
+                display();
+                answer = nextKey();
+            }
+            if (answer != 'l' && answer != 'L') {
+                diskChanged = true;
+                statusMessage("Kept your changes; :w! overwrites the file on disk");
+                return true;
+            }
+        }
+        reloadFile();
+        return true;
+    }
+
+    // The next key for a command that reads more than one (dd, "a, m...):
+    // from the macro being replayed if there is one, else the terminal
+    int nextKey() {
+        if (replayPos < replayKeys.size()) return replayKeys[replayPos++];
+        int ch = readKey();
+        if (recordingRegister) encodeKey(recordedKeys, ch);
+        return ch;
+    }
+
+    // A key from the terminal, or in a headless run from --keys, where
+    // running out of them cancels like Escape
+    int readKey() {
+        if (!headless) return getch();
+        return typedPos < typedKeys.size() ? typedKeys[typedPos++] : 27;
+    }
+
+    // Macros keep keys in a register as bytes, with curses keys above 255
+    // stored as a zero byte and two bytes of key code
+    static void encodeKey(std::string &keys, int ch) {
+        if (ch >= 0 && ch < 256 && ch != 0) {
+            keys += static_cast<char>(ch);
+        } else {
+            keys += '\0';
+            keys += static_cast<char>((ch >> 8) & 0xFF);
+            keys += static_cast<char>(ch & 0xFF);
+        }
+    }
+
+    static std::vector<int> decodeKeys(const std::string &keys) {
+        std::vector<int> decoded;
+        decoded.reserve(keys.length());
+        for (size_t i = 0; i < keys.length(); ++i) {
+            if (keys[i] != '\0' || i + 2 >= keys.length()) {
+                decoded.push_back((unsigned char)keys[i]);
+            } else {
+                decoded.push_back((unsigned char)keys[i + 1] << 8 | (unsigned char)keys[i + 2]);
+                i += 2;
+            }
+        }
+        return decoded;
+    }
+
+    // Returns the next key, or ERR when background work wants a redraw
+    int waitForKey() {
+        while (true) {
+            if (idleTimeout() < 0 && inotifyFd >= 0) {
+                // Sleep until a key arrives or a watched file changes
+                timeout(0);
+                int ch = getch();
+                timeout(-1);
+                if (ch != ERR) return ch;
+                pollfd fds[2] = {{0, POLLIN, 0}, {inotifyFd, POLLIN, 0}};
+                poll(fds, 2, -1);
+                if (fds[1].revents & POLLIN && readFileEvents()) return ERR;
+                continue;
+            }
+            timeout(idleTimeout());
+            int ch = getch();
+            if (ch != ERR || doIdleWork()) {
+                timeout(-1);
+                return ch;
+            }
+        }
+    }
+
+    void grepFinished() {
+        std::ostringstream result;
+        result << "grep: " << quickfix.size() << " matches in " 
+               << grep.filesSearched << " files";
+        if (grep.filesSkipped > 0) result << " (" << grep.filesSkipped << " binary skipped)";
+        if (grep.wasCancelled()) result << " - interrupted";
+        if (quickfixIndex < 0 && !quickfix.empty()) jumpToQuickfix(0);
+        statusMessage(result.str());
+    }
+
+    int findBuffer(const std::string &name) {
+        for (size_t i = 0; i < buffers.size(); ++i) {
+            if (i == (size_t)currentBuffer ? fileName == name : buffers[i].fileName == name) return i;
+        }
+        buffers.emplace_back();
+        buffers.back().fileName = name;
+        watchFile(name);
+        return buffers.size() - 1;
+    }
+
+    // :e, also used to follow :grep matches into other files
+    bool editFile(const std::string &name) {
+        return switchToBuffer(findBuffer(name));
+    }
+
+    void swapBuffer(Buffer &b) {
+        std::swap(fileName, b.fileName);
+        std::swap(lines, b.lines);
+        std::swap(cursorX, b.cursorX);
+        std::swap(cursorY, b.cursorY);
+        std::swap(offsetY, b.offsetY);
+        std::swap(undoStack, b.undoStack);
+        std::swap(redoStack, b.redoStack);
+        std::swap(undoBytes, b.undoBytes);
+        std::swap(searchIndex, b.searchIndex);
+        std::swap(brackets, b.brackets);
+        std::swap(timeIndex, b.timeIndex);
+        std::swap(columns, b.columns);
+        std::swap(folds, b.folds);
+        std::swap(anchors, b.anchors);
+        std::swap(marks, b.marks);
+        std::swap(jumps, b.jumps);
+        std::swap(jumpIndex, b.jumpIndex);
+        std::swap(cursors, b.cursors);
+        std::swap(modified, b.modified);
+        std::swap(contentHash, b.contentHash);
+        std::swap(noEndOfLine, b.noEndOfLine);
+        std::swap(indexSaved, b.indexSaved);
+        std::swap(diskKey, b.diskKey);
+        std::swap(diskChanged, b.diskChanged);
+        std::swap(following, b.following);
+        std::swap(followOpenLine, b.followOpenLine);
+        std::swap(followOffset, b.followOffset);
+        std::swap(followLimit, b.followLimit);
+        std::swap(droppedLines, b.droppedLines);
+        std::swap(filter, b.filter);
+    }
+
+    // Shows another buffer with the cursor and view it was left with,
+    // reading the file the first time
+    bool switchToBuffer(int index) {
+        if (index == currentBuffer) return true;
+        clearCursors();
+        Buffer &previous = buffers[currentBuffer];
+        swapBuffer(previous);
+        previous.bytes = linesBytes(previous.lines);
+        previous.lastUsed = ++bufferClock;
+
+        currentBuffer = index;
+        windows[activeWindow].buffer = index;
+        Buffer &next = buffers[index];
+        swapBuffer(next);
+        bool wasLoaded = next.loaded;
+        if (!next.loaded) {
+            if (!loadFile()) {
+                lines.assign(1, "");
+                contentHash = 0;
+            }
+            if (lines.empty()) lines.push_back("");
+            openSearchIndex((int)lines.size() >= 4 * TrigramIndex::CHUNK_LINES);
+            brackets.reset(lines.size());
+            timeIndex.reset(lines.size());
+            filter.rebuild(lines);
+            next.loaded = true;
+        }
+        cursorY = std::min(cursorY, (int)lines.size() - 1);
+        cursorX = std::min(cursorX, (int)lines[cursorY].length());
+        unloadIdleBuffers();
+        trimUndo();
+        statusMessage("\"" + fileName + "\" " + std::to_string(lines.size()) + " lines");
+        // It may have changed on disk while in the background
+        if (wasLoaded) syncWithDisk();
+        return true;
+    }
+
+    static size_t linesBytes(const std::vector<std::string> &text) {
+        size_t bytes = 0;
+        for (const std::string &line : text) bytes += line.length() + sizeof(std::string);
+        return bytes;
+    }
+
+    // Least recently used background buffer that `usable` accepts
+    template <typename F>
+    Buffer *oldestBuffer(F usable) {
+        Buffer *oldest = nullptr;
+        for (size_t i = 0; i < buffers.size(); ++i) {
+            if ((int)i == currentBuffer || !usable(buffers[i])) continue;
+            if (!oldest || buffers[i].lastUsed < oldest->lastUsed) oldest = &buffers[i];
+        }
+        return oldest;
+    }
+
+    // Unloads unmodified background buffers while they take more than the
+    // budget; they are read again, cursor and marks intact, when shown
+    void unloadIdleBuffers() {
+        size_t total = 0;
+        for (size_t i = 0; i < buffers.size(); ++i) {
+            if ((int)i != currentBuffer && buffers[i].loaded) total += buffers[i].bytes;
+        }
+        while (total > BUFFER_BUDGET) {
+            Buffer *b = oldestBuffer([this](const Buffer &b) { 
+                return b.loaded && !b.modified && !bufferShown(&b - &buffers[0]) && 
+                       diffSide(&b - &buffers[0]) < 0; 
+            });
+            if (!b) break;
+            total -= b->bytes;
+            std::vector<std::string>().swap(b->lines);
+            b->undoStack.clear();
+            b->redoStack.clear();
+            b->undoBytes = 0;
+            b->searchIndex = TrigramIndex();
+            b->brackets = BracketIndex();
+            b->timeIndex = TimeIndex();
+            b->filter.release();
+            b->bytes = 0;
+            b->loaded = false;
+        }
+    }
+
+    // All buffers share one undo budget: the oldest steps of the least
+    // recently used buffers go first, the current buffer's last
+    void trimUndo() {
+        size_t total = undoBytes;
+        for (size_t i = 0; i < buffers.size(); ++i) {
+            if ((int)i != currentBuffer) total += buffers[i].undoBytes;
+        }
+        while (total > UNDO_BUDGET) {
+            Buffer *b = oldestBuffer([](const Buffer &b) { return b.undoBytes > 0; });
+            std::deque<std::vector<std::string>> *stack = b ? &b->undoStack : &undoStack;
+            size_t *bytes = b ? &b->undoBytes : &undoBytes;
+            if (b && !b->redoStack.empty()) stack = &b->redoStack;
+            if (stack->empty() || (!b && stack->size() == 1)) break;
+            size_t dropped = linesBytes(stack->front());
+            stack->pop_front();
+            *bytes -= std::min(*bytes, dropped);
+            total -= std::min(total, dropped);
+        }
+    }
+
+    // :diffthis - the first buffer waits for a second one, then both are diffed
+    void diffThis() {
+        if (diffSide(currentBuffer) >= 0) return;
+        if (diffBuffers[0] < 0 || diffBuffers[0] == currentBuffer || diffBuffers[1] >= 0) {
+            diffOff();
+            diffBuffers[0] = currentBuffer;
+            statusMessage("diff: :diffthis in a second buffer to compare");
+            return;
+        }
+        diffBuffers[1] = currentBuffer;
+        if (!buffers[diffBuffers[0]].loaded) {
+            // Unloaded while it waited: read it again
+            switchToBuffer(diffBuffers[0]);
+            switchToBuffer(diffBuffers[1]);
+        }
+        diffUpdate();
+    }
+
+    // :diffupdate - diffs the two buffers from scratch
+    void diffUpdate() {
+        if (diffBuffers[1] < 0) {
+            errorMessage("No diff: use :diffthis in two buffers");
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        diff.reset(bufferLines(diffBuffers[0]), bufferLines(diffBuffers[1]));
+        long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        scrollToCursor();
+        statusMessage("diff: " + std::to_string(diff.hunks.size()) + " hunks in " + 
+                      std::to_string(ms) + " ms");
+    }
+
+    void diffOff() {
+        diffBuffers[0] = diffBuffers[1] = -1;
+        diff.clear();
+        for (Window &w : windows) w.drawnOffset = -1;
+    }
+
+    // ]c and [c - the next or previous hunk of the diff
+    void jumpToHunk(bool forward, int count) {
+        int side = diffSide(currentBuffer);
+        if (side < 0) return;
+        diff.refresh(bufferLines(diffBuffers[0]), bufferLines(diffBuffers[1]));
+        int y = cursorY;
+        for (int i = 0; i < count; ++i) {
+            int next = diff.nextHunk(side, y, forward);
+            if (next < 0) break;
+            y = next;
+        }
+        if (y == cursorY) return;
+        pushJump();
+        cursorY = std::min(y, (int)lines.size() - 1);
+        cursorX = 0;
+        scrollToCursor();
+    }
+
+    // ]f and [f - the start of the next or previous field of the line
+    void jumpToField(bool forward, int count) {
+        if (!columns.active()) {
+            statusMessage("Not in column mode, see :csv");
+            return;
+        }
+        std::vector<int> starts;
+        columns.fieldStarts(lines[cursorY], starts);
+        int field = ColumnLayout::fieldAt(starts, cursorX);
+        // Back from inside a field goes to its start first
+        if (!forward && cursorX > starts[field]) field++;
+        field += forward ? count : -count;
+        cursorX = starts[std::max(0, std::min(field, (int)starts.size() - 1))];
+    }
+
+    // :csv [delimiter] shows the buffer as aligned columns, split at the
+    // delimiter given ("tab" for a tab) or at one guessed from the first
+    // lines; :nocsv goes back to plain lines
+    void columnMode(const std::string &args) {
+        if (args.empty()) {
+            if (!columns.detect(lines)) {
+                errorMessage("No delimiter found, give one as :csv <char>");
+                return;
+            }
+        } else {
+            char d = args == "tab" || args == "\\t" ? '\t' : args.length() == 1 ? args[0] : 0;
+            if (!d || d == '"') {
+                errorMessage("Invalid delimiter: " + args);
+                return;
+            }
+            columns.set(d, ColumnLayout::detectQuote(lines, d));
+        }
+        for (Window &w : windows) w.widthsTop = -1;
+        damageTop = 0;
+        damageBottom = INT_MAX;
+        char d = columns.separator();
+        statusMessage(std::string("Columns split at ") + (d == '\t' ? "tab" : std::string(1, d)) + 
+                      (columns.quoting() ? ", quoted with \"" : ""));
+    }
+
+    void clearColumns() {
+        columns.clear();
+        damageTop = 0;
+        damageBottom = INT_MAX;
+    }
+
+    bool bufferShown(int index) {
+        for (const Window &w : windows) {
+            if (w.isLeaf() && w.buffer == index) return true;
+        }
+        return false;
+    }
+
+    // Anchors of the buffer a window shows
+    AnchorTree &windowAnchors(const Window &w) {
+        return w.buffer == currentBuffer ? anchors : buffers[w.buffer].anchors;
+    }
+
+    // :sp / :vs - the active window is split in two, both on its buffer;
+    // the new half above or left becomes active
+    void splitWindow(bool vertical) {
+        // Not laid out yet before the first draw
+        int room = vertical ? windows[activeWindow].width : windows[activeWindow].height;
+        if (room > 0 && room < 4) {
+            errorMessage("Not enough room");
+            return;
+        }
+        int node = windows.size();
+        windows.emplace_back();
+        windows.emplace_back();
+        windows.emplace_back();
+        Window &split = windows[node], &first = windows[node + 1], &second = windows[node + 2];
+        Window &old = windows[activeWindow];
+        split.vertical = vertical;
+        split.parent = old.parent;
+        split.children[0] = node + 1;
+        split.children[1] = node + 2;
+        first.parent = second.parent = node;
+        first.buffer = second.buffer = old.buffer;
+        first.offsetY = second.offsetY = offsetY;
+        second.cursor = anchors.add(cursorY, cursorX);
+        replaceWindow(activeWindow, node);
+        old.buffer = -1;
+        activeWindow = node + 1;
+    }
+
+    // Puts `node` where `old` was in the layout tree
+    void replaceWindow(int old, int node) {
+        int parent = windows[old].parent;
+        windows[node].parent = parent;
+        if (parent < 0) {
+            rootWindow = node;
+        } else {
+            Window &p = windows[parent];
+            p.children[p.children[0] == old ? 0 : 1] = node;
+        }
+    }
+
+    // Makes another window active; the one left keeps its cursor as an anchor
+    void focusWindow(int index) {
+        if (index == activeWindow) return;
+        clearCursors();
+        Window &left = windows[activeWindow];
+        left.cursor = anchors.add(cursorY, cursorX);
+        left.offsetY = offsetY;
+        left.drawnOffset = -1;
+        activeWindow = index;
+        Window &w = windows[index];
+        int buffer = w.buffer;
+        if (buffer != currentBuffer) {
+            // The buffer is switched from the window's side
+            w.buffer = currentBuffer;
+            switchToBuffer(buffer);
+        }
+        anchors.get(w.cursor, cursorY, cursorX);
+        anchors.remove(w.cursor);
+        w.cursor = -1;
+        offsetY = w.offsetY;
+        cursorY = std::min(cursorY, (int)lines.size() - 1);
+        cursorX = std::min(cursorX, (int)lines[cursorY].length());
+        scrollToCursor();
+    }
+
+    // Leaves in layout order, for Ctrl-W w and W
+    void leafWindows(int node, std::vector<int> &leaves) {
+        if (windows[node].isLeaf()) {
+            leaves.push_back(node);
+            return;
+        }
+        leafWindows(windows[node].children[0], leaves);
+        leafWindows(windows[node].children[1], leaves);
+    }
+
+    void cycleWindow(int step) {
+        std::vector<int> leaves;
+        leafWindows(rootWindow, leaves);
+        int at = std::find(leaves.begin(), leaves.end(), activeWindow) - leaves.begin();
+        focusWindow(leaves[(at + step + leaves.size()) % leaves.size()]);
+    }
+
+    // Ctrl-W h/j/k/l - the window beside the cursor in that direction
+    void moveToWindow(int dy, int dx) {
+        const Window &from = windows[activeWindow];
+        int y = from.top + std::min(screenRow(cursorY), from.height - 1);
+        int x = from.left + std::min(cursorColumn() + 5, from.width - 1);
+        if (dy < 0) y = from.top - 1;
+        if (dy > 0) y = from.top + from.height;
+        if (dx < 0) x = from.left - 2;
+        if (dx > 0) x = from.left + from.width + 1;
+        for (size_t i = 0; i < windows.size(); ++i) {
+            const Window &w = windows[i];
+            if (!w.isLeaf() || w.buffer < 0) continue;
+            if (y >= w.top && y < w.top + w.height && x >= w.left && x < w.left + w.width) {
+                focusWindow(i);
+                return;
+            }
+        }
+    }
+
+    // :close - the sibling takes over the parent's area; false for the last window
+    bool closeWindow() {
+        int parent = windows[activeWindow].parent;
+        if (parent < 0) return false;
+        Window &p = windows[parent];
+        int sibling = p.children[p.children[0] == activeWindow ? 1 : 0];
+        replaceWindow(parent, sibling);
+        windows[activeWindow].buffer = -1;
+        p.children[0] = p.children[1] = -1;
+        p.buffer = -1;
+
+        int next = sibling;
+        while (!windows[next].isLeaf()) next = windows[next].children[0];
+        windows[activeWindow].cursor = -1;
+        Window &w = windows[next];
+        // The closed window's position is dropped, not saved
+        int buffer = w.buffer;
+        activeWindow = next;
+        if (buffer != currentBuffer) {
+            w.buffer = currentBuffer;
+            switchToBuffer(buffer);
+        }
+        anchors.get(w.cursor, cursorY, cursorX);
+        anchors.remove(w.cursor);
+        w.cursor = -1;
+        offsetY = w.offsetY;
+        cursorY = std::min(cursorY, (int)lines.size() - 1);
+        cursorX = std::min(cursorX, (int)lines[cursorY].length());
+        scrollToCursor();
+        compactWindows();
+        return true;
+    }
+
+    // :only - closes every window but the active one
+    void onlyWindow() {
+        for (Window &w : windows) {
+            if (w.isLeaf() && w.buffer >= 0 && w.cursor >= 0) windowAnchors(w).remove(w.cursor);
+        }
+        Window single = windows[activeWindow];
+        single.parent = -1;
+        windows.assign(1, single);
+        rootWindow = activeWindow = 0;
+        windows[0].drawnOffset = -1;
+        erase();
+    }
+
+    // Drops the nodes of closed windows once they outnumber the live ones
+    void compactWindows() {
+        std::vector<int> leaves;
+        leafWindows(rootWindow, leaves);
+        if (windows.size() < 4 * leaves.size()) return;
+        std::vector<Window> kept;
+        activeWindow = copyWindows(rootWindow, -1, kept);
+        rootWindow = 0;
+        windows.swap(kept);
+    }
+
+    // Copies the subtree at `node` into `kept`; returns where the active window went
+    int copyWindows(int node, int parent, std::vector<Window> &kept) {
+        int at = kept.size(), active = node == activeWindow ? at : -1;
+        kept.push_back(windows[node]);
+        kept[at].parent = parent;
+        if (!windows[node].isLeaf()) {
+            for (int i = 0; i < 2; ++i) {
+                kept[at].children[i] = kept.size();
+                active = std::max(active, copyWindows(windows[node].children[i], at, kept));
+            }
+        }
+        return active;
+    }
+
+    // Ctrl-W and the window command after it
+    void windowCommand() {
+        int ch = nextKey();
+        switch (ch) {
+            case 'w': case 23: cycleWindow(1); break;
+            case 'W': cycleWindow(-1); break;
+            case 'h': case KEY_LEFT: moveToWindow(0, -1); break;
+            case 'j': case KEY_DOWN: moveToWindow(1, 0); break;
+            case 'k': case KEY_UP: moveToWindow(-1, 0); break;
+            case 'l': case KEY_RIGHT: moveToWindow(0, 1); break;
+            case 's': case 'S': splitWindow(false); break;
+            case 'v': splitWindow(true); break;
+            case 'c': case 'q': 
+                if (!closeWindow()) {
+                    if (ch == 'q') quitRequested = true;
+                    else errorMessage("Cannot close last window");
+                }
+                break;
+            case 'o': onlyWindow(); break;
+        }
+    }
+
+    // :ls - number, % for the current buffer, + if modified, and the line
+    void listBuffers() {
+        std::ostringstream list;
+        for (size_t i = 0; i < buffers.size(); ++i) {
+            bool current = (int)i == currentBuffer;
+            const Buffer &b = buffers[i];
+            list << (i ? " | " : "") << i + 1 << (current ? " %" : " ") 
+                 << ((current ? modified : b.modified) ? "+" : "") 
+                 << " \"" << (current ? fileName : b.fileName) << "\"";
+            if (current || b.loaded) list << " line " << (current ? cursorY : b.cursorY) + 1;
+        }
+        statusMessage(list.str());
+    }
+
+    void saveCurrentStateForUndo() {
+        if (undoSuspended) return;
+        keepForUndo(std::vector<std::string>(lines));
+    }
+
+    // Makes `snapshot`, the buffer before an edit, the next undo step
+    // without copying it again
+    void keepForUndo(std::vector<std::string> &&snapshot) {
+        undoBytes += linesBytes(snapshot);
+        undoStack.push_back(std::move(snapshot));
+        // Clear redo stack when a new action is performed
+        for (const auto &snapshot : redoStack) undoBytes -= std::min(undoBytes, linesBytes(snapshot));
+        redoStack.clear();
+        trimUndo();
+    }
+
+    void undo() {
+        if (!undoStack.empty()) {
+            // Save current state to redo stack
+            redoStack.push_back(lines);
+            undoBytes += linesBytes(lines);
+            
+            // Restore previous state
+            lines = std::move(undoStack.back());
+            undoStack.pop_back();
+            undoBytes -= std::min(undoBytes, linesBytes(lines));
+            bufferReplaced();
+
+            // Adjust cursor if needed
+            cursorY = std::min(cursorY, (int)lines.size() - 1);
+            cursorX = std::min(cursorX, (int)lines[cursorY].length());
+        }
+    }
+
+    void redo() {
+        if (!redoStack.empty()) {
+            // Save current state to undo stack
+            undoStack.push_back(lines);
+            undoBytes += linesBytes(lines);
+            
+            // Restore next state
+            lines = std::move(redoStack.back());
+            redoStack.pop_back();
+            undoBytes -= std::min(undoBytes, linesBytes(lines));
+            bufferReplaced();
+
+            // Adjust cursor if needed
+            cursorY = std::min(cursorY, (int)lines.size() - 1);
+            cursorX = std::min(cursorX, (int)lines[cursorY].length());
+        }
+    }
+
+    // Refuses to overwrite changes made to the file by someone else since
+    // it was read, unless forced with :w!
+    bool saveFile(bool force = false) {
+        FileKey now;
+        if (!force && (diskChanged || (fileKey(now) && !now.sameStat(diskKey)))) {
+            errorMessage("File changed on disk since it was read (add ! to override)");
+            return false;
+        }
+        if (!force && droppedLines > 0) {
+            errorMessage("Only the end of the file is loaded (add ! to override)");
+            return false;
+        }
+        // Written beside the file and renamed over it, so a failed write
+        // leaves the old file whole.  Past a file size limit the write
+        // fails instead of killing the editor.
+        struct stat st;
+        bool existed = stat(fileName.c_str(), &st) == 0;
+        std::string temp = fileName + ".pbtmp";
+        void (*oldSizeHandler)(int) = signal(SIGXFSZ, SIG_IGN);
+        std::ofstream file(temp);
+        if (!file.is_open()) {
+            signal(SIGXFSZ, oldSizeHandler);
+            errorMessage("Error saving file: " + std::string(strerror(errno)));
+            return false;
+        }
+
+        // The last line gets a newline unless the file had none there
+        uint64_t hash = HASH_SEED;
+        for (size_t i = 0; i < lines.size() && file.good(); ++i) {
+            file << lines[i];
+            if (i + 1 < lines.size() || !noEndOfLine) file << '\n';
+            hash = hashLine(hash, lines[i]);
+        }
+        file.flush();
+        file.close();
+        signal(SIGXFSZ, oldSizeHandler);
+        if (!file.good() || (existed && chmod(temp.c_str(), st.st_mode & 07777) != 0) ||
+            rename(temp.c_str(), fileName.c_str()) != 0) {
+            errorMessage("Can't write " + fileName + ": " + strerror(errno));
+            unlink(temp.c_str());
+            return false;
+        }
+        contentHash = hash;
+        modified = false;
+        indexSaved = false;
+        fileKey(diskKey);
+        diskChanged = false;
+        statusMessage("File saved successfully.");
+        return true;
+    }
+
+    void insertChar(int ch) {
+        lines[cursorY].insert(cursorX, 1, ch);
+        charsInserted(cursorY, cursorX, 1);
+        cursorX++;
+    }
+
+    void backspace() {
+        if (cursorX > 0) {
+            lines[cursorY].erase(cursorX - 1, 1);
+            charsErased(cursorY, cursorX - 1, 1);
+            cursorX--;
+        } else if (cursorY > 0) {
+            cursorX = lines[cursorY - 1].length();
+            lines[cursorY - 1] += lines[cursorY];
+            lines.erase(lines.begin() + cursorY);
+            anchors.moveTail(cursorY, 0, cursorY - 1, cursorX);
+            linesErased(cursorY, 1);
+            linesChanged(cursorY - 1);
+            cursorY--;
+            if (cursorY < offsetY) offsetY--;
+        }
+    }
+
+    void newLine() {
+        std::string newLine = lines[cursorY].substr(cursorX);
+        lines[cursorY] = lines[cursorY].substr(0, cursorX);
+        lines.insert(lines.begin() + cursorY + 1, newLine);
+        linesChanged(cursorY);
+        linesInserted(cursorY + 1, 1);
+        anchors.moveTail(cursorY, cursorX, cursorY + 1, -cursorX);
+        cursorY++;
+        cursorX = 0;
+        scrollToCursor();
+    }
+
+    // Inserts text at the cursor, each newline splitting the line, and
+    // leaves the cursor after it; used to replay an insert session
+    void insertText(const std::string &text) {
+        size_t nl = text.find('\n');
+        if (nl == std::string::npos) {
+            lines[cursorY].insert(cursorX, text);
+            charsInserted(cursorY, cursorX, text.length());
+            cursorX += text.length();
+            return;
+        }
+
+        std::string tail = lines[cursorY].substr(cursorX);
+        lines[cursorY].replace(cursorX, std::string::npos, text, 0, nl);
+        std::vector<std::string> added;
+        for (size_t start = nl + 1;; start = nl + 1) {
+            nl = text.find('\n', start);
+            added.push_back(text.substr(start, nl == std::string::npos ? nl : nl - start));
+            if (nl == std::string::npos) break;
+        }
+        int newX = added.back().length();
+        added.back() += tail;
+        int n = added.size();
+        lines.insert(lines.begin() + cursorY + 1, 
+                     std::make_move_iterator(added.begin()), std::make_move_iterator(added.end()));
+        linesChanged(cursorY);
+        linesInserted(cursorY + 1, n);
+        anchors.moveTail(cursorY, cursorX, cursorY + n, newX - cursorX);
+        cursorY += n;
+        cursorX = newX;
+        scrollToCursor();
+    }
+
+    void moveUp(int count = 1) {
+        if (filtered()) {
+            moveShown(-count);
+        } else if (folded()) {
+            moveFolded(-count);
+        } else if (cursorY > 0) {
+            int from = cursorY;
+            cursorY = std::max(0, cursorY - count);
+            cursorX = verticalColumn(from, cursorX);
+            scrollToCursor();
+        }
+    }
+
+    void moveDown(int count = 1) {
+        if (filtered()) {
+            moveShown(count);
+        } else if (folded()) {
+            moveFolded(count);
+        } else if (cursorY < (int)lines.size() - 1) {
+            int from = cursorY;
+            cursorY = std::min((int)lines.size() - 1, cursorY + count);
+            cursorX = verticalColumn(from, cursorX);
+            scrollToCursor();
+        }
+    }
+
+    // Over folds j and k step a closed fold at a time, onto its first line
+    void moveFolded(int count) {
+        int from = cursorY;
+        cursorY = stepFolded(cursorY, count);
+        cursorX = verticalColumn(from, cursorX);
+        scrollToCursor();
+    }
+
+    // In a filtered view j and k step over the shown lines only
+    void moveShown(int count) {
+        int row = filter.rank(cursorY, cursorY) + count, from = cursorY;
+        cursorY = filter.lineAt(std::max(0, std::min(row, filter.rows(cursorY) - 1)), cursorY);
+        cursorX = verticalColumn(from, cursorX);
+        scrollToCursor();
+    }
+
+    void moveLeft(int count = 1) {
+        for (int i = 0; i < count; ++i) {
+            if (cursorX > 0) {
+                cursorX--;
+            } else if (cursorY > 0) {
+                cursorY--;
+                cursorX = lines[cursorY].length();
+            } else {
+                break;
+            }
+        }
+        scrollToCursor();
+    }
+
+    void moveRight(int count = 1) {
+        for (int i = 0; i < count; ++i) {
+            if (cursorX < (int)lines[cursorY].length()) {
+                cursorX++;
+            } else if (cursorY < (int)lines.size() - 1) {
+                cursorY++;
+                cursorX = 0;
+            } else {
+                break;
+            }
+        }
+        scrollToCursor();
+    }
+
+    // Runs a cursor movement for the primary cursor and every extra one
+    template <typename F>
+    void forEachCursor(F move) {
+        int y = cursorY, x = cursorX, top = offsetY;
+        for (AnchorTree::Handle h : cursors) {
+            anchors.get(h, cursorY, cursorX);
+            move();
+            anchors.set(h, cursorY, cursorX);
+        }
+        cursorY = y;
+        cursorX = x;
+        offsetY = top;
+        move();
+    }
+
+    // Remembers the cursor before a jump, for Ctrl-O / Ctrl-I
+    void pushJump() {
+        for (size_t i = 0; i < jumps.size(); ++i) {
+            int y, x;
+            anchors.get(jumps[i], y, x);
+            if (y == cursorY) {
+                anchors.remove(jumps[i]);
+                jumps.erase(jumps.begin() + i);
+                break;
+            }
+        }
+        jumps.push_back(anchors.add(cursorY, cursorX));
+        if (jumps.size() > 100) {
+            anchors.remove(jumps.front());
+            jumps.erase(jumps.begin());
+        }
+        jumpIndex = jumps.size();
+    }
+
+    // Moves the cursor to an anchor, clamped in case undo shrank the buffer
+    void gotoAnchor(AnchorTree::Handle h) {
+        int y, x;
+        anchors.get(h, y, x);
+        cursorY = std::max(0, std::min(y, (int)lines.size() - 1));
+        cursorX = std::max(0, std::min(x, (int)lines[cursorY].length()));
+        scrollToCursor();
+    }
+
+    // Goes to the first non-blank of a 1-based line number, as with NG
+    void gotoLine(int line) {
+        cursorY = std::max(0, std::min(line, (int)lines.size()) - 1);
+        cursorX = classRunEnd(lines[cursorY], 0, CLASS_BLANK, false);
+        openFoldsAtCursor();
+        scrollToCursor();
+    }
+
+    // Word motions (w, W) walk the class table over the raw line bytes and
+    // move the cursor once at the end, however large the count
+    void moveToNextWord(int count = 1, bool bigWord = false) {
+        int y = cursorY, x = cursorX;
+        int last = lines.size() - 1;
+        for (int k = 0; k < count; ++k) {
+            const std::string &line = lines[y];
+            if (x < (int)line.length()) {
+                int cls = charClass(line[x], bigWord);
+                if (cls != CLASS_BLANK) x = classRunEnd(line, x, cls, bigWord);
+                x = classRunEnd(line, x, CLASS_BLANK, bigWord);
+                if (x < (int)line.length()) continue;
+            }
+            // Continue on the following lines, an empty line counts as a word
+            bool found = false;
+            while (!found && y < last) {
+                y++;
+                x = classRunEnd(lines[y], 0, CLASS_BLANK, bigWord);
+                found = lines[y].empty() || x < (int)lines[y].length();
+            }
+            if (!found) {
+                x = lines[y].length();
+                break;
+            }
+        }
+        cursorY = y;
+        cursorX = x;
+        scrollToCursor();
+    }
+
+    // b, B
+    void moveToPreviousWord(int count = 1, bool bigWord = false) {
+        int y = cursorY, x = cursorX;
+        for (int k = 0; k < count; ++k) {
+            // Step back to the previous non-blank, stopping on empty lines
+            bool atStart = false, emptyLine = false;
+            while (true) {
+                if (x == 0) {
+                    if (y == 0) {
+                        atStart = true;
+                        break;
+                    }
+                    y--;
+                    x = lines[y].length();
+                    if (x == 0) {
+                        emptyLine = true;
+                        break;
+                    }
+                    continue;
+                }
+                int i = x - 1;
+                if (charClass(lines[y][i], bigWord) == CLASS_BLANK) {
+                    i = (int)classRunStart(lines[y], i, CLASS_BLANK, bigWord) - 1;
+                }
+                if (i >= 0) {
+                    x = i;
+                    break;
+                }
+                x = 0;
+            }
+            if (atStart) break;
+            if (emptyLine) continue;
+            x = classRunStart(lines[y], x, charClass(lines[y][x], bigWord), bigWord);
+        }
+        cursorY = y;
+        cursorX = x;
+        scrollToCursor();
+    }
+
+    // e, E
+    void moveToWordEnd(int count = 1, bool bigWord = false) {
+        int y = cursorY, x = cursorX;
+        int last = lines.size() - 1;
+        for (int k = 0; k < count; ++k) {
+            // Always advance, then skip blanks and empty lines
+            x++;
+            while (true) {
+                x = classRunEnd(lines[y], std::min(x, (int)lines[y].length()), CLASS_BLANK, bigWord);
+                if (x < (int)lines[y].length() || y == last) break;
+                y++;
+                x = 0;
+            }
+            if (x >= (int)lines[y].length()) {
+                x = std::max(0, (int)lines[y].length() - 1);
+                break;
+            }
+            x = classRunEnd(lines[y], x, charClass(lines[y][x], bigWord), bigWord) - 1;
+        }
+        cursorY = y;
+        cursorX = x;
+        scrollToCursor();
+    }
+
+    void moveToLineStart() {
+        cursorX = 0;
+    }
+
+    void moveToLineEnd() {
+        cursorX = lines[cursorY].length();
+    }
+
+    // Keeps the cursor on screen: scrolls when it is just off the edge and
+    // centers the view when it jumped further away
+    void scrollToCursor() {
+        int rows = viewRows();
+        int side = diffSide(currentBuffer);
+        if (side >= 0) {
+            // Filler rows count too: scroll by aligned rows
+            int top = scrollTop(diff.lineToRow(side, cursorY), diff.lineToRow(side, offsetY), rows);
+            bool filler;
+            offsetY = std::min(diff.rowToLine(side, top, filler), cursorY);
+        } else if (filtered()) {
+            // Only the shown lines take rows
+            int top = scrollTop(filter.rank(cursorY, cursorY), filter.rank(offsetY, cursorY), rows);
+            offsetY = filter.lineAt(top, cursorY);
+        } else if (folded()) {
+            // A closed fold takes one row, as scrollTop with rows counted
+            // by stepping over the folds
+            int row = foldTop(cursorY), top = foldTop(offsetY);
+            if (row < top) {
+                offsetY = rowsBetween(row, top, rows) <= rows / 2 ? row : stepFolded(row, -(rows / 2));
+            } else {
+                int below = rowsBetween(top, row, 2 * rows);
+                offsetY = below < rows ? top
+                        : below - rows < rows / 2 ? stepFolded(top, below - rows + 1)
+                                                  : stepFolded(row, -(rows / 2));
+            }
+        } else {
+            offsetY = scrollTop(cursorY, offsetY, rows);
+        }
+    }
+
+    static int scrollTop(int row, int top, int rows) {
+        if (row < top) return top - row <= rows / 2 ? row : std::max(0, row - rows / 2);
+        if (row >= top + rows) return row - top - rows < rows / 2 ? row - rows + 1 : std::max(0, row - rows / 2);
+        return top;
+    }
+
+    void moveToDocumentStart() {
+        cursorY = filtered() && filter.matches() ? filter.lineAt(0, -1) : 0;
+        cursorX = 0;
+        offsetY = cursorY;
+    }
+
+    void moveToDocumentEnd() {
+        cursorY = lastLine();
+        cursorX = lines[cursorY].length();
+        if (folded()) {
+            cursorToFoldTop();
+            offsetY = stepFolded(cursorY, 1 - viewRows());
+            return;
+        }
+        offsetY = filtered() ? filter.lineAt(std::max(0, filter.rows(cursorY) - viewRows()), cursorY)
+                             : std::max(0, (int)lines.size() - viewRows());
+    }
+
+    // Row of line y in the active window, -1 if a filter hides it; lines
+    // in a closed fold are on the fold's row
+    int screenRow(int y) {
+        int side = diffSide(currentBuffer);
+        if (side >= 0) return diff.lineToRow(side, y) - diff.lineToRow(side, offsetY);
+        if (folded()) {
+            int row = foldTop(y), top = foldTop(offsetY);
+            return row < top ? -1 : rowsBetween(top, row, viewRows() + 1);
+        }
+        if (!filtered()) return y - offsetY;
+        int row = filter.rank(y, cursorY);
+        if (filter.lineAt(row, cursorY) != y) return -1;
+        return row - filter.rank(offsetY, cursorY);
+    }
+
+    // Text rows of the active window
+    int viewRows() {
+        int height = windows[activeWindow].height;
+        return height > 0 ? height - 1 : (headless ? HEADLESS_LINES : LINES) - 2;
+    }
+
+    // Gives every window in the subtree its part of the area; a window
+    // whose area changed is repainted in full
+    void layoutWindows(int node, int top, int left, int height, int width) {
+        Window &w = windows[node];
+        if (w.top != top || w.left != left || w.height != height || w.width != width) {
+            w.drawnOffset = -1;
+        }
+        w.top = top;
+        w.left = left;
+        w.height = height;
+        w.width = width;
+        if (w.isLeaf()) return;
+        if (w.vertical) {
+            // Side by side with a one column separator
+            int first = std::max(1, (width - 1) / 2);
+            layoutWindows(w.children[0], top, left, height, first);
+            layoutWindows(w.children[1], top, left + first + 1, height, std::max(1, width - first - 1));
+            attron(COLOR_PAIR(LINE_NUMBER_COLOR));
+            mvvline(top, left + first, '|', height);
+            attroff(COLOR_PAIR(LINE_NUMBER_COLOR));
+        } else {
+            int first = std::max(2, height / 2);
+            layoutWindows(w.children[0], top, left, first, width);
+            layoutWindows(w.children[1], top + first, left, std::max(2, height - first), width);
+        }
+    }
+
+    void display() {
+        if (diffBuffers[1] >= 0) diff.refresh(bufferLines(diffBuffers[0]), bufferLines(diffBuffers[1]));
+        layoutWindows(rootWindow, 0, 0, LINES - 1, COLS);
+        for (size_t w = 0; w < windows.size(); ++w) {
+            if (windows[w].isLeaf() && windows[w].buffer >= 0) drawWindow(w);
+        }
+        damageTop = INT_MAX;
+        damageBottom = -1;
+
+        // If in command mode, display command buffer
+        move(LINES - 1, 0);
+        clrtoeol();
+        if (mode == EditorMode::COMMAND) {
+            attron(COLOR_PAIR(COMMAND_COLOR));
+            mvprintw(LINES - 1, 0, "%c%s", commandPrompt, commandBuffer.c_str());
+            attroff(COLOR_PAIR(COMMAND_COLOR));
+        } else if (!message.empty()) {
+            mvprintw(LINES - 1, 0, "%s", message.c_str());
+        }
+
+        const Window &active = windows[activeWindow];
+        move(active.top + screenRow(cursorY), active.left + std::min(cursorColumn() + 5, active.width - 1));
+        refresh();
+    }
+
+    // Draws a window's rows.  The active one is drawn whole, since its
+    // cursor and selection move; the others only when they scrolled or
+    // when an edit through another window damaged the lines they show.
+    void drawWindow(int index) {
+        Window &w = windows[index];
+        bool active = index == activeWindow;
+        const std::vector<std::string> &text = bufferLines(w.buffer);
+        int rows = w.height - 1;
+
+        // Windows in diff mode show aligned rows and scroll together
+        int side = diffSide(w.buffer), activeSide = diffSide(currentBuffer), topRow = 0;
+        if (side >= 0) {
+            topRow = active ? diff.lineToRow(side, offsetY) 
+                   : activeSide >= 0 ? diff.lineToRow(activeSide, offsetY) 
+                                     : diff.lineToRow(side, w.offsetY);
+            bool filler;
+            if (!active) w.offsetY = diff.rowToLine(side, topRow, filler);
+        }
+        int top = active ? offsetY : w.offsetY;
+
+        // Filtered windows show the matching lines and the cursor's line
+        const LineFilter *shown = bufferFilter(w.buffer);
+        int pin = active ? cursorY : -1;
+        if (shown) topRow = shown->rank(top, pin);
+
+        // Folded windows show a closed fold as one row
+        FoldTree *foldTree = bufferFolds(w.buffer);
+        std::vector<FoldTree::Fold> foldRows;
+        for (int y = top; foldTree && (int)foldRows.size() < rows && y < (int)text.size(); ) {
+            FoldTree::Fold fold;
+            if (!foldTree->closedAt(y, fold)) fold = {y, y, false};
+            foldRows.push_back(fold);
+            y = fold.end + 1;
+        }
+        auto rowLine = [&](int i, bool &filler) {
+            filler = false;
+            if (side >= 0) return diff.rowToLine(side, topRow + i, filler);
+            if (foldTree) return i < (int)foldRows.size() ? foldRows[i].start : (int)text.size();
+            return shown ? shown->lineAt(topRow + i, pin) : top + i;
+        };
+
+        // Column mode measures the fields on screen when the view moves and
+        // then only widens them for a line being edited, so columns stay put
+        // while typing
+        const ColumnLayout *columns = bufferColumns(w.buffer);
+        if (columns) {
+            // Edits to more than a line (a paste, :sort, undo) measure anew
+            bool fresh = w.widthsTop != top || w.widthsBuffer != w.buffer || w.widthsRows != rows || 
+                         (w.buffer == currentBuffer && damageBottom - damageTop > 1);
+            if (fresh) w.columnWidths.clear();
+            if (fresh || (w.buffer == currentBuffer && damageTop < damageBottom)) {
+                for (int i = 0; i < rows; ++i) {
+                    bool filler;
+                    int y = rowLine(i, filler);
+                    if (filler || y < 0 || y >= (int)text.size()) continue;
+                    if (fresh || (y >= damageTop && y < damageBottom)) columns->measure(text[y], w.columnWidths);
+                }
+            }
+            w.widthsTop = top;
+            w.widthsBuffer = w.buffer;
+            w.widthsRows = rows;
+        }
+        auto screenX = [&](const std::string &line, int x) {
+            return columns ? columns->screenX(line, x, w.columnWidths) : x;
+        };
+
+        int from = 0, to = rows;
+        if (!active && side < 0 && !shown && !columns && !foldTree && w.drawnOffset == top && w.drawnBuffer == w.buffer) {
+            if (w.buffer != currentBuffer || damageTop >= damageBottom) {
+                from = to = 0;
+            } else {
+                from = std::max(0, damageTop - top);
+                to = damageBottom - top < rows ? std::max(0, damageBottom - top) : rows;
+            }
+        }
+        w.drawnOffset = top;
+        w.drawnBuffer = w.buffer;
+
+        bool visual = active && (mode == EditorMode::VISUAL || 
+                                 mode == EditorMode::VISUAL_LINE || 
+                                 mode == EditorMode::VISUAL_BLOCK);
+        int selectTop = std::min(visualStartY, cursorY);
+        int selectBottom = std::max(visualStartY, cursorY);
+        int selectLeft = std::min(visualStartX, cursorX);
+        int selectRight = std::max(visualStartX, cursorX);
+        int textWidth = std::max(0, w.width - 5);
+
+        // Draw the visible lines of text with line numbers
+        for (int i = from; i < to; ++i) {
+            int row = w.top + i;
+            bool filler;
+            int lineIndex = rowLine(i, filler);
+            mvhline(row, w.left, ' ', w.width);
+            if (filler) {
+                // Lines the other side has here
+                attron(COLOR_PAIR(DIFF_FILLER_COLOR));
+                mvhline(row, w.left, '-', w.width);
+                attroff(COLOR_PAIR(DIFF_FILLER_COLOR));
+                continue;
+            }
+            if (lineIndex < 0 || lineIndex >= (int)text.size()) continue;
+            bool closedFold = foldTree && foldRows[i].closed;
+
+            // Display line number
+            attron(COLOR_PAIR(LINE_NUMBER_COLOR));
+            std::ostringstream lineNumber;
+            lineNumber << std::setw(4) << lineIndex + 1;
+            mvaddnstr(row, w.left, (lineNumber.str() + " ").c_str(), w.width);
+            attroff(COLOR_PAIR(LINE_NUMBER_COLOR));
+
+            if (closedFold) {
+                // The fold's size and first line, like vim's fold text
+                const std::string &first = text[lineIndex];
+                size_t indent = std::min(first.find_first_not_of(" \t"), first.length());
+                std::string label = "+--" + std::to_string(foldRows[i].end - lineIndex + 1) + " lines: " + 
+                                    first.substr(indent);
+                if ((int)label.length() < textWidth) label.resize(textWidth, '-');
+                attron(COLOR_PAIR(FOLD_COLOR));
+                if (textWidth > 0) mvaddnstr(row, w.left + 5, label.c_str(), textWidth);
+                attroff(COLOR_PAIR(FOLD_COLOR));
+                if (!active || textWidth <= 0) continue;
+                if (visual && foldRows[i].end >= selectTop && lineIndex <= selectBottom) {
+                    mvchgat(row, w.left + 5, textWidth, A_NORMAL, VISUAL_COLOR, nullptr);
+                } else if (!visual && cursorY >= lineIndex && cursorY <= foldRows[i].end) {
+                    mvchgat(row, w.left + 5, 1, A_REVERSE, FOLD_COLOR, nullptr);
+                }
+                continue;
+            }
+
+            // Draw the actual line of text, then the selection or cursor on top
+            const std::string &line = text[lineIndex];
+            std::string aligned;
+            if (columns) aligned = columns->render(line, w.columnWidths);
+            const std::string &drawn = columns ? aligned : line;
+            if (textWidth > 0) mvaddnstr(row, w.left + 5, drawn.c_str(), textWidth);
+            if (side >= 0 && textWidth > 0) {
+                LineDiff::LineKind kind = diff.kind(side, lineIndex);
+                if (kind != LineDiff::SAME) {
+                    mvchgat(row, w.left + 5, textWidth, A_NORMAL, 
+                            kind == LineDiff::ADDED ? DIFF_ADD_COLOR : DIFF_CHANGE_COLOR, nullptr);
+                }
+            }
+            if (!active) continue;
+            if (visual && lineIndex >= selectTop && lineIndex <= selectBottom) {
+                int start = mode == EditorMode::VISUAL_LINE ? 0 : screenX(line, selectLeft);
+                int end = mode == EditorMode::VISUAL_LINE || selectRight + 1 >= (int)line.length() 
+                        ? drawn.length() : screenX(line, selectRight + 1);
+                end = std::min(end, textWidth);
+                if (end > start) mvchgat(row, w.left + 5 + start, end - start, A_NORMAL, VISUAL_COLOR, nullptr);
+            } else if (!visual && lineIndex == cursorY && screenX(line, cursorX) < textWidth) {
+                mvchgat(row, w.left + 5 + screenX(line, cursorX), 1, A_REVERSE, 0, nullptr);
+            }
+        }
+
+        if (active) {
+            // Extra cursors of a multi-cursor edit
+            for (AnchorTree::Handle h : cursors) {
+                int y, x;
+                anchors.get(h, y, x);
+                int row = screenRow(y);
+                x = screenX(lines[y], x);
+                if (row >= 0 && row < rows && x < textWidth) {
+                    mvchgat(w.top + row, w.left + 5 + x, 1, A_REVERSE, 0, nullptr);
+                }
+            }
+
+            // Highlight the bracket matching the one under the cursor
+            if (mode == EditorMode::NORMAL || mode == EditorMode::INSERT) {
+                int matchY = cursorY, matchX = cursorX;
+                if (matchX < (int)lines[matchY].length() && 
+                    brackets.findMatch(lines, matchY, matchX) && 
+                    screenRow(matchY) >= 0 && screenRow(matchY) < rows && 
+                    screenX(lines[matchY], matchX) < textWidth) {
+                    mvaddch(w.top + screenRow(matchY), w.left + 5 + screenX(lines[matchY], matchX), 
+                            lines[matchY][matchX] | COLOR_PAIR(MATCH_COLOR));
+                }
+            }
+        }
+
+        // Draw the status bar
+        attron(COLOR_PAIR(STATUS_BAR_COLOR));
+        displayStatusBar(w, active);
+        attroff(COLOR_PAIR(STATUS_BAR_COLOR));
+    }
+
+    void displayStatusBar(const Window &w, bool active) {
+        std::ostringstream status;
+        if (active) {
+            // Display current mode
+            std::string modeStr;
+            switch(mode) {
+                case EditorMode::NORMAL: modeStr = "NORMAL"; break;
+                case EditorMode::INSERT: modeStr = "INSERT"; break;
+                case EditorMode::COMMAND: modeStr = "COMMAND"; break;
+                case EditorMode::VISUAL: modeStr = "VISUAL"; break;
+                case EditorMode::VISUAL_LINE: modeStr = "VISUAL LINE"; break;
+                case EditorMode::VISUAL_BLOCK: modeStr = "VISUAL BLOCK"; break;
+            }
+
+            status << "Mode: " << modeStr << " | "
+                   << "Pos: (" << cursorY + 1 << "," << cursorX + 1 
+                   << ") | File: " << fileName;
+            if (buffers.size() > 1) status << " [" << currentBuffer + 1 << "/" << buffers.size() << "]";
+            if (!cursors.empty()) status << " | " << cursors.size() + 1 << " cursors";
+            if (recordingRegister) status << " | recording @" << recordingRegister;
+            if (following) status << " | following";
+            if (columns.active()) {
+                status << " | csv " << (columns.separator() == '\t' ? "tab" : std::string(1, columns.separator()));
+            }
+            if (filter.active()) {
+                status << " | " << (filter.inverted() ? "v/" : "g/") << filter.pattern() << "/ " 
+                       << filter.matches() << " lines";
+            }
+            if (grep.running()) {
+                status << " | grep: " << grep.matchCount << " matches, " 
+                       << grep.filesSearched << " files (Ctrl-C to stop)";
+            }
+        } else {
+            bool current = w.buffer == currentBuffer;
+            status << "File: " << (current ? fileName : buffers[w.buffer].fileName) 
+                   << ((current ? modified : buffers[w.buffer].modified) ? " [+]" : "");
+        }
+
+        // Pad the status message to fit the window width
+        std::string statusStr = status.str();
+        statusStr.resize(w.width, ' ');
+        mvaddnstr(w.top + w.height - 1, w.left, statusStr.c_str(), w.width);
+    }
+
+    void statusMessage(const std::string &text) {
+        message = text;
+    }
+
+    // Like statusMessage, but a headless run exits with an error
+    void errorMessage(const std::string &text) {
+        message = text;
+        if (!failed) error = text;
+        failed = true;
+    }
+
+    // Yank/paste registers, and the one named with " for the next command
+    Registers registers;
+    char pendingRegister;
+
+    int CTRL(char c) { return c & 0x1F; }
+};
+
+void TextEditor::searchText(char prompt) {
+    mode = EditorMode::COMMAND;
+    commandPrompt = prompt;
+    commandBuffer.clear();
+}
+
+void TextEditor::searchNext(bool reverse) {
+    if (lastSearch.empty()) {
+        statusMessage("No previous search pattern");
+        return;
+    }
+
+    bool forward = lastSearchForward != reverse;
+    int y = cursorY, x = cursorX;
+    if (!findPattern(lastSearch, forward, y, x)) {
+        statusMessage("Pattern not found: " + lastSearch);
+        return;
+    }
+    if ((forward && (y < cursorY || (y == cursorY && x <= cursorX))) ||
+        (!forward && (y > cursorY || (y == cursorY && x >= cursorX)))) {
+        statusMessage(forward ? "search hit BOTTOM, continuing at TOP" 
+                              : "search hit TOP, continuing at BOTTOM");
+    }
+
+    pushJump();
+    cursorY = y;
+    cursorX = x;
+    openFoldsAtCursor();
+    scrollToCursor();
+}
+
+// Finds the next occurrence after (or before) y/x, wrapping around the buffer
+bool TextEditor::findPattern(const std::string &pattern, bool forward, int &y, int &x) {
+    int total = lines.size();
+
+    if (forward) {
+        size_t pos = lines[y].find(pattern, x + 1);
+        if (pos != std::string::npos) {
+            x = pos;
+            return true;
+        }
+        int found = scanLines(pattern, y + 1, total, true);
+        if (found < 0) found = scanLines(pattern, 0, y + 1, true);
+        if (found < 0) return false;
+        y = found;
+        x = lines[y].find(pattern);
+        return true;
+    }
+
+    if (x > 0) {
+        size_t pos = lines[y].rfind(pattern, x - 1);
+        if (pos != std::string::npos) {
+            x = pos;
+            return true;
+        }
+    }
+    int found = scanLines(pattern, 0, y, false);
+    if (found < 0) found = scanLines(pattern, y, total, false);
+    if (found < 0) return false;
+    y = found;
+    x = lines[y].rfind(pattern);
+    return true;
+}
+
+// Returns the first (or last) line in [from, to) containing the pattern,
+// skipping the chunks the trigram index rules out
+int TextEditor::scanLines(const std::string &pattern, int from, int to, bool forward) {
+    bool useIndex = searchIndex.enabled && pattern.length() >= 3;
+    std::vector<uint32_t> hashes;
+    if (useIndex) {
+        hashes = TrigramIndex::patternHashes(pattern);
+        searchIndex.lookups++;
+    }
+    LineChunks<TrigramIndex::Signature> &chunks = searchIndex.layout();
+
+    int y = forward ? from : to - 1;
+    while (forward ? y < to : y >= from) {
+        int stop = forward ? to : from - 1;
+        bool clean = false;
+        if (useIndex) {
+            int c = chunks.chunkOf(y);
+            int first = chunks.firstLine(c);
+            stop = forward ? std::min(to, first + chunks[c].lines) 
+                           : std::max(from, first) - 1;
+            clean = !chunks[c].dirty;
+            if (clean) {
+                searchIndex.chunksChecked++;
+                if (!searchIndex.mayContain(c, hashes)) {
+                    searchIndex.chunksSkipped++;
+                    y = stop;
+                    continue;
+                }
+                searchIndex.chunksScanned++;
+            }
+        }
+
+        for (; y != stop; y += forward ? 1 : -1) {
+            if (lines[y].find(pattern) != std::string::npos) {
+                if (clean) searchIndex.chunksMatched++;
+                return y;
+            }
+        }
+    }
+    return -1;
+}
+
+void TextEditor::showSearchStats() {
+    if (!searchIndex.enabled) {
+        statusMessage("Search index disabled (:set trigram to enable)");
+        return;
+    }
+
+    LineChunks<TrigramIndex::Signature> &chunks = searchIndex.layout();
+    std::ostringstream stats;
+    stats << std::fixed << std::setprecision(1)
+          << "index: " << chunks.count() << " chunks, "
+          << searchIndex.memoryBytes() / (1024.0 * 1024.0) << " MB, "
+          << 100.0 * searchIndex.builtChunks() / chunks.count() << "% built"
+          << " | searches: " << searchIndex.lookups
+          << " | chunks skipped: " << searchIndex.chunksSkipped << "/" 
+          << searchIndex.chunksChecked;
+    if (searchIndex.chunksChecked > 0) {
+        stats << " (" << 100.0 * searchIndex.chunksSkipped / searchIndex.chunksChecked << "%)";
+    }
+    if (searchIndex.chunksScanned > 0) {
+        stats << " | candidate hit rate: " 
+              << 100.0 * searchIndex.chunksMatched / searchIndex.chunksScanned << "%";
+    }
+    statusMessage(stats.str());
+}
+
+// :grep pattern [dir], the pattern may be quoted to include spaces
+void TextEditor::startGrep(const std::string &args) {
+    std::string pattern, root;
+    size_t start = args.find_first_not_of(' ');
+    if (start == std::string::npos) {
+        statusMessage("Usage: :grep pattern [dir or file]");
+        return;
+    }
+    size_t end;
+    if (args[start] == '"' || args[start] == '\'') {
+        end = args.find(args[start], start + 1);
+        if (end == std::string::npos) end = args.length();
+        pattern = args.substr(start + 1, end - start - 1);
+        end++;
+    } else {
+        end = args.find(' ', start);
+        if (end == std::string::npos) end = args.length();
+        pattern = args.substr(start, end - start);
+    }
+    if (end < args.length()) {
+        size_t dirStart = args.find_first_not_of(' ', end);
+        if (dirStart != std::string::npos) root = args.substr(dirStart);
+    }
+    while (root.length() > 1 && root.back() == '/') root.pop_back();
+    if (root.empty()) root = ".";
+    if (pattern.empty()) {
+        statusMessage("Usage: :grep pattern [dir or file]");
+        return;
+    }
+    if (access(root.c_str(), R_OK) != 0) {
+        errorMessage("Can't search " + root + ": " + strerror(errno));
+        return;
+    }
+
+    quickfix.clear();
+    quickfixIndex = -1;
+    grep.start(pattern, root);
+    // A headless run has no idle loop to gather the matches, so it waits
+    if (headless) {
+        while (grep.running()) {
+            poll(nullptr, 0, 10);
+            grep.drain(quickfix);
+        }
+        grepFinished();
+    }
+}
+
+void TextEditor::jumpToQuickfix(int index) {
+    if (quickfix.empty()) {
+        statusMessage("No quickfix entries");
+        return;
+    }
+    if (index < 0 || index >= (int)quickfix.size()) {
+        statusMessage(index < 0 ? "No previous match" : "No more matches");
+        return;
+    }
+
+    const ParallelGrep::Match &match = quickfix[index];
+    if (match.file == fileName) pushJump();
+    if (!editFile(match.file)) return;
+    quickfixIndex = index;
+
+    cursorY = std::min(match.line - 1, (int)lines.size() - 1);
+    cursorX = std::min(match.col, (int)lines[cursorY].length());
+    scrollToCursor();
+
+    std::ostringstream entry;
+    entry << "(" << index + 1 << " of " << quickfix.size() << ") " 
+          << match.file << ":" << match.line << ": " << match.text;
+    statusMessage(entry.str());
+}
+
+void TextEditor::setMark(int name) {
+    if (name < 'a' || name > 'z') return;
+    AnchorTree::Handle &mark = marks[name - 'a'];
+    if (mark < 0) {
+        mark = anchors.add(cursorY, cursorX);
+    } else {
+        anchors.set(mark, cursorY, cursorX);
+    }
+}
+
+// 'a goes to the first non-blank of the mark's line, `a to its exact spot
+void TextEditor::jumpToMark(int name, bool exact) {
+    if (name < 'a' || name > 'z' || marks[name - 'a'] < 0) {
+        statusMessage("Mark not set");
+        return;
+    }
+    pushJump();
+    gotoAnchor(marks[name - 'a']);
+    if (!exact) gotoLine(cursorY + 1);
+}
+
+void TextEditor::jumpOlder(int count) {
+    if (jumpIndex == (int)jumps.size()) {
+        // Remember where we are so Ctrl-I can come back
+        pushJump();
+        jumpIndex = jumps.size() - 1;
+    }
+    if (jumpIndex == 0) return;
+    jumpIndex = std::max(0, jumpIndex - count);
+    gotoAnchor(jumps[jumpIndex]);
+}
+
+void TextEditor::jumpNewer(int count) {
+    if (jumpIndex + 1 >= (int)jumps.size()) return;
+    jumpIndex = std::min((int)jumps.size() - 1, jumpIndex + count);
+    gotoAnchor(jumps[jumpIndex]);
+}
+
+// :goto / Ngo, 1-based byte offset into the file as saveFile writes it
+void TextEditor::gotoByte(long long offset) {
+    pushJump();
+    long long start = 0;
+    int y = 0;
+    while (y + 1 < (int)lines.size() && start + (long long)lines[y].length() + 1 < offset) {
+        start += lines[y].length() + 1;
+        y++;
+    }
+    cursorY = y;
+    cursorX = std::max(0LL, std::min(offset - 1 - start, (long long)lines[y].length()));
+    scrollToCursor();
+}
+
+void TextEditor::showMarks() {
+    std::ostringstream list;
+    list << "marks:";
+    for (int i = 0; i < 26; ++i) {
+        if (marks[i] < 0) continue;
+        int y, x;
+        anchors.get(marks[i], y, x);
+        list << " " << (char)('a' + i) << " " << y + 1 << ":" << x + 1;
+    }
+    statusMessage(list.str());
+}
+
+// :123 goes to a line, :50% to a percentage of the file, :goto N to a byte
+bool TextEditor::gotoCommand(const std::string &command) {
+    size_t digits = command.find_first_not_of("0123456789");
+    if (digits == 0 && (command.compare(0, 5, "goto ") == 0 || 
+                        command.compare(0, 3, "go ") == 0)) {
+        long long offset = std::atoll(command.c_str() + command.find(' ') + 1);
+        gotoByte(std::max(1LL, offset));
+        return true;
+    }
+    if (digits == 0) return false;
+
+    long long value = std::atoll(command.c_str());
+    if (digits == std::string::npos) {
+        pushJump();
+        gotoLine(std::min<long long>(std::max(1LL, value), lines.size()));
+        return true;
+    }
+    if (command.substr(digits) == "%") {
+        pushJump();
+        gotoLine((std::min(value, 100LL) * lines.size() + 99) / 100);
+        return true;
+    }
+    return false;
+}
+
+// Reads an address into `line`: a line number, . $ 'x, or /pat/ and ?pat?
+// for the next and previous line containing pat, each followed by any
+// number of +N and -N (a bare sign counting 1); signs alone count from the
+// current line.  Lines are numbered the way the Nav does.  Returns 1 for
+// an address, 0 when there is none and -1 when it cannot be resolved, the
+// reason left in nav.error.
+template <typename Nav>
+int TextEditor::parseAddress(const std::string &command, size_t &pos, Nav &nav, int &line) {
+    bool found = true;
+    char c = pos < command.length() ? command[pos] : 0;
+    if (c == '.') {
+        ++pos;
+        line = nav.at;
+    } else if (c == '$') {
+        ++pos;
+        line = nav.last();
+    } else if (std::isdigit((unsigned char)c)) {
+        int value = 0;
+        auto result = std::from_chars(command.data() + pos, command.data() + command.length(), value);
+        pos = result.ptr - command.data();
+        line = result.ec == std::errc() ? nav.line(value) : nav.fail("Invalid range");
+    } else if (c == '\'' && pos + 1 < command.length()) {
+        line = nav.mark(command[pos + 1]);
+        pos += 2;
+    } else if (c == '/' || c == '?') {
+        size_t close = command.find(c, pos + 1);
+        std::string pattern = command.substr(pos + 1, close == std::string::npos ? std::string::npos 
+                                                                                 : close - pos - 1);
+        pos = close == std::string::npos ? command.length() : close + 1;
+        if (pattern.empty()) pattern = lastSearch;
+        line = pattern.empty() ? nav.fail("No previous search pattern") 
+                               : nav.search(nav.at, pattern, c == '/');
+    } else {
+        found = false;
+        line = nav.at;
+    }
+    while (pos < command.length() && (command[pos] == '+' || command[pos] == '-')) {
+        int sign = command[pos++] == '+' ? 1 : -1, value = 1;
+        if (pos < command.length() && std::isdigit((unsigned char)command[pos])) {
+            auto result = std::from_chars(command.data() + pos, command.data() + command.length(), value);
+            pos = result.ptr - command.data();
+        }
+        if (nav.error.empty()) line = nav.step(line, sign * value);
+        found = true;
+    }
+    if (!nav.error.empty()) return -1;
+    return found ? 1 : 0;
+}
+
+// Parses the range in front of an ex command: none is the current line,
+// % every line, and after a ; the second address counts from the first.
+// Line 0 counts as the first line here.  Returns where the command starts,
+// or npos when an address cannot be resolved.
+template <typename Nav>
+size_t TextEditor::parseRange(const std::string &command, Nav &nav, int &first, int &last) {
+    first = last = nav.at;
+    size_t pos = 0;
+    if (!command.empty() && command[0] == '%') {
+        first = nav.first();
+        last = nav.last();
+        return 1;
+    }
+    int status = parseAddress(command, pos, nav, first);
+    if (status < 0) return std::string::npos;
+    if (status == 0) return pos;
+    last = first;
+    if (pos < command.length() && (command[pos] == ',' || command[pos] == ';')) {
+        if (command[pos++] == ';') nav.at = first;
+        status = parseAddress(command, pos, nav, last);
+        if (status < 0) return std::string::npos;
+        if (status == 0) last = first;
+    }
+    if (first == nav.zero()) first = nav.first();
+    if (last == nav.zero()) last = nav.first();
+    if (!nav.ordered(first, last)) std::swap(first, last);
+    return pos;
+}
+
+// Whether `word` is `full` or an abbreviation of it at least `shortest` long
+static bool abbreviates(const std::string &word, const char *full, size_t shortest) {
+    return word.length() >= shortest && std::string(full).compare(0, word.length(), word) == 0;
+}
+
+// Ex commands that take a range: d, m, t, normal, g and v, fold, sort,
+// uniq, delcol, !cmd and r !cmd.  A range alone goes to its last line.  False if the
+// command is none of these.
+bool TextEditor::rangeCommand(const std::string &command) {
+    BufferNav nav(*this);
+    int first, last;
+    size_t pos = parseRange(command, nav, first, last);
+    if (pos == std::string::npos) {
+        errorMessage(nav.error);
+        return true;
+    }
+    std::string name = command.substr(pos);
+    if (name.empty()) {
+        pushJump();
+        gotoLine(last + 1);
+        return true;
+    }
+    bool read = name.compare(0, 2, "r!") == 0 || name.compare(0, 3, "r !") == 0 || 
+                name.compare(0, 5, "read!") == 0 || name.compare(0, 6, "read !") == 0;
+    // A blank command would replace the range with nothing
+    if ((read || name[0] == '!') && 
+        name.find_first_not_of(' ', name.find('!') + 1) == std::string::npos) {
+        errorMessage("No command to run after !");
+        return true;
+    }
+    if (read) {
+        readCommand(name.substr(name.find('!') + 1), last);
+        return true;
+    }
+    if (name[0] == '!') {
+        if (pos == 0) shellCommand(name.substr(1));
+        else filterLines(name.substr(1), first, last - first + 1);
+        return true;
+    }
+
+    // The command word, a ! right after it, then its arguments
+    size_t length = std::min(name.find_first_not_of("abcdefghijklmnopqrstuvwxyz"), name.length());
+    std::string word = name.substr(0, length);
+    bool bang = length < name.length() && name[length] == '!';
+    size_t start = name.find_first_not_of(' ', length + bang);
+    std::string args = start == std::string::npos ? "" : name.substr(start);
+
+    if (word == "g" || word == "global" || word == "v" || word == "vglobal") {
+        // Without a range :g runs over the whole buffer
+        if (pos == 0) {
+            first = 0;
+            last = lines.size() - 1;
+        }
+        globalCommand(first, last, name.substr(length + bang), bang || word[0] == 'v');
+        return true;
+    }
+    if (abbreviates(word, "delete", 1)) {
+        if (!args.empty() && (args.length() > 1 || !std::isalpha((unsigned char)args[0]))) {
+            errorMessage("Trailing characters: " + args);
+            return true;
+        }
+        std::vector<std::string> deleted(lines.begin() + first, lines.begin() + last + 1);
+        registers.store(args.empty() ? 0 : args[0], Registers::LINES, std::move(deleted), true);
+        std::vector<std::string> none;
+        spliceLines(first, last - first + 1, none);
+        return true;
+    }
+    if (abbreviates(word, "move", 1) || word == "t" || abbreviates(word, "copy", 2)) {
+        size_t at = 0;
+        int dest;
+        int status = parseAddress(args, at, nav, dest);
+        if (status <= 0 || at != args.length()) {
+            errorMessage(status < 0 ? nav.error : "Invalid address: " + args);
+            return true;
+        }
+        if (word[0] == 'm') moveLines(first, last, dest);
+        else copyLines(first, last, dest);
+        return true;
+    }
+    if (abbreviates(word, "fold", 2)) {
+        cursorY = first;
+        makeFold(first, last);
+        return true;
+    }
+    if (abbreviates(word, "normal", 4)) {
+        // Whatever the keys do to the lines, each runs once
+        std::vector<int> targets;
+        for (int y = first; y <= last; ++y) targets.push_back(y);
+        forEachLine(targets, [&] { normalKeys(args); });
+        return true;
+    }
+
+    bool sort = abbreviates(word, "sort", 3), uniq = word == "uniq", delcol = word == "delcol";
+    if (!sort && !uniq && !delcol) return false;
+    // Without a range these work on the whole buffer
+    if (pos == 0) {
+        first = 0;
+        last = lines.size() - 1;
+    }
+    if (delcol) {
+        deleteField(first, last, args);
+        return true;
+    }
+    if (args.find_first_not_of(sort ? " niu0123456789" : " i") != std::string::npos) {
+        errorMessage("Invalid argument: " + args);
+        return true;
+    }
+    if (sort) sortLines(first, last - first + 1, args, bang);
+    else uniqLines(first, last - first + 1, args);
+    return true;
+}
+
+// :g/pat/cmd runs cmd on each line of the range containing pat, :g!/pat/cmd
+// and :v/pat/cmd on the others, with the cursor on the line.  The lines
+// are all found first.  Deletions, moves and copies then go to a LineList
+// and the buffer is rebuilt from it once, as one undo step, so :g/pat/d
+// is one pass over the buffer however many lines it removes; other
+// commands run line by line.  Without a command the lines are shown in a
+// filtered view instead.
+void TextEditor::globalCommand(int first, int last, const std::string &args, bool invert) {
+    char delimiter = args.empty() ? 0 : args[0];
+    if (!delimiter || std::isalnum((unsigned char)delimiter) || delimiter == ' ' || delimiter == '"') {
+        errorMessage("Regular expression missing from :g");
+        return;
+    }
+    size_t close = args.find(delimiter, 1);
+    std::string pattern = args.substr(1, close == std::string::npos ? std::string::npos : close - 1);
+    std::string command = close == std::string::npos ? "" : args.substr(close + 1);
+    if (pattern.empty()) pattern = lastSearch;
+    if (pattern.empty()) {
+        errorMessage("No previous search pattern");
+        return;
+    }
+    if (command.empty()) {
+        showFiltered(pattern, invert);
+        return;
+    }
+
+    std::vector<int> marked;
+    findLines(lines, first, last + 1, pattern, invert, marked);
+    if (marked.empty()) {
+        statusMessage("Pattern not found: " + pattern);
+        return;
+    }
+
+    // Which command it is, past its own range
+    LineList list(lines.size());
+    ListNav nav(*this, list);
+    nav.at = marked[0];
+    int a, b;
+    size_t pos = parseRange(command, nav, a, b);
+    if (pos == std::string::npos) {
+        errorMessage(nav.error);
+        return;
+    }
+    size_t length = std::min(command.find_first_not_of("abcdefghijklmnopqrstuvwxyz", pos), command.length());
+    std::string word = command.substr(pos, length - pos);
+    size_t start = command.find_first_not_of(' ', length);
+    std::string rest = start == std::string::npos ? "" : command.substr(start);
+    if (word == "g" || word == "global" || word == "v" || word == "vglobal") {
+        errorMessage("Cannot do :global recursive");
+        return;
+    }
+    bool erase = abbreviates(word, "delete", 1);
+    bool move = abbreviates(word, "move", 1), copy = word == "t" || abbreviates(word, "copy", 2);
+    auto begin = std::chrono::steady_clock::now();
+    if (!erase && !move && !copy) {
+        // Line by line, stopping at the first error
+        bool wasFailed = failed;
+        failed = false;
+        forEachLine(marked, [&] {
+            if (!failed && !rangeCommand(command)) errorMessage("Not an editor command: " + command);
+        });
+        failed = failed || wasFailed;
+        return;
+    }
+    if (erase && !rest.empty()) {
+        errorMessage("Trailing characters: " + rest);
+        return;
+    }
+
+    int cursorNode = -1;
+    for (int node : marked) {
+        if (!list.live(node)) continue;  // went with an earlier deletion
+        nav.at = node;
+        if (parseRange(command, nav, a, b) == std::string::npos) break;
+        if (erase) {
+            cursorNode = list.step(b, 1);
+            if (cursorNode < 0) cursorNode = list.step(a, -1);
+            list.erase(a, b);
+            continue;
+        }
+        size_t at = 0;
+        int dest;
+        int status = parseAddress(rest, at, nav, dest);
+        if (status <= 0 || at != rest.length()) {
+            if (status == 0 || at != rest.length()) nav.fail("Invalid address: " + rest);
+            break;
+        }
+        if (copy) {
+            cursorNode = list.copy(a, b, dest, lines);
+        } else if (list.move(a, b, dest)) {
+            cursorNode = b;
+        } else {
+            nav.fail("Cannot move a range of lines into itself");
+            break;
+        }
+    }
+    // Nothing changed unless every line went through
+    if (!nav.error.empty()) {
+        errorMessage(nav.error);
+        return;
+    }
+
+    // The old lines become the undo step as they are
+    int before = lines.size();
+    std::vector<int> index;
+    std::vector<std::string> old = list.rebuild(lines, index, !undoSuspended);
+    if (!undoSuspended) keepForUndo(std::move(old));
+    if (lines.empty()) lines.emplace_back();
+    cursorY = cursorNode >= 0 && index[cursorNode] >= 0 ? index[cursorNode] : 0;
+
+    // Marks and cursors follow their lines; those on erased lines go to the
+    // start of the next line left
+    int next = lines.size() - 1;
+    for (int i = before - 1; i >= 0; --i) {
+        if (index[i] >= 0) next = index[i];
+        else index[i] = -1 - next;
+    }
+    anchors.reorder([&](int &y, int &x) {
+        if (y >= before) return;
+        if (index[y] < 0) x = 0;
+        y = index[y] >= 0 ? index[y] : -1 - index[y];
+    });
+    bufferReplaced();
+    cursorX = classRunEnd(lines[cursorY], 0, CLASS_BLANK, false);
+    scrollToCursor();
+
+    long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - begin).count();
+    int added = (int)lines.size() - before;
+    statusMessage((added < 0 ? std::to_string(-added) + " fewer lines" : 
+                   added > 0 ? std::to_string(added) + " more lines" : 
+                               std::to_string(marked.size()) + " lines moved") + 
+                  " in " + std::to_string(ms) + " ms");
+}
+
+// :m puts lines y..last after line dest (-1 for line 0); marks on them
+// move with them
+void TextEditor::moveLines(int y, int last, int dest) {
+    if (dest >= y && dest < last) {
+        errorMessage("Cannot move a range of lines into itself");
+        return;
+    }
+    int n = last - y + 1;
+    if (dest != last && dest != y - 1) {
+        saveCurrentStateForUndo();
+        int top = std::min(y, dest + 1), bottom = std::max(last, dest);
+        if (dest < y) {
+            std::rotate(lines.begin() + top, lines.begin() + y, lines.begin() + last + 1);
+        } else {
+            std::rotate(lines.begin() + y, lines.begin() + last + 1, lines.begin() + dest + 1);
+        }
+        // The moved lines and the ones they passed swap places
+        int shift = dest < y ? top - y : dest - last;
+        int passed = dest < y ? n : -n;
+        anchors.reorder([&](int &ay, int &) {
+            if (ay >= y && ay <= last) ay += shift;
+            else if (ay >= top && ay <= bottom) ay += passed;
+        });
+        // Told as erased and inserted again, so folds go with the lines
+        linesErased(y, n, false);
+        linesInserted(y + shift, n, false);
+    }
+    gotoLine((dest < y ? dest + n : dest) + 1);
+}
+
+// :t and :co put a copy of lines y..last after line dest (-1 for line 0)
+void TextEditor::copyLines(int y, int last, int dest) {
+    int n = last - y + 1;
+    std::vector<std::string> copied(lines.begin() + y, lines.begin() + last + 1);
+    saveCurrentStateForUndo();
+    lines.insert(lines.begin() + dest + 1, std::make_move_iterator(copied.begin()), 
+                 std::make_move_iterator(copied.end()));
+    linesInserted(dest + 1, n);
+    gotoLine(dest + n + 1);
+}
+
+// :normal runs keys at the cursor as if typed, then leaves any insert or
+// pending command as Escape would.  Works from inside a macro too.
+void TextEditor::normalKeys(const std::string &keys) {
+    // :normal @a in register a would nest without end
+    const int MAX_DEPTH = 100;
+    if (macroDepth >= MAX_DEPTH) {
+        errorMessage("Macro recursion too deep");
+        return;
+    }
+    macroDepth++;
+    std::vector<int> outer;
+    outer.swap(replayKeys);
+    size_t outerPos = replayPos;
+    for (char c : keys) replayKeys.push_back((unsigned char)c);
+    replayKeys.push_back(27);
+    replayPos = 0;
+    mode = EditorMode::NORMAL;
+    while (replayPos < replayKeys.size()) handleKey(replayKeys[replayPos++]);
+    mode = EditorMode::NORMAL;
+    replayKeys.swap(outer);
+    replayPos = outerPos;
+    macroDepth--;
+}
+
+// The filtered view of :g/pat/ and :v/pat/, until :nofilter
+void TextEditor::showFiltered(const std::string &pattern, bool invert) {
+    if (diffSide(currentBuffer) >= 0) {
+        errorMessage("Cannot filter a buffer in diff mode");
+        return;
+    }
+    filter.reset(lines, pattern, invert);
+    if (!filter.matches()) {
+        clearFilter();
+        errorMessage("No lines to show for: " + pattern);
+        return;
+    }
+    // Onto the first shown line from the cursor on
+    cursorY = filter.lineAt(std::min(filter.rank(cursorY, -1), filter.matches() - 1), -1);
+    cursorX = std::min(cursorX, (int)lines[cursorY].length());
+    damageTop = 0;
+    damageBottom = INT_MAX;
+    scrollToCursor();
+    statusMessage(std::to_string(filter.matches()) + " of " + std::to_string(lines.size()) + " lines");
+}
+
+// Byte order, or byte order ignoring ASCII case
+static bool lessLine(std::string_view a, std::string_view b, bool ignoreCase) {
+    if (!ignoreCase) return a < b;
+    size_t n = std::min(a.length(), b.length());
+    for (size_t i = 0; i < n; ++i) {
+        int ca = std::tolower((unsigned char)a[i]), cb = std::tolower((unsigned char)b[i]);
+        if (ca != cb) return ca < cb;
+    }
+    return a.length() < b.length();
+}
+
+// Sort key of a line: its first 8 bytes, big endian so that comparing
+// keys compares the bytes, or with n its first decimal number.  Lines
+// without a number sort first.
+static uint64_t sortKey(std::string_view line, bool numeric, bool ignoreCase) {
+    if (numeric) {
+        size_t digit = line.find_first_of("0123456789");
+        if (digit == std::string_view::npos) return 0;
+        if (digit > 0 && line[digit - 1] == '-') --digit;
+        long long value;
+        auto result = std::from_chars(line.data() + digit, line.data() + line.length(), value);
+        if (result.ec != std::errc()) value = line[digit] == '-' ? LLONG_MIN + 1 : LLONG_MAX;
+        return (uint64_t)value ^ (1ULL << 63);
+    }
+    uint64_t key = 0;
+    for (size_t i = 0; i < 8; ++i) {
+        unsigned char c = i < line.length() ? line[i] : 0;
+        key = key << 8 | (ignoreCase ? std::tolower(c) : c);
+    }
+    return key;
+}
+
+// Sorts lines y..y+n-1.  Only keys and line numbers are sorted, so most
+// comparisons never touch the text, and the lines are moved into their new
+// order once at the end.  A number in `args` sorts by that field in
+// column mode; the fields are split once, in parallel, with the keys.
+void TextEditor::sortLines(int y, int n, const std::string &args, bool reverse) {
+    bool numeric = args.find('n') != std::string::npos;
+    bool ignoreCase = args.find('i') != std::string::npos;
+    bool unique = args.find('u') != std::string::npos;
+    size_t digit = args.find_first_of("0123456789");
+    int field = digit == std::string::npos ? -1 : std::atoi(args.c_str() + digit) - 1;
+    if (digit != std::string::npos && (field < 0 || !columns.active())) {
+        errorMessage(field < 0 ? "Invalid field: " + args.substr(digit) : "Not in column mode, see :csv");
+        return;
+    }
+    auto start = std::chrono::steady_clock::now();
+
+    struct Item {
+        uint64_t key;
+        uint32_t line;
+    };
+    std::vector<Item> items(n);
+    std::vector<std::string_view> keys(field < 0 ? 0 : n);
+    parallelFor(n, [&](size_t begin, size_t end) {
+        std::vector<int> starts;
+        for (size_t i = begin; i < end; ++i) {
+            std::string_view text = lines[y + i];
+            if (field >= 0) {
+                columns.fieldStarts(lines[y + i], starts);
+                text = keys[i] = columns.fieldText(lines[y + i], starts, field);
+            }
+            items[i] = {sortKey(text, numeric, ignoreCase), (uint32_t)i};
         }
+    });
+
+    // Equal keys decide a numeric sort; otherwise only lines longer than
+    // the key need comparing
+    const std::string *base = &lines[y];
+    auto less = [&](const Item &a, const Item &b) {
+        const Item &first = reverse ? b : a, &second = reverse ? a : b;
+        if (first.key != second.key) return first.key < second.key;
+        if (numeric) return false;
+        if (field >= 0) return lessLine(keys[first.line], keys[second.line], ignoreCase);
+        return lessLine(base[first.line], base[second.line], ignoreCase);
+    };
+    parallelSort(items, less);
+
+    std::vector<uint32_t> order;
+    order.reserve(n);
+    for (size_t i = 0; i < items.size(); ++i) {
+        // Sorted, so equal lines are next to each other
+        if (unique && i > 0 && !less(items[i - 1], items[i])) continue;
+        order.push_back(items[i].line);
     }
+    replaceRange(y, n, order);
 
-    void moveRight() {
-        if (cursorX < (int)lines[cursorY].length()) {
-            cursorX++;
-        } else if (cursorY < (int)lines.size() - 1) {
-            cursorY++;
-            cursorX = 0;
-            if (cursorY >= offsetY + LINES - 2) offsetY++;
-        }
+    long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    statusMessage("Sorted " + std::to_string(n) + " lines" + 
+                  (n > (int)order.size() ? ", " + std::to_string(n - order.size()) + " duplicates removed" : "") + 
+                  " in " + std::to_string(ms) + " ms");
+}
+
+// Drops lines equal to the one before them
+void TextEditor::uniqLines(int y, int n, const std::string &args) {
+    bool ignoreCase = args.find('i') != std::string::npos;
+    std::vector<uint32_t> order;
+    order.reserve(n);
+    for (int i = 0; i < n; ++i) {
+        const std::string &line = lines[y + i];
+        if (i > 0 && !lessLine(lines[y + i - 1], line, ignoreCase) && 
+            !lessLine(line, lines[y + i - 1], ignoreCase)) continue;
+        order.push_back(i);
     }
+    if ((int)order.size() == n) {
+        statusMessage("No duplicate lines");
+        return;
+    }
+    replaceRange(y, n, order);
+    statusMessage(std::to_string(n - order.size()) + " fewer lines");
+}
 
-    void moveToNextWord() {
-        while (cursorY < (int)lines.size() && 
-               cursorX < (int)lines[cursorY].length() && 
-               !std::isspace(lines[cursorY][cursorX])) {
-            moveRight();
-        }
-        while (cursorY < (int)lines.size() && 
-               cursorX < (int)lines[cursorY].length() && 
-               std::isspace(lines[cursorY][cursorX])) {
-            moveRight();
+// :[range]delcol [N] removes field N, or the one under the cursor, with
+// its delimiter from every line of the range.  The lines are cut in
+// parallel into a new buffer and the old one becomes the undo step.
+void TextEditor::deleteField(int first, int last, const std::string &args) {
+    if (!columns.active()) {
+        errorMessage("Not in column mode, see :csv");
+        return;
+    }
+    std::vector<int> starts;
+    columns.fieldStarts(lines[cursorY], starts);
+    int field = ColumnLayout::fieldAt(starts, cursorX);
+    if (!args.empty()) {
+        auto result = std::from_chars(args.data(), args.data() + args.length(), field);
+        if (result.ec != std::errc() || result.ptr != args.data() + args.length() || field < 1) {
+            errorMessage("Invalid field: " + args);
+            return;
         }
+        field--;
     }
+    auto start = std::chrono::steady_clock::now();
 
-    void moveToPreviousWord() {
-        while (cursorY > 0 || cursorX > 0) {
-            moveLeft();
-            if (cursorX > 0 && !std::isspace(lines[cursorY][cursorX-1])) {
-                while (cursorX > 0 && !std::isspace(lines[cursorY][cursorX-1])) {
-                    moveLeft();
+    std::vector<std::string> edited(lines.size());
+    std::atomic<int> cut(0);
+    parallelFor(lines.size(), [&](size_t begin, size_t end) {
+        std::vector<int> fields;
+        int count = 0;
+        for (size_t y = begin; y < end; ++y) {
+            const std::string &line = lines[y];
+            if ((int)y >= first && (int)y <= last) {
+                columns.fieldStarts(line, fields);
+                if (field < (int)fields.size()) {
+                    // The delimiter after the field goes with it, or the
+                    // one before the last field
+                    int from = fields[field], to = ColumnLayout::fieldEnd(line, fields, field) + 1;
+                    if (field + 1 == (int)fields.size()) {
+                        to--;
+                        if (field > 0) from--;
+                    }
+                    edited[y].reserve(line.length() - (to - from));
+                    edited[y].append(line, 0, from).append(line, to, std::string::npos);
+                    count++;
+                    continue;
                 }
-                break;
             }
+            edited[y] = line;
         }
+        cut += count;
+    });
+    if (cut == 0) {
+        statusMessage("No line has field " + std::to_string(field + 1));
+        return;
     }
+    if (!undoSuspended) keepForUndo(std::move(lines));
+    lines = std::move(edited);
+    linesChanged(first, last - first + 1);
+    cursorX = std::min(cursorX, (int)lines[cursorY].length());
 
-    void moveToLineStart() {
-        cursorX = 0;
-    }
-
-    void moveToLineEnd() {
-        cursorX = lines[cursorY].length();
-    }
+    long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    statusMessage("Deleted field " + std::to_string(field + 1) + " from " + std::to_string(cut) + 
+                  " lines in " + std::to_string(ms) + " ms");
+}
 
-    void moveToDocumentStart() {
-        cursorY = 0;
-        cursorX = 0;
-        offsetY = 0;
-    }
+// Replaces lines y..y+n-1 with those at the offsets in `order`.  They
+// are copied, not moved, since the lines as they are become the undo step.
+void TextEditor::replaceRange(int y, int n, const std::vector<uint32_t> &order) {
+    std::vector<std::string> kept(order.size());
+    parallelFor(order.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) kept[i] = lines[y + order[i]];
+    });
+    spliceLines(y, n, kept);
+}
 
-    void moveToDocumentEnd() {
-        cursorY = lines.size() - 1;
-        cursorX = lines[cursorY].length();
-        offsetY = std::max(0, (int)lines.size() - (LINES - 2));
+// Moves `text` in place of lines y..y+n-1 as one undo step.  Marks and
+// cursors in the range move to the start of the line they were on, or to
+// the last new line when there are fewer.
+void TextEditor::spliceLines(int y, int n, std::vector<std::string> &text) {
+    if (text.empty() && n == (int)lines.size()) text.emplace_back();
+    saveCurrentStateForUndo();
+    int common = std::min<int>(n, text.size());
+    std::move(text.begin(), text.begin() + common, lines.begin() + y);
+    if ((int)text.size() < n) {
+        lines.erase(lines.begin() + y + common, lines.begin() + y + n);
+    } else {
+        lines.insert(lines.begin() + y + n, std::make_move_iterator(text.begin() + common), 
+                     std::make_move_iterator(text.end()));
     }
 
-    void display() {
-        clear();
-
-        int rows = LINES - 2;
+    int bottom = y + std::max<int>(text.size(), 1) - 1;
+    anchors.remap([&](int &ay, int &ax) {
+        if (ay < y || ay >= y + n) return;
+        ay = std::min(ay, bottom);
+        ax = 0;
+    });
+    if (common > 0) linesChanged(y, common);
+    if ((int)text.size() < n) linesErased(y + common, n - common);
+    if ((int)text.size() > n) linesInserted(y + n, text.size() - n);
+    cursorY = std::min(y, (int)lines.size() - 1);
+    cursorX = 0;
+    scrollToCursor();
+}
 
-        // Draw the visible lines of text with line numbers
-        for (int i = 0; i < rows; ++i) {
-            int lineIndex = offsetY + i;
-            if (lineIndex < (int)lines.size()) {
-                // Display line number
-                attron(COLOR_PAIR(LINE_NUMBER_COLOR));
-                std::ostringstream lineNumber;
-                lineNumber << std::setw(4) << lineIndex + 1;
-                mvprintw(i, 0, "%s ", lineNumber.str().c_str());
-                attroff(COLOR_PAIR(LINE_NUMBER_COLOR));
-
-                // Draw the actual line of text
-                if (mode == EditorMode::VISUAL || 
-                    mode == EditorMode::VISUAL_LINE || 
-                    mode == EditorMode::VISUAL_BLOCK) {
-                    bool isSelected = (lineIndex >= std::min(visualStartY, cursorY) && 
-                                       lineIndex <= std::max(visualStartY, cursorY));
-                    
-                    if (isSelected) {
-                        attron(COLOR_PAIR(VISUAL_COLOR));
-                    }
+// Runs `command` with /bin/sh, lines y..y+n-1 on its stdin and its output
+// split into lines as it arrives.  Both pipes are polled together so
+// neither side can fill up and stall the other, and the terminal too, so
+// Ctrl-C kills the command.  False if it was cancelled or did not start.
+bool TextEditor::pipeThrough(const std::string &command, int y, int n, std::vector<std::string> &output) {
+    int in[2], out[2];
+    if (pipe(in) < 0) {
+        errorMessage("Cannot create pipe: " + std::string(strerror(errno)));
+        return false;
+    }
+    if (pipe(out) < 0) {
+        errorMessage("Cannot create pipe: " + std::string(strerror(errno)));
+        close(in[0]);
+        close(in[1]);
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Its own process group, so that a cancel kills the whole pipeline
+        setpgid(0, 0);
+        dup2(in[0], 0);
+        dup2(out[1], 1);
+        dup2(out[1], 2);
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        execl("/bin/sh", "sh", "-c", command.c_str(), (char *)nullptr);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    if (pid < 0) {
+        errorMessage("Cannot run command: " + std::string(strerror(errno)));
+        close(in[1]);
+        close(out[0]);
+        return false;
+    }
+    int writeFd = in[1], readFd = out[0];
+    fcntl(writeFd, F_SETFL, O_NONBLOCK);
+    fcntl(readFd, F_SETFL, O_NONBLOCK);
+    if (n == 0) {
+        close(writeFd);
+        writeFd = -1;
+    }
+    mode = EditorMode::NORMAL;  // the progress replaces the command line
+    // A command that exits without reading its input must not kill the editor
+    void (*oldPipeHandler)(int) = signal(SIGPIPE, SIG_IGN);
 
-                    for (int j = 0; j < (int)lines[lineIndex].length(); ++j) {
-                        if (mode == EditorMode::VISUAL && 
-                            j >= std::min(visualStartX, cursorX) && 
-                            j <= std::max(visualStartX, cursorX)) {
-                            if (isSelected) mvaddch(i, 5 + j, lines[lineIndex][j]);
-                        } else if (mode == EditorMode::VISUAL_LINE && isSelected) {
-                            mvaddch(i, 5 + j, lines[lineIndex][j]);
-                        } else if (mode == EditorMode::VISUAL_BLOCK) {
-                            if (j >= std::min(visualStartX, cursorX) && 
-                                j <= std::max(visualStartX, cursorX)) {
-                                mvaddch(i, 5 + j, lines[lineIndex][j]);
-                            }
-                        }
-                    }
+    std::string pending;  // bytes taken from lines but not yet written
+    size_t written = 0;
+    int sent = 0;
+    std::string partial;  // output after the last newline
+    std::vector<char> buffer(1 << 16);
+    bool cancelled = false;
+    auto lastShown = std::chrono::steady_clock::now();
+    while (readFd >= 0) {
+        pollfd fds[3];
+        int count = 0;
+        if (writeFd >= 0) fds[count++] = {writeFd, POLLOUT, 0};
+        fds[count++] = {readFd, POLLIN, 0};
+        if (!headless) fds[count++] = {0, POLLIN, 0};
+        if (poll(fds, count, 100) < 0 && errno != EINTR) break;
 
-                    if (isSelected) {
-                        attroff(COLOR_PAIR(VISUAL_COLOR));
-                    }
-                } else if (i == cursorY - offsetY) {
-                    for (int j = 0; j < (int)lines[lineIndex].length(); ++j) {
-                        if (j == cursorX) {
-                            attron(A_REVERSE);
-                            mvaddch(i, 5 + j, lines[lineIndex][j]);
-                            attroff(A_REVERSE);
-                        } else {
-                            mvaddch(i, 5 + j, lines[lineIndex][j]);
-                        }
-                    }
-                } else {
-                    mvprintw(i, 5, "%s", lines[lineIndex].c_str());
+        if (writeFd >= 0 && fds[0].revents) {
+            if (written == pending.size()) {
+                // Refill with whole lines, up to the size of a pipe buffer
+                pending.clear();
+                written = 0;
+                while (sent < n && pending.size() < buffer.size()) {
+                    pending += lines[y + sent++];
+                    pending += '\n';
                 }
             }
+            ssize_t done = pending.empty() ? 0 : write(writeFd, pending.data() + written, pending.size() - written);
+            if (done > 0) written += done;
+            if (pending.empty() || (done < 0 && errno != EAGAIN && errno != EINTR)) {
+                close(writeFd);
+                writeFd = -1;
+            }
         }
 
-        // Draw the status bar
-        attron(COLOR_PAIR(STATUS_BAR_COLOR));
-        displayStatusBar();
-        attroff(COLOR_PAIR(STATUS_BAR_COLOR));
-
-        // If in command mode, display command buffer
-        if (mode == EditorMode::COMMAND) {
-            attron(COLOR_PAIR(COMMAND_COLOR));
-            mvprintw(LINES - 1, 0, ":%s", commandBuffer.c_str());
-            attroff(COLOR_PAIR(COMMAND_COLOR));
+        ssize_t got;
+        while ((got = read(readFd, buffer.data(), buffer.size())) > 0) {
+            const char *p = buffer.data(), *end = p + got;
+            while (const char *newline = (const char *)memchr(p, '\n', end - p)) {
+                partial.append(p, newline);
+                output.push_back(std::move(partial));
+                partial.clear();
+                p = newline + 1;
+            }
+            partial.append(p, end);
+        }
+        if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR)) {
+            close(readFd);
+            readFd = -1;
         }
 
-        move(cursorY - offsetY, cursorX + 5);
-        refresh();
+        if (!headless && fds[count - 1].revents & POLLIN) {
+            timeout(0);
+            int ch;
+            while ((ch = getch()) != ERR) cancelled = cancelled || ch == 3;
+            timeout(-1);
+            if (cancelled) break;
+        }
+        if (!headless && std::chrono::steady_clock::now() - lastShown > std::chrono::milliseconds(100)) {
+            lastShown = std::chrono::steady_clock::now();
+            statusMessage("!" + command + ": " + std::to_string(sent) + "/" + std::to_string(n) + 
+                          " lines sent, " + std::to_string(output.size()) + " read (Ctrl-C to cancel)");
+            display();
+        }
     }
+    if (!partial.empty()) output.push_back(std::move(partial));
+    if (writeFd >= 0) close(writeFd);
+    if (readFd >= 0) close(readFd);
+    if (cancelled) kill(-pid, SIGKILL);
 
-    void displayStatusBar() {
-        std::ostringstream status;
-        
-        // Display current mode
-        std::string modeStr;
-        switch(mode) {
-            case EditorMode::NORMAL: modeStr = "NORMAL"; break;
-            case EditorMode::INSERT: modeStr = "INSERT"; break;
-            case EditorMode::COMMAND: modeStr = "COMMAND"; break;
-            case EditorMode::VISUAL: modeStr = "VISUAL"; break;
-            case EditorMode::VISUAL_LINE: modeStr = "VISUAL LINE"; break;
-            case EditorMode::VISUAL_BLOCK: modeStr = "VISUAL BLOCK"; break;
+    // A command can close its output and go on running, so once the output
+    // is done it gets two seconds to exit before its process group is
+    // sent SIGTERM, and two more before SIGKILL
+    int status = 0, signalled = cancelled ? SIGKILL : 0;
+    auto outputDone = std::chrono::steady_clock::now();
+    for (;;) {
+        pid_t done = waitpid(pid, &status, WNOHANG);
+        if (done == pid || (done < 0 && errno != EINTR)) break;
+        auto waited = std::chrono::steady_clock::now() - outputDone;
+        if (!signalled && waited > std::chrono::seconds(2)) {
+            signalled = SIGTERM;
+            kill(-pid, SIGTERM);
+        } else if (signalled == SIGTERM && waited > std::chrono::seconds(4)) {
+            signalled = SIGKILL;
+            kill(-pid, SIGKILL);
         }
+        poll(nullptr, 0, 10);
+    }
+    signal(SIGPIPE, oldPipeHandler);
+
+    if (cancelled) {
+        errorMessage("!" + command + ": interrupted");
+        return false;
+    }
+    if (signalled) {
+        errorMessage("!" + command + ": killed, it did not exit after its output ended");
+    } else if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+        errorMessage("shell returned " + std::to_string(WEXITSTATUS(status)));
+    } else {
+        statusMessage("");
+    }
+    return true;
+}
 
-        status << "Mode: " << modeStr << " | "
-               << "Pos: (" << cursorY + 1 << "," << cursorX + 1 
-               << ") | File: " << fileName;
+// :[range]!cmd - the range is replaced by what the command prints for it
+void TextEditor::filterLines(const std::string &command, int y, int n) {
+    std::vector<std::string> output;
+    if (!pipeThrough(command, y, n, output)) return;
+    std::string status = message;
+    int count = output.size();
+    spliceLines(y, n, output);
+    statusMessage(std::to_string(n) + " lines filtered, " + std::to_string(count) + " lines out" + 
+                  (status.empty() ? "" : " - " + status));
+}
 
-        // Pad the status message to fit the terminal width
-        std::string statusStr = status.str();
-        if ((int)statusStr.length() < COLS) {
-            statusStr += std::string(COLS - statusStr.length(), ' ');
-        } else if ((int)statusStr.length() > COLS) {
-            statusStr = statusStr.substr(0, COLS);
-        }
+// :r !cmd - the command's output goes below line y
+void TextEditor::readCommand(const std::string &command, int y) {
+    std::vector<std::string> output;
+    if (!pipeThrough(command, 0, 0, output) || output.empty()) return;
+    spliceLines(y + 1, 0, output);
+}
 
-        mvprintw(LINES - 2, 0, "%s", statusStr.c_str());
-        clrtoeol();
+// :!cmd - the output is only shown
+void TextEditor::shellCommand(const std::string &command) {
+    std::vector<std::string> output;
+    if (!pipeThrough(command, 0, 0, output)) return;
+    std::string text = message;
+    for (const std::string &line : output) text += (text.empty() ? "" : " | ") + line;
+    statusMessage(text);
+}
+
+// Reads the file again after someone else changed it, patching only what
+// differs.  The file is mapped and compared with the buffer in place from
+// both ends; just the lines in between are split out and diffed, and each
+// hunk is applied as an edit, so cursor and marks follow and undo brings
+// back the old text.
+bool TextEditor::reloadFile() {
+    MappedFile file;
+    FileKey now;
+    if (!file.open(fileName) || !fileKey(now)) {
+        errorMessage("Can't read " + fileName);
+        return false;
     }
+    const char *data = file.data;
+    size_t size = file.size;
+    // As loadFile, so a save keeps the file's own last newline or lack of one
+    noEndOfLine = size > 0 && data[size - 1] != '\n';
 
-    void statusMessage(const std::string &message) {
-        mvprintw(LINES - 1, 0, "%s", message.c_str());
-        clrtoeol();
-        refresh();
+    // Lines at the start that are unchanged
+    int first = 0;
+    size_t pos = 0;
+    while (first < (int)lines.size() && pos < size) {
+        const char *newline = (const char *)memchr(data + pos, '\n', size - pos);
+        size_t end = newline ? newline - data : size;
+        const std::string &line = lines[first];
+        if (end - pos != line.length() || memcmp(data + pos, line.data(), line.length()) != 0) break;
+        ++first;
+        pos = newline ? end + 1 : size;
+    }
+
+    // and at the end, not reaching back into those
+    int last = lines.size();
+    size_t suffix = size;
+    if (pos < size) {
+        size_t tail = data[size - 1] == '\n' ? size - 1 : size;
+        while (last > first && tail >= pos) {
+            const char *newline = (const char *)memrchr(data + pos, '\n', tail - pos);
+            size_t start = newline ? newline - data + 1 : pos;
+            const std::string &line = lines[last - 1];
+            if (tail - start != line.length() || memcmp(data + start, line.data(), line.length()) != 0) break;
+            --last;
+            suffix = start;
+            if (!newline) break;
+            tail = newline - data;
+        }
     }
 
-    // Clipboard for yank/paste
-    std::vector<std::string> clipboardLines;
-    EditorMode clipboardType;
+    // The changed lines of the file, split as loadFile does
+    std::vector<std::string> changed;
+    for (size_t p = pos; p < suffix;) {
+        const char *newline = (const char *)memchr(data + p, '\n', suffix - p);
+        size_t end = newline ? newline - data : suffix;
+        changed.emplace_back(data + p, end - p);
+        p = newline ? end + 1 : suffix;
+    }
+    if (changed.empty() && first == 0 && last == (int)lines.size()) changed.emplace_back();
 
-    int CTRL(char c) { return c & 0x1F; }
-};
+    std::vector<std::string> old(lines.begin() + first, lines.begin() + last);
+    LineDiff edits;
+    edits.reset(old, changed);
+    int changedLines = 0;
+    if (!edits.hunks.empty()) {
+        saveCurrentStateForUndo();
+        AnchorTree::Handle cursor = anchors.add(cursorY, cursorX);
+        for (size_t i = edits.hunks.size(); i-- > 0;) {
+            const LineDiff::Hunk &h = edits.hunks[i];
+            int y = first + h.start[0], common = std::min(h.count[0], h.count[1]);
+            auto from = changed.begin() + h.start[1];
+            std::move(from, from + common, lines.begin() + y);
+            if (common > 0) linesChanged(y, common);
+            if (h.count[0] > common) {
+                lines.erase(lines.begin() + y + common, lines.begin() + y + h.count[0]);
+                linesErased(y + common, h.count[0] - common);
+            } else if (h.count[1] > common) {
+                lines.insert(lines.begin() + y + common, std::make_move_iterator(from + common), 
+                             std::make_move_iterator(from + h.count[1]));
+                linesInserted(y + common, h.count[1] - common);
+            }
+            changedLines += h.rows();
+        }
+        anchors.get(cursor, cursorY, cursorX);
+        anchors.remove(cursor);
+        cursorY = std::min(cursorY, (int)lines.size() - 1);
+        cursorX = std::min(cursorX, (int)lines[cursorY].length());
+        scrollToCursor();
+    }
 
-void TextEditor::searchText() {
-    // Placeholder for search functionality
-    //I don't got time for that lmao 
-    statusMessage("Search not implemented yet.");
+    // Hashing the whole file again would read it all; the search index
+    // sidecar is simply not saved for this version
+    modified = false;
+    contentHash = 0;
+    indexSaved = true;
+    diskKey = now;
+    diskChanged = false;
+    statusMessage("\"" + fileName + "\" changed on disk, reloaded: " + std::to_string(changedLines) + 
+                  " lines changed");
+    return true;
 }
 
-void TextEditor::jumpToMatchingBracket() {
-    char currentChar = lines[cursorY][cursorX];
-    char matchBracket = '\0';
-    bool searchForward = true;
-
-    switch(currentChar) {
-        case '(': matchBracket = ')'; break;
-        case '{': matchBracket = '}'; break;
-        case '[': matchBracket = ']'; break;
-        case ')': matchBracket = '('; searchForward = false; break;
-        case '}': matchBracket = '{'; searchForward = false; break;
-        case ']': matchBracket = '['; searchForward = false; break;
-        default: return;
+void TextEditor::setOption(const std::string &args) {
+    std::istringstream in(args);
+    std::string option;
+    while (in >> option) {
+        if (option == "trigram") {
+            if (!searchIndex.enabled) openSearchIndex(true);
+        } else if (option == "notrigram") {
+            openSearchIndex(false);
+        } else if (option == "expandtab" || option == "et") {
+            expandTab = true;
+        } else if (option == "noexpandtab" || option == "noet") {
+            expandTab = false;
+        } else if (option.compare(0, 11, "shiftwidth=") == 0 || option.compare(0, 3, "sw=") == 0 || 
+                   option.compare(0, 8, "tabstop=") == 0 || option.compare(0, 3, "ts=") == 0) {
+            int value = std::atoi(option.c_str() + option.find('=') + 1);
+            if (value <= 0) {
+                errorMessage("Invalid value: " + option);
+                return;
+            }
+            if (option[0] == 's') shiftWidth = value;
+            else tabStop = value;
+        } else if (option.compare(0, 11, "foldmethod=") == 0 || option.compare(0, 4, "fdm=") == 0) {
+            std::string method = option.substr(option.find('=') + 1);
+            if (method != "indent" && method != "bracket" && method != "manual") {
+                errorMessage("Invalid value: " + option);
+                return;
+            }
+            if (method != "manual") buildFolds(method == "indent");
+        } else {
+            errorMessage("Unknown option: " + option);
+            return;
+        }
     }
+}
+
+// The z commands: zf{motion} and zF fold lines, zo and zO open the folds
+// at the cursor, zc closes one, za toggles, zd and zE delete folds and zR
+// and zM open and close all of them
+void TextEditor::foldCommand(int ch, int count) {
+    std::vector<FoldTree::Fold> around;
+    folds.foldsAt(cursorY, around);
+    FoldTree::Fold closed;
+    bool inClosed = folds.closedAt(cursorY, closed);
 
-    int depth = 1;
-    int startY = cursorY, startX = cursorX;
+    // The innermost open fold outside any closed one, for zc
+    auto closable = [&](FoldTree::Fold &fold) {
+        bool found = false;
+        for (const FoldTree::Fold &f : around) {
+            if (f.closed) break;
+            fold = f;
+            found = true;
+        }
+        return found;
+    };
 
-    if (searchForward) {
-        // Search forward
-        for (int y = startY; y < (int)lines.size(); ++y) {
-            int xStart = (y == startY) ? startX + 1 : 0;
-            for (int x = xStart; x < (int)lines[y].length(); ++x) {
-                if (lines[y][x] == currentChar) depth++;
-                if (lines[y][x] == matchBracket) depth--;
+    FoldTree::Fold fold;
+    switch (ch) {
+        case 'f': {
+            // A count may also come between zf and the motion, as in zf3j
+            int motion = nextKey(), y = cursorY, x = cursorX, motionCount = 0;
+            for (; motion >= '0' && motion <= '9'; motion = nextKey()) motionCount = motionCount * 10 + motion - '0';
+            if (motionCount > 0) count *= motionCount;
+            if (motion == 'j') {
+                makeFold(foldTop(cursorY), foldBottom(stepFolded(cursorY, count)));
+            } else if (motion == 'k') {
+                makeFold(stepFolded(cursorY, -count), foldBottom(cursorY));
+            } else if (motion == 'G') {
+                makeFold(foldTop(cursorY), lastLine());
+            } else if (motion == '%') {
+                // To the match of the first bracket at or after the cursor
+                int dir;
+                while (x < (int)lines[y].length() && BracketIndex::kindOf(lines[y][x], dir) < 0) x++;
+                if (x < (int)lines[y].length() && brackets.findMatch(lines, y, x)) {
+                    makeFold(foldTop(std::min(y, cursorY)), foldBottom(std::max(y, cursorY)));
+                }
+            }
+            return;
+        }
+        case 'F':
+            makeFold(foldTop(cursorY), foldBottom(cursorY + count - 1));
+            return;
+        case 'o':
+            if (inClosed) folds.setClosed(closed.start, closed.end, false);
+            else if (around.empty()) errorMessage("No fold found");
+            break;
+        case 'O':
+            if (around.empty()) errorMessage("No fold found");
+            openFoldsAtCursor();
+            break;
+        case 'c':
+            if (closable(fold)) folds.setClosed(fold.start, fold.end, true);
+            else if (around.empty()) errorMessage("No fold found");
+            break;
+        case 'a':
+            if (inClosed) folds.setClosed(closed.start, closed.end, false);
+            else if (closable(fold)) folds.setClosed(fold.start, fold.end, true);
+            else errorMessage("No fold found");
+            break;
+        case 'd':
+            if (inClosed) folds.remove(closed.start, closed.end);
+            else if (!around.empty()) folds.remove(around.back().start, around.back().end);
+            else errorMessage("No fold found");
+            break;
+        case 'E': folds.clear(); break;
+        case 'R': folds.setAll(false); break;
+        case 'M': folds.setAll(true); break;
+        default: return;
+    }
+    cursorToFoldTop();
+    damageTop = 0;
+    damageBottom = INT_MAX;
+    scrollToCursor();
+}
 
-                if (depth == 0) {
-                    cursorY = y;
-                    cursorX = x;
-                    return;
+// :set foldmethod=indent folds every line with the deeper indented lines
+// below it, foldmethod=bracket every { with the lines up to its }.  Both
+// replace the folds there are with closed ones, in one pass over the buffer.
+void TextEditor::buildFolds(bool indent) {
+    folds.clear();
+    int made = 0;
+    // Folds not ended yet, as their first line and its indent
+    std::vector<std::pair<int, int>> open;
+    if (indent) {
+        int lastText = -1;
+        for (int y = 0; y <= (int)lines.size(); ++y) {
+            int width = INT_MIN;
+            if (y < (int)lines.size()) {
+                const std::string &line = lines[y];
+                size_t i = 0;
+                for (width = 0; i < line.length() && (line[i] == ' ' || line[i] == '\t'); ++i) {
+                    width = line[i] == '\t' ? (width / tabStop + 1) * tabStop : width + 1;
                 }
+                if (i == line.length()) continue;  // blank lines go with the fold around them
+            }
+            // A line no deeper than a fold's first line ends it at the
+            // last line with text
+            while (!open.empty() && open.back().second >= width) {
+                if (lastText > open.back().first) made += folds.add(open.back().first, lastText, true);
+                open.pop_back();
             }
+            open.push_back({y, width});
+            lastText = y;
         }
     } else {
-        // Search backward
-        for (int y = startY; y >= 0; --y) {
-            int xEnd = (y == startY) ? startX - 1 : lines[y].length() - 1;
-            for (int x = xEnd; x >= 0; --x) {
-                if (lines[y][x] == currentChar) depth++;
-                if (lines[y][x] == matchBracket) depth--;
-
-                if (depth == 0) {
-                    cursorY = y;
-                    cursorX = x;
-                    return;
+        // Braces in strings and comments are skipped as % skips them
+        bool inComment = false;
+        std::vector<int> braces;  // this line's, +1 for { and -1 for }
+        for (int y = 0; y < (int)lines.size(); ++y) {
+            braces.clear();
+            inComment = BracketIndex::lexLine(lines[y], inComment, [&](int, int kind, int dir) {
+                if (kind == 2) braces.push_back(dir);
+            });
+            for (size_t i = 0; i < braces.size(); ++i) {
+                if (braces[i] > 0) {
+                    open.push_back({y, 0});
+                } else if (!open.empty()) {
+                    // "} else {" leaves its line to the next fold
+                    bool reopens = std::find(braces.begin() + i, braces.end(), 1) != braces.end();
+                    int end = reopens ? y - 1 : y;
+                    if (end > open.back().first) made += folds.add(open.back().first, end, true);
+                    open.pop_back();
                 }
             }
         }
     }
+    cursorToFoldTop();
+    damageTop = 0;
+    damageBottom = INT_MAX;
+    scrollToCursor();
+    statusMessage(std::to_string(made) + " folds");
 }
 
-void TextEditor::yankText() {
-    saveCurrentStateForUndo();
-    
-    // Clear previous clipboard
-    clipboardLines.clear();
+// :time 2026-10-16T14:32 goes to the first line stamped at or after that
+// time.  Fields the log's stamps lack are dropped from the query, and a
+// query without a date is taken on the day of the cursor's line.
+void TextEditor::gotoTime(const std::string &args) {
+    size_t start = args.find_first_not_of(' ');
+    TimeIndex::Format format = TimeIndex::UNKNOWN;
+    uint64_t key, base;
+    if (start == std::string::npos || !TimeIndex::parse(args.substr(start), format, key)) {
+        errorMessage("Not a time: " + args);
+        return;
+    }
+    if (!timeIndex.stampBefore(lines, cursorY, base)) {
+        int first = timeIndex.find(lines, 0);
+        if (first < 0) {
+            errorMessage("No timestamps found");
+            return;
+        }
+        TimeIndex::Format detected = timeIndex.detected();
+        TimeIndex::parse(lines[first], detected, base);
+    }
+
+    const uint64_t DAY = TimeIndex::DAY, YEAR = 10000 * DAY;
+    TimeIndex::Format log = timeIndex.detected();
+    if (log == TimeIndex::CLOCK) key %= DAY;
+    else if (format == TimeIndex::CLOCK) key += base - base % DAY;
+    else if (log == TimeIndex::SYSLOG) key %= YEAR;
+
+    int y = timeIndex.find(lines, key);
+    if (y < 0) {
+        errorMessage("No line stamped at or after " + args.substr(start));
+        return;
+    }
+    pushJump();
+    cursorY = y;
+    cursorX = 0;
+    scrollToCursor();
+}
+
+void TextEditor::jumpToMatchingBracket() {
+    // Like vi, use the first bracket at or after the cursor on this line
+    const std::string &line = lines[cursorY];
+    int x = cursorX, dir;
+    while (x < (int)line.length() && BracketIndex::kindOf(line[x], dir) < 0) x++;
+    if (x >= (int)line.length()) return;
+
+    int y = cursorY;
+    if (!brackets.findMatch(lines, y, x)) return;
+    pushJump();
+    cursorY = y;
+    cursorX = x;
+    scrollToCursor();
+}
+
+void TextEditor::yankText(int count) {
+    // Yanking changes nothing, so it takes no undo snapshot
+    std::vector<std::string> yanked;
+    Registers::Kind kind = Registers::LINES;
 
-    if (mode == EditorMode::VISUAL) {
+    if (mode == EditorMode::VISUAL || mode == EditorMode::VISUAL_BLOCK) {
         // Rectangular visual mode
         int startX = std::min(visualStartX, cursorX);
         int endX = std::max(visualStartX, cursorX);
         int startY = std::min(visualStartY, cursorY);
         int endY = std::max(visualStartY, cursorY);
 
-        clipboardType = EditorMode::VISUAL;
+        kind = Registers::BLOCK;
         for (int y = startY; y <= endY; ++y) {
-            std::string line = lines[y].substr(startX, endX - startX + 1);
-            clipboardLines.push_back(line);
+            int from = std::min(startX, (int)lines[y].length());
+            yanked.push_back(lines[y].substr(from, endX - startX + 1));
         }
     } else if (mode == EditorMode::VISUAL_LINE) {
         // Line visual mode
         int startY = std::min(visualStartY, cursorY);
         int endY = std::max(visualStartY, cursorY);
-
-        clipboardType = EditorMode::VISUAL_LINE;
-        for (int y = startY; y <= endY; ++y) {
-            clipboardLines.push_back(lines[y]);
-        }
+        yanked.assign(lines.begin() + startY, lines.begin() + endY + 1);
     } else {
-        // Normal mode, usually triggered by 'yy' command
-        clipboardType = EditorMode::NORMAL;
-        clipboardLines.push_back(lines[cursorY]);
+        // Normal mode, usually triggered by 'Nyy': yanks N whole lines
+        int endY = std::min((int)lines.size(), cursorY + count);
+        yanked.assign(lines.begin() + cursorY, lines.begin() + endY);
     }
+    registers.store(pendingRegister, kind, std::move(yanked), false);
 
     mode = EditorMode::NORMAL;
     statusMessage("Text yanked.");
 }
 
-void TextEditor::deleteText() {
+// Removes lines [y, y + n) in one erase, keeping at least one line
+void TextEditor::eraseLines(int y, int n) {
+    lines.erase(lines.begin() + y, lines.begin() + y + n);
+    linesErased(y, n);
+    if (lines.empty()) {
+        lines.push_back("");
+        linesInserted(0, 1);
+    }
+    cursorY = std::min(y, (int)lines.size() - 1);
+    cursorX = std::min(cursorX, (int)lines[cursorY].length());
+}
+
+void TextEditor::deleteText(int count) {
     saveCurrentStateForUndo();
+    std::vector<std::string> deleted;
+    Registers::Kind kind = Registers::LINES;
     
-    if (mode == EditorMode::VISUAL) {
+    if (mode == EditorMode::VISUAL || mode == EditorMode::VISUAL_BLOCK) {
         // Rectangular visual mode
         int startX = std::min(visualStartX, cursorX);
         int endX = std::max(visualStartX, cursorX);
         int startY = std::min(visualStartY, cursorY);
         int endY = std::max(visualStartY, cursorY);
 
-        clipboardLines.clear();
-        clipboardType = EditorMode::VISUAL;
-        
-        for (int y = endY; y >= startY; --y) {
-            std::string line = lines[y];
-            clipboardLines.insert(clipboardLines.begin(), 
-                line.substr(startX, endX - startX + 1));
-            
-            lines[y].erase(startX, endX - startX + 1);
+        kind = Registers::BLOCK;
+        for (int y = startY; y <= endY; ++y) {
+            int from = std::min(startX, (int)lines[y].length());
+            deleted.push_back(lines[y].substr(from, endX - startX + 1));
+            lines[y].erase(from, endX - startX + 1);
+            charsErased(y, from, endX - startX + 1);
         }
+        cursorY = startY;
+        cursorX = startX;
     } else if (mode == EditorMode::VISUAL_LINE) {
-        // Line visual mode
+        // Line visual mode, the lines move into the register without a copy
         int startY = std::min(visualStartY, cursorY);
         int endY = std::max(visualStartY, cursorY);
-
-        clipboardType = EditorMode::VISUAL_LINE;
-        clipboardLines.clear();
-        
-        for (int y = endY; y >= startY; --y) {
-            clipboardLines.insert(clipboardLines.begin(), lines[y]);
-            lines.erase(lines.begin() + y);
-        }
-        
-        cursorY = std::min(startY, (int)lines.size() - 1);
+        deleted.assign(std::make_move_iterator(lines.begin() + startY), 
+                       std::make_move_iterator(lines.begin() + endY + 1));
+        eraseLines(startY, endY - startY + 1);
         cursorX = 0;
     } else {
-        // Normal mode, triggered by 'dd' or delete command
-        clipboardLines.clear();
-        clipboardType = EditorMode::NORMAL;
-        
-        if (lines.size() > 1) {
-            clipboardLines.push_back(lines[cursorY]);
-            lines.erase(lines.begin() + cursorY);
-            
-            if (cursorY >= (int)lines.size()) 
-                cursorY = lines.size() - 1;
-        }
+        // Normal mode, triggered by 'Ndd': deletes N whole lines at once
+        int n = std::min(count, (int)lines.size() - cursorY);
+        deleted.assign(std::make_move_iterator(lines.begin() + cursorY), 
+                       std::make_move_iterator(lines.begin() + cursorY + n));
+        eraseLines(cursorY, n);
     }
+    registers.store(pendingRegister, kind, std::move(deleted), true);
 
     mode = EditorMode::NORMAL;
 }
 
-void TextEditor::pasteText() {
+// x: deletes up to `count` characters under and after the cursor
+void TextEditor::deleteChars(int count) {
+    if (cursorX >= (int)lines[cursorY].length()) return;
     saveCurrentStateForUndo();
+    registers.store(pendingRegister, Registers::CHARS, 
+                    std::vector<std::string>(1, lines[cursorY].substr(cursorX, count)), true);
+    lines[cursorY].erase(cursorX, count);
+    charsErased(cursorY, cursorX, count);
+}
+
+void TextEditor::pasteText(int count) {
+    Registers::Kind kind;
+    Registers::Text text = registers.get(pendingRegister, kind);
+    if (!text || text->empty()) return;
+    const std::vector<std::string> &clipboardLines = *text;
 
-    if (clipboardLines.empty()) return;
+    saveCurrentStateForUndo();
 
-    if (clipboardType == EditorMode::VISUAL_LINE) {
-        // Paste lines after current line
+    if (kind == Registers::LINES) {
+        // Paste the lines `count` times after the current line in one insert
+        std::vector<std::string> pasted;
+        pasted.reserve(clipboardLines.size() * count);
+        for (int i = 0; i < count; ++i) {
+            pasted.insert(pasted.end(), clipboardLines.begin(), clipboardLines.end());
+        }
         lines.insert(lines.begin() + cursorY + 1, 
-                     clipboardLines.begin(), 
-                     clipboardLines.end());
-        cursorY += clipboardLines.size();
+                     std::make_move_iterator(pasted.begin()), 
+                     std::make_move_iterator(pasted.end()));
+        linesInserted(cursorY + 1, pasted.size());
+        cursorY++;
         cursorX = 0;
-    } else if (clipboardType == EditorMode::VISUAL) {
-        // Paste rectangular selection
+        scrollToCursor();
+    } else if (kind == Registers::BLOCK) {
+        // Paste rectangular selection, each row repeated `count` times
         int pasteX = cursorX;
         for (int i = 0; i < (int)clipboardLines.size() && 
                         cursorY + i < (int)lines.size(); ++i) {
-            if (pasteX + clipboardLines[i].length() > (int)lines[cursorY + i].length()) {
-                lines[cursorY + i].resize(pasteX + clipboardLines[i].length());
+            std::string row;
+            for (int k = 0; k < count; ++k) row += clipboardLines[i];
+            if (pasteX + row.length() > lines[cursorY + i].length()) {
+                lines[cursorY + i].resize(pasteX + row.length(), ' ');
             }
             
-            lines[cursorY + i].replace(pasteX, 
-                                       clipboardLines[i].length(), 
-                                       clipboardLines[i]);
+            lines[cursorY + i].replace(pasteX, row.length(), row);
         }
+        // Rows past the end of the buffer are dropped
+        linesChanged(cursorY, std::min<int>(clipboardLines.size(), lines.size() - cursorY));
     } else {
         // Paste after cursor position in the current line
-        lines[cursorY].insert(cursorX, clipboardLines[0]);
-        cursorX += clipboardLines[0].length();
+        std::string text;
+        for (int k = 0; k < count; ++k) text += clipboardLines[0];
+        lines[cursorY].insert(cursorX, text);
+        charsInserted(cursorY, cursorX, text.length());
+        cursorX += text.length();
     }
 }
 
-void TextEditor::changeText() {
-    if (mode == EditorMode::VISUAL) {
+void TextEditor::changeText(int count) {
+    if (mode == EditorMode::VISUAL || mode == EditorMode::VISUAL_BLOCK) {
         deleteText();
         mode = EditorMode::INSERT;
     } else {
-        // In normal mode, typically 'cw' or 'cc'
-        deleteText();
+        // In normal mode, 'Ncc' empties N lines into one and inserts there
+        int n = std::min(count, (int)lines.size() - cursorY);
+        saveCurrentStateForUndo();
+        registers.store(pendingRegister, Registers::LINES, 
+                        std::vector<std::string>(std::make_move_iterator(lines.begin() + cursorY), 
+                                                 std::make_move_iterator(lines.begin() + cursorY + n)), 
+                        true);
+        lines[cursorY].clear();
+        linesChanged(cursorY);
+        if (n > 1) {
+            lines.erase(lines.begin() + cursorY + 1, lines.begin() + cursorY + n);
+            linesErased(cursorY + 1, n - 1);
+        }
+        cursorX = 0;
         mode = EditorMode::INSERT;
     }
-}
+}
+
+// Shifts lines [y, y + n) by `levels` shiftwidths (negative unindents,
+// zero just rewrites the indent for :retab).  The whole range is one pass
+// and one undo entry, and anchors on the lines move with their text.
+void TextEditor::shiftLines(int y, int n, int levels) {
+    n = std::min(n, (int)lines.size() - y);
+    if (n <= 0) return;
+    saveCurrentStateForUndo();
+
+    std::vector<std::pair<int, int>> indents(n);  // old and new indent length
+    for (int i = 0; i < n; ++i) {
+        std::string &line = lines[y + i];
+        int width = 0;
+        size_t end = 0;
+        for (; end < line.length() && (line[end] == ' ' || line[end] == '\t'); ++end) {
+            width = line[end] == '\t' ? (width / tabStop + 1) * tabStop : width + 1;
+        }
+        indents[i].first = indents[i].second = end;
+
+        // Like vi, blank lines are not indented
+        if (end == line.length() && levels > 0) continue;
+        width = std::max(0, width + levels * shiftWidth);
+        std::string indent = expandTab ? std::string(width, ' ') 
+                                       : std::string(width / tabStop, '\t') + std::string(width % tabStop, ' ');
+        if (line.compare(0, end, indent) == 0) continue;
+        line.replace(0, end, indent);
+        indents[i].second = indent.length();
+    }
+    linesChanged(y, n);
+
+    // Columns inside the old indent are kept, clamped to the new one
+    anchors.remap([&](int &ay, int &ax) {
+        if (ay < y || ay >= y + n) return;
+        const std::pair<int, int> &indent = indents[ay - y];
+        ax = ax >= indent.first ? ax - indent.first + indent.second : std::min(ax, indent.second);
+    });
+    if (cursorY >= y && cursorY < y + n) {
+        const std::pair<int, int> &indent = indents[cursorY - y];
+        cursorX = std::max(0, cursorX - indent.first + indent.second);
+    }
+}
+
+// Adds an extra cursor unless one is already there
+bool TextEditor::addCursorAt(int y, int x) {
+    if (y == cursorY && x == cursorX) return false;
+    for (AnchorTree::Handle h : cursors) {
+        int cy, cx;
+        anchors.get(h, cy, cx);
+        if (cy == y && cx == x) return false;
+    }
+    cursors.push_back(anchors.add(y, x));
+    return true;
+}
+
+// Block 'I' / 'A': one cursor per selected line, the primary on the top line
+void TextEditor::addCursorsForBlock(bool append) {
+    int startY = std::min(visualStartY, cursorY);
+    int endY = std::max(visualStartY, cursorY);
+    int x = append ? std::max(visualStartX, cursorX) + 1 : std::min(visualStartX, cursorX);
+    clearCursors();
+    cursorY = startY;
+    cursorX = std::min(x, (int)lines[startY].length());
+    for (int y = startY + 1; y <= endY; ++y) {
+        // Short lines are padded so every cursor sits in the same column
+        if ((int)lines[y].length() < x) {
+            int pad = x - lines[y].length();
+            lines[y].append(pad, ' ');
+            charsInserted(y, x - pad, pad);
+        }
+        cursors.push_back(anchors.add(y, x));
+    }
+    scrollToCursor();
+}
+
+// Ctrl-N: a cursor at the next match of the last search, or of the word
+// under the cursor when nothing has been searched for yet
+void TextEditor::addCursorAtNextMatch() {
+    if (lastSearch.empty()) {
+        const std::string &line = lines[cursorY];
+        if (cursorX >= (int)line.length() || charClass(line[cursorX], false) != CLASS_WORD) {
+            statusMessage("No word under cursor");
+            return;
+        }
+        int start = classRunStart(line, cursorX, CLASS_WORD, false);
+        int end = classRunEnd(line, cursorX, CLASS_WORD, false);
+        lastSearch = line.substr(start, end - start);
+        lastSearchForward = true;
+    }
+
+    // Search from the last cursor added so repeated Ctrl-N walks forward
+    int y = cursorY, x = cursorX;
+    if (!cursors.empty()) anchors.get(cursors.back(), y, x);
+    if (!findPattern(lastSearch, true, y, x) || !addCursorAt(y, x)) {
+        statusMessage("No more matches for: " + lastSearch);
+        return;
+    }
+    statusMessage(std::to_string(cursors.size() + 1) + " cursors");
+}
+
+// :cursors [pattern] puts a cursor on every match in the buffer
+void TextEditor::addCursorsAtMatches(const std::string &pattern) {
+    if (pattern.empty()) {
+        statusMessage("No previous search pattern");
+        return;
+    }
+    lastSearch = pattern;
+    clearCursors();
+
+    // Walk the matches with the same indexed scan the search uses,
+    // the first one becomes the primary cursor
+    bool first = true;
+    int y = 0, x = -1;
+    std::vector<std::pair<int, int>> found;
+    while (findPattern(pattern, true, y, x)) {
+        if (!first && y == found[0].first && x == found[0].second) break;
+        found.emplace_back(y, x);
+        first = false;
+    }
+    if (found.empty()) {
+        statusMessage("Pattern not found: " + pattern);
+        return;
+    }
+    cursorY = found[0].first;
+    cursorX = found[0].second;
+    cursors.reserve(found.size() - 1);
+    for (size_t i = 1; i < found.size(); ++i) {
+        cursors.push_back(anchors.add(found[i].first, found[i].second));
+    }
+    scrollToCursor();
+    statusMessage(std::to_string(found.size()) + " cursors");
+}
+
+void TextEditor::clearCursors() {
+    for (AnchorTree::Handle h : cursors) anchors.remove(h);
+    cursors.clear();
+}
+
+// Drops extra cursors that ended up on the primary or on each other
+void TextEditor::mergeCursors() {
+    std::vector<std::pair<std::pair<int, int>, AnchorTree::Handle>> sorted;
+    sorted.reserve(cursors.size());
+    for (AnchorTree::Handle h : cursors) {
+        int y, x;
+        anchors.get(h, y, x);
+        sorted.push_back({{y, x}, h});
+    }
+    std::sort(sorted.begin(), sorted.end());
+    cursors.clear();
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        const std::pair<int, int> &at = sorted[i].first;
+        if ((i > 0 && sorted[i - 1].first == at) || 
+            (at.first == cursorY && at.second == cursorX)) {
+            anchors.remove(sorted[i].second);
+        } else {
+            cursors.push_back(sorted[i].second);
+        }
+    }
+}
+
+// Applies one insert-mode key at every cursor; the insert session is one
+// undo step.  The lines from the first cursor to the last are rebuilt in
+// one pass over the sorted cursors, every anchor is then moved by a single
+// remap and the indexes hear of each changed, split or joined line, so the
+// cost is in the lines with cursors rather than one vector insert per
+// cursor or a rebuild of every index.
+void TextEditor::multiCursorKey(int ch) {
+    if (ch == KEY_UP || ch == KEY_DOWN || ch == KEY_LEFT || ch == KEY_RIGHT) {
+        forEachCursor([&] {
+            if (ch == KEY_UP) moveUp();
+            else if (ch == KEY_DOWN) moveDown();
+            else if (ch == KEY_LEFT) moveLeft();
+            else moveRight();
+        });
+        mergeCursors();
+        return;
+    }
+    if (!insertUndoSaved) {
+        saveCurrentStateForUndo();
+        insertUndoSaved = true;
+    }
+
+    // The primary cursor takes part as a temporary anchor
+    AnchorTree::Handle primary = anchors.add(cursorY, cursorX);
+    std::vector<std::pair<int, int>> at;
+    at.reserve(cursors.size() + 1);
+    at.emplace_back(cursorY, cursorX);
+    for (AnchorTree::Handle h : cursors) {
+        int y, x;
+        anchors.get(h, y, x);
+        at.emplace_back(y, std::min(x, (int)lines[y].length()));
+    }
+    std::sort(at.begin(), at.end());
+    at.erase(std::unique(at.begin(), at.end()), at.end());
+
+    // Cursors on line y at or before column x
+    auto cursorsUpTo = [&at](int y, int x) {
+        return std::make_pair(std::lower_bound(at.begin(), at.end(), std::make_pair(y, 0)), 
+                              std::upper_bound(at.begin(), at.end(), std::make_pair(y, x)));
+    };
+
+    if (ch == '\n') {
+        // Every cursor splits its line.  Lines move down once, from the
+        // bottom up, by the number of splits above them.
+        int n = lines.size(), to = n + at.size();
+        lines.resize(to);
+        size_t k = at.size();
+        for (int y = n - 1; k > 0; --y) {
+            if (at[k - 1].first != y) {
+                lines[--to] = std::move(lines[y]);
+                continue;
+            }
+            std::string line = std::move(lines[y]);
+            size_t end = line.length();
+            for (; k > 0 && at[k - 1].first == y; --k) {
+                lines[--to] = line.substr(at[k - 1].second, end - at[k - 1].second);
+                end = at[k - 1].second;
+            }
+            line.resize(end);
+            lines[--to] = std::move(line);
+        }
+        anchors.remap([&](int &y, int &x) {
+            auto range = cursorsUpTo(y, x);
+            if (range.second > range.first) x -= (range.second - 1)->second;
+            y += (range.second - at.begin());
+        });
+        // Top down, so each line is where the edits above it put it
+        for (size_t i = 0, added = 0; i < at.size();) {
+            int y = at[i].first, split = 0;
+            for (; i < at.size() && at[i].first == y; ++i) split++;
+            linesChanged(y + added);
+            linesInserted(y + added + 1, split, false);
+            added += split;
+        }
+    } else if (ch == KEY_BACKSPACE || ch == 127) {
+        // A cursor in column 0 joins its line onto the one above, any
+        // other erases the character before it.  Lines move up once, by
+        // the number of joins above them; without joins none move.
+        struct Edit {
+            int y, newY, baseX, joins;  // joins: joined lines up to this one
+            bool joined;
+        };
+        std::vector<Edit> edited;
+        int n = lines.size(), to = at.front().first, joins = 0, y = to;
+        size_t k = 0;
+        for (; y < n; ++y) {
+            if (k == at.size() && to == y) break;
+            if (k == at.size() || at[k].first != y) {
+                if (to != y) lines[to] = std::move(lines[y]);
+                to++;
+                continue;
+            }
+            size_t first = k, from = 0;
+            std::string text;
+            for (; k < at.size() && at[k].first == y; ++k) {
+                if (at[k].second == 0) continue;
+                text.append(lines[y], from, at[k].second - 1 - from);
+                from = at[k].second;
+            }
+            if (from == 0) text = std::move(lines[y]);
+            else text.append(lines[y], from, std::string::npos);
+
+            if (y > 0 && at[first].second == 0) {
+                joins++;
+                edited.push_back({y, to - 1, (int)lines[to - 1].length(), joins, true});
+                lines[to - 1] += text;
+            } else {
+                edited.push_back({y, to, 0, joins, false});
+                lines[to++] = std::move(text);
+            }
+        }
+        if (y == n) lines.resize(to);
+        anchors.remap([&](int &y, int &x) {
+            auto e = std::upper_bound(edited.begin(), edited.end(), y, 
+                                      [](int y, const Edit &e) { return y < e.y; });
+            if (e == edited.begin()) return;
+            --e;
+            if (e->y != y) {
+                y -= e->joins;
+                return;
+            }
+            auto range = cursorsUpTo(y, x);
+            int erased = range.second - range.first;
+            if (erased > 0 && range.first->second == 0) erased--;
+            x = e->baseX + x - erased;
+            y = e->newY;
+        });
+        // Top down, a joined line going from just below the one it joined
+        for (const Edit &e : edited) {
+            linesChanged(e.newY);
+            if (e.joined) linesErased(e.newY + 1, 1, false);
+        }
+    } else {
+        // Each line with cursors is rebuilt once with the character at all of them
+        for (size_t i = 0; i < at.size();) {
+            int y = at[i].first;
+            std::string text;
+            text.reserve(lines[y].length() + at.size() - i);
+            size_t from = 0;
+            for (; i < at.size() && at[i].first == y; ++i) {
+                text.append(lines[y], from, at[i].second - from);
+                text += static_cast<char>(ch);
+                from = at[i].second;
+            }
+            text.append(lines[y], from, std::string::npos);
+            lines[y].swap(text);
+            linesChanged(y);
+        }
+        anchors.remap([&](int &y, int &x) {
+            auto range = cursorsUpTo(y, x);
+            x += range.second - range.first;
+        });
+    }
+
+    anchors.get(primary, cursorY, cursorX);
+    anchors.remove(primary);
+    mergeCursors();
+    scrollToCursor();
+}
+
+// i a I A and cc start an insert session whose text completes the change
+void TextEditor::beginInsertChange(char command, int count) {
+    insertChange = Change();
+    insertChange.command = command;
+    insertChange.count = count;
+    insertRecorded = true;
+}
+
+// Remembers a change that needs no typed text
+void TextEditor::recordChange(char command, int count) {
+    lastChange = Change();
+    lastChange.command = command;
+    lastChange.count = count;
+    lastChange.reg = pendingRegister;
+}
+
+// A visual operation is kept as the size of its selection, so . applies
+// it to a selection of the same size starting at the cursor
+void TextEditor::recordVisualChange(char op, int count) {
+    Change change;
+    change.command = 'v';
+    change.op = op;
+    change.count = count;
+    change.reg = pendingRegister;
+    change.visualMode = mode;
+    change.height = std::abs(cursorY - visualStartY);
+    change.width = std::abs(cursorX - visualStartX);
+    if (op == 'c') {
+        insertChange = change;
+        insertRecorded = true;
+    } else {
+        lastChange = change;
+    }
+}
+
+// Applies the text of an insert session at the cursor and leaves insert mode
+void TextEditor::replayInsert(const Change &change, int times) {
+    int erased = std::min(change.erased, cursorX);
+    if (erased > 0) {
+        cursorX -= erased;
+        lines[cursorY].erase(cursorX, erased);
+        charsErased(cursorY, cursorX, erased);
+    }
+    std::string text;
+    text.reserve(change.inserted.length() * times);
+    for (int i = 0; i < times; ++i) text += change.inserted;
+    if (!text.empty()) insertText(text);
+    mode = EditorMode::NORMAL;
+    if (cursorX > 0) cursorX--;
+}
+
+// . repeats the last change at the cursor from its recorded description,
+// without going through the keys again; a count replaces the original one
+void TextEditor::repeatChange(int count, bool hasCount) {
+    Change change = lastChange;
+    if (!change.command) return;
+    if (hasCount) change.count = count;
+    pendingRegister = change.reg;
+
+    switch (change.command) {
+        case 'x': deleteChars(change.count); break;
+        case 'd': deleteText(change.count); break;
+        case 'p': pasteText(change.count); break;
+        case '>': shiftLines(cursorY, change.count, 1); break;
+        case '<': shiftLines(cursorY, change.count, -1); break;
+        case 'c':
+            changeText(change.count);
+            replayInsert(change, 1);
+            break;
+        case 'v':
+            visualStartX = cursorX;
+            visualStartY = cursorY;
+            cursorY = std::min((int)lines.size() - 1, cursorY + change.height);
+            cursorX += change.width;
+            mode = change.visualMode;
+            if (change.op == 'd') {
+                deleteText();
+            } else if (change.op == 'c') {
+                changeText();
+                replayInsert(change, 1);
+            } else {
+                cursorY = visualStartY;
+                shiftLines(visualStartY, change.height + 1, change.op == '>' ? change.count : -change.count);
+                mode = EditorMode::NORMAL;
+            }
+            break;
+        default:
+            // i a I A
+            if (change.command == 'a' && cursorX < (int)lines[cursorY].length()) cursorX++;
+            if (change.command == 'I') moveToLineStart();
+            if (change.command == 'A') moveToLineEnd();
+            saveCurrentStateForUndo();
+            replayInsert(change, change.count);
+            break;
+    }
+    lastChange = change;
+}
+
+// q{reg} starts recording keys into a register, the next q stores them
+void TextEditor::toggleRecording(int name) {
+    if (recordingRegister) {
+        if (!recordedKeys.empty()) recordedKeys.pop_back();  // the q that stopped recording
+        registers.storeKeys(recordingRegister, recordedKeys);
+        recordingRegister = 0;
+        recordedKeys.clear();
+        return;
+    }
+    if (name <= 0 || name >= 128 || !std::isalnum(name)) return;
+    recordingRegister = name;
+    recordedKeys.clear();
+}
+
+// Replays a register `count` times straight through the input handlers.
+// Nothing is drawn until the end and the whole run is one undo entry.  A
+// macro that calls another queues that one's keys in front of the rest.
+void TextEditor::runMacro(int name, int count) {
+    Registers::Kind kind;
+    Registers::Text text = Registers::valid(name) ? registers.get(name, kind) : Registers::Text();
+    if (!text || text->empty()) {
+        statusMessage("Register is empty");
+        return;
+    }
+    lastMacro = name;
+
+    std::string joined;
+    for (size_t i = 0; i < text->size(); ++i) {
+        if (i > 0) joined += '\n';
+        joined += (*text)[i];
+    }
+    std::vector<int> keys = decodeKeys(joined);
+    std::vector<int> queued;
+    queued.reserve(keys.size() * count);
+    for (int i = 0; i < count; ++i) queued.insert(queued.end(), keys.begin(), keys.end());
 
-void TextEditor::indentLine() {
-    saveCurrentStateForUndo();
-    lines[cursorY].insert(0, "    ");
-    cursorX += 4;
-}
+    if (macroDepth > 0 || replayPos < replayKeys.size()) {
+        // Called from a macro: the outer replay loop runs these keys next.
+        // One that calls itself would never end, so a run stops after
+        // MAX_MACRO_CALLS macros.
+        const size_t MAX_REPLAY_KEYS = 100000000;
+        const int MAX_MACRO_CALLS = 100000;
+        if (++macroCalls > MAX_MACRO_CALLS || replayKeys.size() - replayPos + queued.size() > MAX_REPLAY_KEYS) {
+            errorMessage("Macro recursion too deep");
+            replayKeys.resize(replayPos);
+            return;
+        }
+        replayKeys.insert(replayKeys.begin() + replayPos, queued.begin(), queued.end());
+        return;
+    }
 
-void TextEditor::unindentLine() {
+    auto start = std::chrono::steady_clock::now();
     saveCurrentStateForUndo();
-    if (lines[cursorY].length() >= 4 && 
-        lines[cursorY].substr(0, 4) == "    ") {
-        lines[cursorY].erase(0, 4);
-        cursorX = std::max(0, cursorX - 4);
-    }
+    bool suspended = undoSuspended;
+    undoSuspended = true;
+    macroDepth++;
+    macroCalls = 0;
+    replayKeys.swap(queued);
+    replayPos = 0;
+    while (replayPos < replayKeys.size()) handleKey(replayKeys[replayPos++]);
+    size_t replayed = replayKeys.size();
+    replayKeys.clear();
+    replayPos = 0;
+    macroDepth--;
+    undoSuspended = suspended;
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::ostringstream report;
+    report << "@" << (char)name << ": " << replayed << " keys in " 
+           << std::fixed << std::setprecision(1) << seconds * 1000 << " ms";
+    if (seconds > 0) report << " (" << (long long)(replayed / seconds) << " keys/s)";
+    if (message.empty()) statusMessage(report.str());
 }
 
 void TextEditor::handleVisualModeInput(int ch) {
@@ -623,13 +7106,10 @@ void TextEditor::handleVisualModeInput(int ch) {
         return;
     }
 
-    // Repeat last command if no digit entered
-    int iterations = std::max(1, repeatCount);
+    // Motions take the count as their distance
+    int count = std::max(1, repeatCount);
     repeatCount = 0;
 
-    for (int i = 0; i < iterations; ++i) {
-    
-
     switch(ch) {
         case 27:  // ESC key
             mode = EditorMode::NORMAL;
@@ -638,51 +7118,75 @@ void TextEditor::handleVisualModeInput(int ch) {
             yankText();
             break;
         case 'd':
+            recordVisualChange('d', 1);
             deleteText();
             break;
         case 'c':
+            recordVisualChange('c', 1);
             changeText();
             break;
-        case '>':
-            // Indent selected lines
-            {
-                int startY = std::min(visualStartY, cursorY);
-                int endY = std::max(visualStartY, cursorY);
-                for (int y = startY; y <= endY; ++y) {
-                    saveCurrentStateForUndo();
-                    lines[y].insert(0, "    ");
-                }
-                mode = EditorMode::NORMAL;
+        case '"': {
+            int name = nextKey();
+            if (Registers::valid(name)) pendingRegister = name;
+        }
+        break;
+        case 'I':
+        case 'A':
+            // In block mode, insert at the left or right edge of every line
+            if (mode == EditorMode::VISUAL_BLOCK) {
+                addCursorsForBlock(ch == 'A');
+                mode = EditorMode::INSERT;
+                insertRecorded = false;
             }
             break;
+        case ':':
+            // An ex command on the selected lines
+            visualTop = std::min(visualStartY, cursorY);
+            visualBottom = std::max(visualStartY, cursorY);
+            mode = EditorMode::COMMAND;
+            commandPrompt = ':';
+            commandBuffer = "'<,'>";
+            break;
+        case '>':
         case '<':
-            // Unindent selected lines
+            // Shift the selected lines, a count shifts that many times
             {
                 int startY = std::min(visualStartY, cursorY);
                 int endY = std::max(visualStartY, cursorY);
-                for (int y = startY; y <= endY; ++y) {
-                    saveCurrentStateForUndo();
-                    if (lines[y].length() >= 4 && 
-                        lines[y].substr(0, 4) == "    ") {
-                        lines[y].erase(0, 4);
-                    }
-                }
+                recordVisualChange(ch, count);
+                cursorY = startY;
+                shiftLines(startY, endY - startY + 1, ch == '>' ? count : -count);
                 mode = EditorMode::NORMAL;
             }
             break;
         
         // Movement keys for visual mode
-        case 'h': moveLeft(); break;
-        case 'l': moveRight(); break;
-        case 'j': moveDown(); break;
-        case 'k': moveUp(); break;
+        case 'h': moveLeft(count); break;
+        case 'l': moveRight(count); break;
+        case 'j': moveDown(count); break;
+        case 'k': moveUp(count); break;
         case '-': moveToLineStart(); break;
         case '$': moveToLineEnd(); break;
-        case 'w': moveToNextWord(); break;
-        case 'b': moveToPreviousWord(); break;
+        case 'w': moveToNextWord(count); break;
+        case 'W': moveToNextWord(count, true); break;
+        case 'b': moveToPreviousWord(count); break;
+        case 'B': moveToPreviousWord(count, true); break;
+        case 'e': moveToWordEnd(count); break;
+        case 'E': moveToWordEnd(count, true); break;
+        case 'z':
+            // zf folds the selected lines, closed folds in it whole
+            if (nextKey() == 'f') {
+                int startY = std::min(visualStartY, cursorY);
+                int endY = std::max(visualStartY, cursorY);
+                mode = EditorMode::NORMAL;
+                cursorY = startY;
+                makeFold(foldTop(startY), foldBottom(endY));
+            }
+            break;
     }
+    if (mode == EditorMode::NORMAL || mode == EditorMode::INSERT) pendingRegister = 0;
 }
-}
+
 void TextEditor::handleNormalModeInput(int ch) {
     // Support for repeat count (chaining commands into eachother)
     if (std::isdigit(ch)) {
@@ -690,96 +7194,236 @@ void TextEditor::handleNormalModeInput(int ch) {
         return;
     }
 
-    // Repeat last command if no digit entered
-    int iterations = std::max(1, repeatCount);
+    // Counts are passed to the operations as a range instead of running
+    // the command N times, so 10000dd is one erase and one undo entry
+    bool hasCount = repeatCount > 0;
+    int count = std::max(1, repeatCount);
     repeatCount = 0;
 
-    for (int i = 0; i < iterations; ++i) {
-        switch(ch) {
-            case 'i': 
-                mode = EditorMode::INSERT;
-                break;
-            case 'I':
-                moveToLineStart();
-                mode = EditorMode::INSERT;
-                break;
-            case 'a':
+    switch(ch) {
+        case 'i': 
+            mode = EditorMode::INSERT;
+            beginInsertChange('i', 1);
+            break;
+        case 'I':
+            forEachCursor([this] { moveToLineStart(); });
+            mode = EditorMode::INSERT;
+            beginInsertChange('I', 1);
+            break;
+        case 'a':
+            forEachCursor([this] {
                 if (cursorX < (int)lines[cursorY].length()) 
                     cursorX++;
-                mode = EditorMode::INSERT;
-                break;
-            case 'A':
-                moveToLineEnd();
-                mode = EditorMode::INSERT;
-                break;
-            case 'k': moveUp(); break;
-            case 'j': moveDown(); break;
-            case 'h': moveLeft(); break;
-            case 'l': moveRight(); break;
-            case '-': moveToLineStart(); break;
-            case '$': moveToLineEnd(); break;
-            case 'w': moveToNextWord(); break;
-            case 'b': moveToPreviousWord(); break;
-            case 'g': {
-                int nextCh = getch();
-                if (nextCh == 'g') moveToDocumentStart();
-            }
-            break;
-            case 'G': moveToDocumentEnd(); break;
-            case 'x':
-                // Delete character
-                if (cursorX < (int)lines[cursorY].length()) {
-                    saveCurrentStateForUndo();
-                    lines[cursorY].erase(cursorX, 1);
-                }
-                break;
-            case 'd': {
-                int nextCh = getch();
-                if (nextCh == 'd') deleteText();
-            }
+            });
+            mode = EditorMode::INSERT;
+            beginInsertChange('a', 1);
+            break;
+        case 'A':
+            forEachCursor([this] { moveToLineEnd(); });
+            mode = EditorMode::INSERT;
+            beginInsertChange('A', 1);
             break;
-            case 'y': {
-                int nextCh = getch();
-                if (nextCh == 'y') yankText();
+        // Motions move every cursor of a multi-cursor edit
+        case 'k': forEachCursor([&] { moveUp(count); }); break;
+        case 'j': forEachCursor([&] { moveDown(count); }); break;
+        case 'h': forEachCursor([&] { moveLeft(count); }); break;
+        case 'l': forEachCursor([&] { moveRight(count); }); break;
+        case '-': forEachCursor([this] { moveToLineStart(); }); break;
+        case '$': forEachCursor([this] { moveToLineEnd(); }); break;
+        case 'w': forEachCursor([&] { moveToNextWord(count); }); break;
+        case 'W': forEachCursor([&] { moveToNextWord(count, true); }); break;
+        case 'b': forEachCursor([&] { moveToPreviousWord(count); }); break;
+        case 'B': forEachCursor([&] { moveToPreviousWord(count, true); }); break;
+        case 'e': forEachCursor([&] { moveToWordEnd(count); }); break;
+        case 'E': forEachCursor([&] { moveToWordEnd(count, true); }); break;
+        case 'g': {
+            int nextCh = nextKey();
+            if (nextCh == 'g') {
+                pushJump();
+                if (hasCount) gotoLine(count);
+                else moveToDocumentStart();
+            } else if (nextCh == 'o') {
+                gotoByte(count);
             }
+        }
+        break;
+        case 'G':
+            pushJump();
+            if (hasCount) gotoLine(count);
+            else moveToDocumentEnd();
+            break;
+        case 'm': setMark(nextKey()); break;
+        case '\'': jumpToMark(nextKey(), false); break;
+        case '`': jumpToMark(nextKey(), true); break;
+        case 15: jumpOlder(count); break;  // Ctrl-O
+        case 9: jumpNewer(count); break;   // Ctrl-I / Tab
+        case 'x':
+            recordChange('x', count);
+            deleteChars(count);
             break;
-            case 'c': {
-                int nextCh = getch();
-                if (nextCh == 'c') changeText();
+        case 'd': {
+            int nextCh = nextKey();
+            if (nextCh == 'd') {
+                recordChange('d', count);
+                deleteText(foldedCount(count));
+            }
+        }
+        break;
+        case 'y': {
+            int nextCh = nextKey();
+            if (nextCh == 'y') yankText(foldedCount(count));
+        }
+        break;
+        case 'c': {
+            int nextCh = nextKey();
+            if (nextCh == 'c') {
+                changeText(count);
+                beginInsertChange('c', count);
             }
+        }
+        break;
+        case 'p':
+            recordChange('p', count);
+            pasteText(count);
+            break;
+        case '.': repeatChange(count, hasCount); break;
+        case 'u':
+            for (int i = 0; i < count; ++i) undo();
             break;
-            case 'p': pasteText(); break;
-            case 'u': undo(); break;
 //            case CTRL('r'): redo(); break; 
 // was having issues with this. note to self, fix later 
-            case '%': jumpToMatchingBracket(); break;
-            case '>>': indentLine(); break;
-            case '<<': unindentLine(); break;
-            case 'v': 
-                mode = EditorMode::VISUAL;
-                visualStartX = cursorX;
-                visualStartY = cursorY;
+        case '%': jumpToMatchingBracket(); break;
+        case 'z': {
+            int nextCh = nextKey();
+            foldCommand(nextCh, count);
+        }
+        break;
+        case '>': {
+            int nextCh = nextKey();
+            if (nextCh == '>') {
+                recordChange('>', count);
+                shiftLines(cursorY, count, 1);
+            }
+        }
+        break;
+        case '<': {
+            int nextCh = nextKey();
+            if (nextCh == '<') {
+                recordChange('<', count);
+                shiftLines(cursorY, count, -1);
+            }
+        }
+        break;
+        case 'v': 
+            mode = EditorMode::VISUAL;
+            visualStartX = cursorX;
+            visualStartY = cursorY;
+            break;
+        case 'V':
+            mode = EditorMode::VISUAL_LINE;
+            visualStartX = cursorX;
+            visualStartY = cursorY;
+            break;
+        case 22:  // Ctrl-V
+            mode = EditorMode::VISUAL_BLOCK;
+            visualStartX = cursorX;
+            visualStartY = cursorY;
+            break;
+        case 23:  // Ctrl-W window commands
+            windowCommand();
+            break;
+        case ']':
+        case '[': {
+            int nextCh = nextKey();
+            if (nextCh == 'c') jumpToHunk(ch == ']', count);
+            else if (nextCh == 'f') jumpToField(ch == ']', count);
+        }
+        break;
+        case 14:  // Ctrl-N adds a cursor at the next match
+            addCursorAtNextMatch();
+            break;
+        case ':':
+            mode = EditorMode::COMMAND;
+            commandPrompt = ':';
+            commandBuffer.clear();
+            break;
+        case '/': searchText('/'); break;
+        case '?': searchText('?'); break;
+        case 'n':
+            for (int i = 0; i < count; ++i) searchNext(false);
+            break;
+        case 'N':
+            for (int i = 0; i < count; ++i) searchNext(true);
+            break;
+        case 27:
+            mode = EditorMode::NORMAL;
+            clearCursors();
+            break;
+        case 3:  // Ctrl-C interrupts a running :grep
+            if (grep.running()) grep.cancel();
+            break;
+        case 'q':
+            toggleRecording(recordingRegister ? 0 : nextKey());
+            break;
+        case '@': {
+            int name = nextKey();
+            if (name == '@') name = lastMacro;
+            runMacro(name, count);
+        }
+        break;
+        case '"': {
+            // Names the register for the next command, keeping any count
+            int name = nextKey();
+            if (Registers::valid(name)) pendingRegister = name;
+            repeatCount = hasCount ? count : 0;
+        }
+        return;
+    }
+    pendingRegister = 0;
+}
+
+void TextEditor::handleInsertModeInput(int ch) {
+    // Curses keys other than these (Home, F1, a resize...) are not text:
+    // neither inserted nor kept for .
+    if (ch >= KEY_MIN && ch != KEY_BACKSPACE && 
+        ch != KEY_UP && ch != KEY_DOWN && ch != KEY_LEFT && ch != KEY_RIGHT) {
+        return;
+    }
+
+    // Keep what the session leaves behind for .
+    if (insertRecorded) {
+        switch (ch) {
+            case 27:
+                lastChange = insertChange;
+                insertRecorded = false;
                 break;
-            case 'V':
-                mode = EditorMode::VISUAL_LINE;
-                visualStartX = cursorX;
-                visualStartY = cursorY;
+            case KEY_BACKSPACE:
+            case 127:
+                if (!insertChange.inserted.empty()) insertChange.inserted.pop_back();
+                else if (cursorX > 0) insertChange.erased++;
+                else insertRecorded = false;  // joining lines is not repeated
                 break;
-            case ':':
-                mode = EditorMode::COMMAND;
-                commandBuffer.clear();
+            case KEY_UP:
+            case KEY_DOWN:
+            case KEY_LEFT:
+            case KEY_RIGHT:
+                // Like vi, only what is typed after moving is repeated
+                beginInsertChange('i', 1);
+                break;
+            default:
+                insertChange.inserted += static_cast<char>(ch);
                 break;
-            case '/': searchText(); break;
-            case 27: mode = EditorMode::NORMAL; break;
         }
     }
-}
 
-void TextEditor::handleInsertModeInput(int ch) {
+    if (!cursors.empty() && ch != 27) {
+        multiCursorKey(ch);
+        return;
+    }
     switch(ch) {
         case 27:  // ESC key
             mode = EditorMode::NORMAL;
-            if (cursorX > 0) cursorX--;
+            forEachCursor([this] { if (cursorX > 0) cursorX--; });
             break;
         case KEY_BACKSPACE:
         case 127:
@@ -801,42 +7445,754 @@ void TextEditor::handleInsertModeInput(int ch) {
 }
 
 void TextEditor::handleCommandModeInput(int ch) {
-    if (ch == '\n') {
+    if (ch == '\n' && commandPrompt != ':') {
+        // Search prompt, an empty pattern repeats the last search
+        if (!commandBuffer.empty()) lastSearch = commandBuffer;
+        lastSearchForward = commandPrompt == '/';
+        mode = EditorMode::NORMAL;
+        commandBuffer.clear();
+        searchNext(false);
+    } else if (ch == '\n') {
         // Process command
-        if (commandBuffer == "q") {
-            endwin();
-            exit(0);
+        if (commandBuffer.empty()) {
+            // A bare ':' does nothing
+        } else if (commandBuffer == "q") {
+            if (!closeWindow()) quitRequested = true;
         } else if (commandBuffer == "wq") {
-            saveFile();
-            endwin();
-            exit(0);
+            if (saveFile() && !closeWindow()) quitRequested = true;
         } else if (commandBuffer == "w") {
             saveFile();
+        } else if (commandBuffer == "w!") {
+            saveFile(true);
         } else if (commandBuffer == "q!") {
-            endwin();
-            exit(0);
+            if (!closeWindow()) quitRequested = true;
+        } else if (commandBuffer == "sp" || commandBuffer == "split") {
+            splitWindow(false);
+        } else if (commandBuffer == "vs" || commandBuffer == "vsplit") {
+            splitWindow(true);
+        } else if (commandBuffer == "close") {
+            if (!closeWindow()) errorMessage("Cannot close last window");
+        } else if (commandBuffer == "only") {
+            onlyWindow();
+        } else if (commandBuffer == "follow" || commandBuffer.compare(0, 7, "follow ") == 0) {
+            startFollow(std::strtoul(commandBuffer.c_str() + 6, nullptr, 10));
+        } else if (commandBuffer == "nofollow") {
+            following = false;
+        } else if (commandBuffer == "diffthis") {
+            diffThis();
+        } else if (commandBuffer == "diffoff") {
+            diffOff();
+        } else if (commandBuffer == "diffupdate" || commandBuffer == "diffu") {
+            diffUpdate();
         } else if (commandBuffer == "u") {
             undo();
         } else if (commandBuffer == "redo") {
             redo();
+        } else if (commandBuffer == "nofilter") {
+            clearFilter();
+        } else if (commandBuffer == "csv" || commandBuffer.compare(0, 4, "csv ") == 0) {
+            columnMode(commandBuffer.length() > 4 ? commandBuffer.substr(4) : "");
+        } else if (commandBuffer == "nocsv") {
+            clearColumns();
+        } else if (gotoCommand(commandBuffer)) {
+            // :123, :50% or :goto
+        } else if (rangeCommand(commandBuffer)) {
+            // :[range]d, m, t, normal, g, sort, ...
+        } else if (commandBuffer.compare(0, 2, "e ") == 0) {
+            editFile(commandBuffer.substr(2));
+        } else if (commandBuffer == "bn" || commandBuffer == "bnext") {
+            switchToBuffer((currentBuffer + 1) % buffers.size());
+        } else if (commandBuffer == "bp" || commandBuffer == "bprevious") {
+            switchToBuffer((currentBuffer + buffers.size() - 1) % buffers.size());
+        } else if (commandBuffer.compare(0, 2, "b ") == 0) {
+            int number = std::atoi(commandBuffer.c_str() + 2);
+            if (number >= 1 && number <= (int)buffers.size()) switchToBuffer(number - 1);
+            else errorMessage("No such buffer: " + commandBuffer.substr(2));
+        } else if (commandBuffer == "ls" || commandBuffer == "buffers") {
+            listBuffers();
+        } else if (commandBuffer == "registers" || commandBuffer == "reg") {
+            statusMessage(registers.list());
+        } else if (commandBuffer == "marks") {
+            showMarks();
+        } else if (commandBuffer == "searchstats") {
+            showSearchStats();
+        } else if (commandBuffer.compare(0, 4, "set ") == 0) {
+            setOption(commandBuffer.substr(4));
+        } else if (commandBuffer.compare(0, 5, "time ") == 0) {
+            gotoTime(commandBuffer.substr(5));
+        } else if (commandBuffer.compare(0, 5, "grep ") == 0) {
+            startGrep(commandBuffer.substr(5));
+        } else if (commandBuffer == "cn") {
+            jumpToQuickfix(quickfixIndex + 1);
+        } else if (commandBuffer == "cp") {
+            jumpToQuickfix(quickfixIndex - 1);
+        } else if (commandBuffer == "cc") {
+            jumpToQuickfix(std::max(0, quickfixIndex));
+        } else if (commandBuffer == "retab") {
+            shiftLines(0, lines.size(), 0);
+        } else if (commandBuffer == "cursors") {
+            addCursorsAtMatches(lastSearch);
+        } else if (commandBuffer.compare(0, 8, "cursors ") == 0) {
+            addCursorsAtMatches(commandBuffer.substr(8));
+        } else {
+            errorMessage("Not an editor command: " + commandBuffer);
         }
         mode = EditorMode::NORMAL;
         commandBuffer.clear();
     } else if (ch == 27) {  // ESC key
         mode = EditorMode::NORMAL;
         commandBuffer.clear();
+    } else if (ch == KEY_BACKSPACE || ch == 127) {
+        if (commandBuffer.empty()) {
+            mode = EditorMode::NORMAL;
+        } else {
+            commandBuffer.pop_back();
+        }
     } else {
         commandBuffer += static_cast<char>(ch);
     }
 }
 
+// Bytes of a file edited in hex mode.  The file stays mapped and edits are
+// pieces over it and over an append-only buffer of the bytes typed, so
+// opening reads nothing however large the file is, an edit costs a walk
+// over the pieces, and an undo step is a copy of the piece list.
+class PieceTable {
+public:
+    struct Piece {
+        bool added;        // from the typed bytes rather than the file
+        uint64_t offset;   // where in its source
+        uint64_t length;
+    };
+
+    PieceTable() : total(0) {}
+
+    // Maps the file; one that does not exist yet is empty
+    bool open(const std::string &path) {
+        pieces.clear();
+        added.clear();
+        total = 0;
+        if (!file.open(path)) return errno == ENOENT;
+        total = file.size;
+        if (total > 0) pieces.push_back({false, 0, total});
+        return true;
+    }
+
+    uint64_t size() const { return total; }
+    const std::vector<Piece> &list() const { return pieces; }
+
+    void restore(const std::vector<Piece> &saved) {
+        pieces = saved;
+        total = 0;
+        for (const Piece &p : pieces) total += p.length;
+    }
+
+    // Copies up to n bytes from `at`, returns how many there were
+    size_t read(uint64_t at, unsigned char *out, size_t n) const {
+        size_t done = 0;
+        uint64_t start = 0;
+        for (size_t i = 0; i < pieces.size() && done < n; ++i) {
+            const Piece &p = pieces[i];
+            uint64_t end = start + p.length;
+            if (at + done < end) {
+                size_t count = std::min<uint64_t>(n - done, end - (at + done));
+                memcpy(out + done, source(p) + (at + done - start), count);
+                done += count;
+            }
+            start = end;
+        }
+        return done;
+    }
+
+    // Replaces `erase` bytes at `at` with n new ones
+    void replace(uint64_t at, uint64_t erase, const unsigned char *bytes, size_t n) {
+        erase = std::min(erase, total - at);
+        size_t first = split(at), last = split(at + erase);
+        pieces.erase(pieces.begin() + first, pieces.begin() + last);
+        total -= erase;
+        if (n == 0) return;
+        // Bytes typed one after another extend one piece
+        Piece *before = first > 0 ? &pieces[first - 1] : nullptr;
+        if (before && before->added && before->offset + before->length == added.size()) {
+            before->length += n;
+        } else {
+            pieces.insert(pieces.begin() + first, Piece{true, added.size(), n});
+        }
+        added.append((const char *)bytes, n);
+        total += n;
+    }
+
+    // Writes the bytes back.  When the size is unchanged and every piece of
+    // the file is still at its own offset only the typed pieces are
+    // written, in place; otherwise the whole file goes to a temporary that
+    // then replaces it.  The file is mapped again afterwards, so the pieces
+    // start over.  `written` is how many bytes that took.
+    bool save(const std::string &path, uint64_t &written, std::string &error) {
+        bool inPlace = file.data && total == file.size;
+        uint64_t start = 0;
+        for (const Piece &p : pieces) {
+            if (!p.added && p.offset != start) inPlace = false;
+            start += p.length;
+        }
+        written = 0;
+        if (inPlace) {
+            int fd = ::open(path.c_str(), O_WRONLY);
+            bool ok = fd >= 0;
+            start = 0;
+            for (const Piece &p : pieces) {
+                if (ok && p.added) {
+                    ok = writeAll(fd, source(p), p.length, start);
+                    written += p.length;
+                }
+                start += p.length;
+            }
+            if (fd >= 0 && ::close(fd) != 0) ok = false;
+            if (!ok) {
+                error = "Can't write " + path + ": " + strerror(errno);
+                return false;
+            }
+        } else {
+            struct stat st;
+            mode_t mode = stat(path.c_str(), &st) == 0 ? st.st_mode & 07777 : 0666;
+            std::string temp = path + ".pbtmp";
+            int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode);
+            bool ok = fd >= 0;
+            for (const Piece &p : pieces) {
+                if (ok) ok = writeAll(fd, source(p), p.length, written);
+                written += p.length;
+            }
+            if (fd >= 0 && ::close(fd) != 0) ok = false;
+            if (!ok || rename(temp.c_str(), path.c_str()) != 0) {
+                error = "Can't write " + path + ": " + strerror(errno);
+                unlink(temp.c_str());
+                return false;
+            }
+        }
+        return open(path);
+    }
+
+private:
+    MappedFile file;
+    std::string added;
+    std::vector<Piece> pieces;
+    uint64_t total;
+
+    const char *source(const Piece &p) const {
+        return (p.added ? added.data() : file.data) + p.offset;
+    }
+
+    // Index of the piece that starts at `at`, splitting the one across it
+    size_t split(uint64_t at) {
+        uint64_t start = 0;
+        for (size_t i = 0; i < pieces.size(); ++i) {
+            if (start == at) return i;
+            uint64_t end = start + pieces[i].length;
+            if (at < end) {
+                Piece tail = pieces[i];
+                tail.offset += at - start;
+                tail.length = end - at;
+                pieces[i].length = at - start;
+                pieces.insert(pieces.begin() + i + 1, tail);
+                return i + 1;
+            }
+            start = end;
+        }
+        return pieces.size();
+    }
+
+    static bool writeAll(int fd, const char *p, uint64_t n, uint64_t offset) {
+        while (n > 0) {
+            ssize_t done = pwrite(fd, p, std::min<uint64_t>(n, 1 << 30), offset);
+            if (done < 0 && errno == EINTR) continue;
+            if (done <= 0) return false;
+            p += done;
+            n -= done;
+            offset += done;
+        }
+        return true;
+    }
+};
+
+// pbedit -b: byte-exact editing of one file, shown as rows of offset, 16
+// bytes in hex and the same bytes as ASCII.  Only the rows on screen are
+// read, so a disk image opens as fast as a small file.  Tab switches
+// typing between the hex and the ASCII column.
+class HexEditor {
+public:
+    static const int ROW_BYTES = 16;
+
+    HexEditor(const std::string &fileName, bool headless = false) 
+        : headless(headless), quitRequested(false), failed(false), fileName(fileName), 
+          cursor(0), top(0), mode(Mode::NORMAL), asciiColumn(false), nibble(-1), 
+          count(0), pending(0), modified(false), editSaved(false) {
+        if (!bytes.open(fileName)) errorMessage("Can't open file: " + fileName);
+        if (headless) return;
+        initscr();
+        raw();
+        keypad(stdscr, TRUE);
+        noecho();
+        start_color();
+        init_pair(OFFSET_COLOR, COLOR_BLUE, COLOR_BLACK);
+        init_pair(STATUS_BAR_COLOR, COLOR_GREEN, COLOR_BLACK);
+        init_pair(COMMAND_COLOR, COLOR_BLACK, COLOR_BLUE);
+    }
+
+    ~HexEditor() {
+        if (!headless) endwin();
+    }
+
+    void run() {
+        while (!quitRequested) {
+            display();
+            int ch = getch();
+            if (ch == ERR) continue;
+            message.clear();
+            handleKey(ch);
+        }
+    }
+
+    // As TextEditor::runBatch: keys, then ex commands, then a write if the
+    // keys changed the file and there were no commands
+    bool runBatch(const std::vector<std::string> &commands, const std::vector<int> &keys) {
+        if (failed) return false;
+        for (size_t i = 0; i < keys.size() && !quitRequested; ++i) handleKey(keys[i]);
+        mode = Mode::NORMAL;
+        for (const std::string &command : commands) {
+            if (quitRequested) break;
+            runCommand(command.compare(0, 1, ":") == 0 ? command.substr(1) : command);
+        }
+        if (commands.empty() && modified) saveFile();
+        return !failed;
+    }
+
+    // The first error of a run, which later messages do not replace
+    const std::string &firstError() const { return error; }
+
+    void handleKey(int ch) {
+        switch (mode) {
+            case Mode::NORMAL: normalKey(ch); break;
+            case Mode::INSERT:
+            case Mode::REPLACE: typingKey(ch); break;
+            case Mode::COMMAND: commandKey(ch); break;
+        }
+    }
+
+private:
+    enum class Mode { NORMAL, INSERT, REPLACE, COMMAND };
+
+    const int OFFSET_COLOR = 1;
+    const int STATUS_BAR_COLOR = 2;
+    const int COMMAND_COLOR = 3;
+
+    bool headless, quitRequested, failed;
+    std::string fileName;
+    PieceTable bytes;
+    uint64_t cursor, top;   // byte offset of the cursor, row at the top of the screen
+    Mode mode;
+    bool asciiColumn;       // typing goes to the ASCII column
+    int nibble;             // high hex digit typed for the byte at the cursor, or -1
+    int count;              // count typed before a command
+    int pending;            // 'g' or 'r' waiting for the next key
+    bool modified;
+    std::string commandBuffer, message, error;
+
+    // Undo steps are piece lists and where the cursor was; editSaved is
+    // set once the current insert or replace session has its step
+    struct Step {
+        std::vector<PieceTable::Piece> pieces;
+        uint64_t cursor;
+    };
+    std::vector<Step> undoStack, redoStack;
+    bool editSaved;
+
+    void statusMessage(const std::string &text) { message = text; }
+
+    void errorMessage(const std::string &text) {
+        message = text;
+        if (!failed) error = text;
+        failed = true;
+    }
+
+    static int hexDigit(int ch) {
+        if (ch >= '0' && ch <= '9') return ch - '0';
+        if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+        if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+        return -1;
+    }
+
+    // Last place the cursor can be: past the end only while typing
+    uint64_t lastCursor() const {
+        uint64_t size = bytes.size();
+        return mode == Mode::INSERT || mode == Mode::REPLACE || size == 0 ? size : size - 1;
+    }
+
+    int rows() const { return std::max(1, (headless ? HEADLESS_LINES : LINES) - 2); }
+
+    void moveTo(uint64_t at) {
+        cursor = std::min(at, lastCursor());
+        nibble = -1;
+    }
+
+    void saveForUndo() {
+        undoStack.push_back({bytes.list(), cursor});
+        redoStack.clear();
+    }
+
+    void undo(std::vector<Step> &from, std::vector<Step> &to) {
+        if (from.empty()) {
+            statusMessage(&from == &undoStack ? "Already at oldest change" : "Already at newest change");
+            return;
+        }
+        to.push_back({bytes.list(), cursor});
+        bytes.restore(from.back().pieces);
+        moveTo(from.back().cursor);
+        from.pop_back();
+        modified = true;
+    }
+
+    // Writes a byte at the cursor, over the one there in replace mode and
+    // normal mode (r), in front of it in insert mode
+    void putByte(unsigned char b) {
+        if (!editSaved) saveForUndo();
+        editSaved = mode == Mode::INSERT || mode == Mode::REPLACE;
+        bytes.replace(cursor, mode == Mode::INSERT ? 0 : 1, &b, 1);
+        modified = true;
+    }
+
+    void deleteBytes(uint64_t at, uint64_t n) {
+        n = std::min(n, bytes.size() - at);
+        if (n == 0) return;
+        if (!editSaved) saveForUndo();
+        bytes.replace(at, n, nullptr, 0);
+        modified = true;
+    }
+
+    void normalKey(int ch) {
+        if (pending == 'g') {
+            pending = 0;
+            if (ch == 'g') moveTo(count ? (uint64_t)(count - 1) * ROW_BYTES : 0);
+            count = 0;
+            return;
+        }
+        if (pending == 'r') {
+            // Replaces the byte: one key in the ASCII column, two hex digits otherwise
+            int digit = hexDigit(ch);
+            bool valid = asciiColumn ? ch >= 32 && ch < 127 : digit >= 0;
+            if (!valid || cursor >= bytes.size()) {
+                pending = 0;
+                nibble = -1;
+            } else if (!asciiColumn && nibble < 0) {
+                nibble = digit;
+            } else {
+                putByte(asciiColumn ? ch : nibble << 4 | digit);
+                pending = 0;
+                nibble = -1;
+            }
+            return;
+        }
+        if ((ch >= '1' && ch <= '9') || (ch == '0' && count > 0)) {
+            count = std::min(count * 10 + ch - '0', 100000000);
+            return;
+        }
+        uint64_t n = std::max(count, 1);
+        count = ch == 'g' ? count : 0;
+        uint64_t rowStart = cursor - cursor % ROW_BYTES;
+        switch (ch) {
+            case 'h': case KEY_LEFT: moveTo(cursor - std::min(cursor, n)); break;
+            case 'l': case KEY_RIGHT: moveTo(cursor + n); break;
+            case 'k': case KEY_UP:
+                if (cursor >= ROW_BYTES) moveTo(cursor - std::min(cursor / ROW_BYTES, n) * ROW_BYTES);
+                break;
+            case 'j': case KEY_DOWN:
+                if (cursor + ROW_BYTES <= lastCursor()) {
+                    moveTo(cursor + std::min((lastCursor() - cursor) / ROW_BYTES, n) * ROW_BYTES);
+                }
+                break;
+            case '0': case KEY_HOME: moveTo(rowStart); break;
+            case '$': case KEY_END: moveTo(rowStart + ROW_BYTES - 1); break;
+            case 'G': moveTo(bytes.size()); break;
+            case 6: case KEY_NPAGE:  // Ctrl-F
+                moveTo(cursor + n * rows() * ROW_BYTES);
+                top += n * rows();
+                break;
+            case 2: case KEY_PPAGE: {  // Ctrl-B
+                uint64_t back = std::min<uint64_t>(cursor / ROW_BYTES, n * rows());
+                moveTo(cursor - back * ROW_BYTES);
+                top -= std::min<uint64_t>(top, n * rows());
+            }
+            break;
+            case '\t': asciiColumn = !asciiColumn; break;
+            case 'x': case KEY_DC:
+                editSaved = false;
+                deleteBytes(cursor, n);
+                moveTo(cursor);
+                break;
+            case 'g': case 'r': pending = ch; break;
+            case 'i': case 'a': case 'R':
+                mode = ch == 'R' ? Mode::REPLACE : Mode::INSERT;
+                editSaved = false;
+                if (ch == 'a') moveTo(cursor + 1);
+                break;
+            case 'u': undo(undoStack, redoStack); break;
+            case 18: undo(redoStack, undoStack); break;  // Ctrl-R
+            case ':':
+                mode = Mode::COMMAND;
+                commandBuffer.clear();
+                break;
+        }
+    }
+
+    void typingKey(int ch) {
+        switch (ch) {
+            case 27:
+                mode = Mode::NORMAL;
+                editSaved = false;
+                moveTo(cursor);
+                return;
+            case '\t': asciiColumn = !asciiColumn; nibble = -1; return;
+            case KEY_LEFT: moveTo(cursor - std::min<uint64_t>(cursor, 1)); return;
+            case KEY_RIGHT: moveTo(cursor + 1); return;
+            case KEY_UP: if (cursor >= ROW_BYTES) moveTo(cursor - ROW_BYTES); return;
+            case KEY_DOWN: moveTo(cursor + ROW_BYTES); return;
+            case KEY_BACKSPACE: case 127:
+                if (nibble >= 0) {
+                    nibble = -1;
+                } else if (cursor > 0) {
+                    // Insert mode takes the byte back, replace mode just steps over it
+                    if (mode == Mode::INSERT) deleteBytes(cursor - 1, 1);
+                    moveTo(cursor - 1);
+                }
+                return;
+        }
+        if (asciiColumn) {
+            if (ch < 32 || ch > 126) return;
+            putByte(ch);
+            moveTo(cursor + 1);
+            return;
+        }
+        int digit = hexDigit(ch);
+        if (digit < 0) return;
+        if (nibble < 0) {
+            nibble = digit;
+            return;
+        }
+        putByte(nibble << 4 | digit);
+        moveTo(cursor + 1);
+    }
+
+    void commandKey(int ch) {
+        if (ch == '\n') {
+            mode = Mode::NORMAL;
+            runCommand(commandBuffer);
+            commandBuffer.clear();
+        } else if (ch == 27) {
+            mode = Mode::NORMAL;
+            commandBuffer.clear();
+        } else if (ch == KEY_BACKSPACE || ch == 127) {
+            if (commandBuffer.empty()) mode = Mode::NORMAL;
+            else commandBuffer.pop_back();
+        } else if (ch >= 32 && ch < 127) {
+            commandBuffer += static_cast<char>(ch);
+        }
+    }
+
+    // :w, :q, :wq and :<offset>, decimal or 0x hex
+    void runCommand(const std::string &command) {
+        if (command.empty()) return;
+        if (command == "w" || command == "w!") {
+            saveFile();
+        } else if (command == "q" || command == "q!") {
+            quitRequested = true;
+        } else if (command == "wq" || command == "x") {
+            if (saveFile()) quitRequested = true;
+        } else {
+            bool hex = command.compare(0, 2, "0x") == 0;
+            uint64_t offset;
+            auto result = std::from_chars(command.data() + (hex ? 2 : 0), command.data() + command.length(), 
+                                          offset, hex ? 16 : 10);
+            if (result.ec != std::errc() || result.ptr != command.data() + command.length()) {
+                errorMessage("Not an editor command: " + command);
+                return;
+            }
+            moveTo(offset);
+        }
+    }
+
+    bool saveFile() {
+        uint64_t written;
+        std::string error;
+        if (!bytes.save(fileName, written, error)) {
+            errorMessage(error);
+            return false;
+        }
+        // The pieces now all point into the file written
+        undoStack.clear();
+        redoStack.clear();
+        modified = false;
+        statusMessage("\"" + fileName + "\" " + std::to_string(bytes.size()) + " bytes, " + 
+                      std::to_string(written) + " written");
+        return true;
+    }
+
+    void display() {
+        int height = rows();
+        uint64_t row = cursor / ROW_BYTES;
+        if (row < top) top = row;
+        if (row >= top + height) top = row - height + 1;
+
+        static const char digits[] = "0123456789abcdef";
+        std::vector<unsigned char> data((size_t)height * ROW_BYTES);
+        size_t got = bytes.read(top * ROW_BYTES, data.data(), data.size());
+        const int hexLeft = 14, asciiLeft = hexLeft + 3 * ROW_BYTES + 2;
+        for (int r = 0; r < height; ++r) {
+            move(r, 0);
+            clrtoeol();
+            uint64_t offset = (top + r) * ROW_BYTES;
+            if ((size_t)r * ROW_BYTES >= got && top + r != row) continue;
+            std::ostringstream label;
+            label << std::hex << std::setw(12) << std::setfill('0') << offset;
+            attron(COLOR_PAIR(OFFSET_COLOR));
+            mvaddstr(r, 0, label.str().c_str());
+            attroff(COLOR_PAIR(OFFSET_COLOR));
+            for (int i = 0; i < ROW_BYTES && (size_t)r * ROW_BYTES + i < got; ++i) {
+                unsigned char b = data[r * ROW_BYTES + i];
+                int x = hexLeft + 3 * i + (i >= ROW_BYTES / 2);
+                mvaddch(r, x, digits[b >> 4]);
+                mvaddch(r, x + 1, digits[b & 15]);
+                mvaddch(r, asciiLeft + i, b >= 32 && b < 127 ? b : '.');
+            }
+        }
+
+        // The cursor is in the column being typed into, the other shows the byte reversed
+        int r = row - top, i = cursor % ROW_BYTES;
+        int hexX = hexLeft + 3 * i + (i >= ROW_BYTES / 2), asciiX = asciiLeft + i;
+        if (nibble >= 0) mvaddch(r, hexX, digits[nibble]);
+        mvchgat(r, asciiColumn ? hexX : asciiX, asciiColumn ? 2 : 1, A_REVERSE, 0, nullptr);
+
+        std::ostringstream status;
+        const char *modeName = mode == Mode::INSERT ? "INSERT" : mode == Mode::REPLACE ? "REPLACE" 
+                             : mode == Mode::COMMAND ? "COMMAND" : "NORMAL";
+        status << "Mode: HEX " << modeName << " | Offset: 0x" << std::hex << cursor << std::dec 
+               << " (" << cursor << ") of " << bytes.size() << " | File: " << fileName 
+               << (modified ? " [+]" : "") << (asciiColumn ? " | ascii" : "");
+        std::string statusStr = status.str();
+        statusStr.resize(COLS, ' ');
+        attron(COLOR_PAIR(STATUS_BAR_COLOR));
+        mvaddnstr(LINES - 2, 0, statusStr.c_str(), COLS);
+        attroff(COLOR_PAIR(STATUS_BAR_COLOR));
+
+        move(LINES - 1, 0);
+        clrtoeol();
+        if (mode == Mode::COMMAND) {
+            attron(COLOR_PAIR(COMMAND_COLOR));
+            mvprintw(LINES - 1, 0, ":%s", commandBuffer.c_str());
+            attroff(COLOR_PAIR(COMMAND_COLOR));
+        } else if (!message.empty()) {
+            mvprintw(LINES - 1, 0, "%s", message.c_str());
+        }
+        if (mode != Mode::COMMAND) move(r, asciiColumn ? asciiX : hexX + (nibble >= 0));
+        refresh();
+    }
+};
+
+// --keys takes C-style escapes: \e for Escape, \n, \t, \b for Backspace
+static std::vector<int> parseKeys(const std::string &text) {
+    std::vector<int> keys;
+    for (size_t i = 0; i < text.length(); ++i) {
+        if (text[i] != '\\' || i + 1 == text.length()) {
+            keys.push_back((unsigned char)text[i]);
+            continue;
+        }
+        switch (text[++i]) {
+            case 'e': keys.push_back(27); break;
+            case 'n': case 'r': keys.push_back('\n'); break;
+            case 't': keys.push_back('\t'); break;
+            case 'b': keys.push_back(127); break;
+            default: keys.push_back((unsigned char)text[i]); break;
+        }
+    }
+    return keys;
+}
+
+// Headless mode: every file gets its own editor, a TextEditor or with -b
+// a HexEditor, spread over all cores.  Returns 0 if every file went
+// through, 1 otherwise
+template <typename Editor>
+static int runBatch(const std::vector<std::string> &files, 
+                    const std::vector<std::string> &commands, const std::vector<int> &keys) {
+    std::atomic<size_t> next(0);
+    std::atomic<int> failures(0);
+    std::mutex errorLock;
+    auto worker = [&]() {
+        for (size_t i; (i = next++) < files.size();) {
+            Editor editor(files[i], true);
+            if (!editor.runBatch(commands, keys)) {
+                failures++;
+                std::lock_guard<std::mutex> lock(errorLock);
+                std::cerr << files[i] << ": " << editor.firstError() << "\n";
+            }
+        }
+    };
+
+    size_t threads = std::min<size_t>(files.size(), std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < threads; ++t) pool.emplace_back(worker);
+    worker();
+    for (std::thread &t : pool) t.join();
+    return failures > 0 ? 1 : 0;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " <filename>\n";
-        return 1;
+    std::vector<std::string> files, commands;
+    std::vector<int> keys;
+    bool batch = false, diffMode = false, follow = false, binary = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-b") {
+            binary = true;
+        } else if (arg == "-d") {
+            diffMode = true;
+        } else if (arg == "-f") {
+            follow = true;
+        } else if (arg == "-s" && i + 1 < argc) {
+            std::ifstream script(argv[++i]);
+            if (!script.is_open()) {
+                std::cerr << "Can't open script: " << argv[i] << "\n";
+                return 2;
+            }
+            // One ex command per line; blank lines and " comments are skipped
+            for (std::string line; std::getline(script, line);) {
+                if (!line.empty() && line[0] != '"') commands.push_back(line);
+            }
+            batch = true;
+        } else if (arg == "--keys" && i + 1 < argc) {
+            std::vector<int> more = parseKeys(argv[++i]);
+            keys.insert(keys.end(), more.begin(), more.end());
+            batch = true;
+        } else {
+            files.push_back(arg);
+        }
+    }
+
+    if (files.empty()) {
+        std::cerr << "Usage: " << argv[0] << " <filename>\n"
+                  << "       " << argv[0] << " -b <file>\n"
+                  << "       " << argv[0] << " -f <file>\n"
+                  << "       " << argv[0] << " -d <file> <file>\n"
+                  << "       " << argv[0] << " [-b] [-s script.ex] [--keys keys] <file>...\n";
+        return 2;
+    }
+    if (batch) return binary ? runBatch<HexEditor>(files, commands, keys) : runBatch<TextEditor>(files, commands, keys);
+    if (binary) {
+        HexEditor editor(files[0]);
+        editor.run();
+        return 0;
     }
 
-    TextEditor editor(argv[1]);
+    TextEditor editor(files[0]);
+    editor.addBuffers(std::vector<std::string>(files.begin() + 1, files.end()));
+    if (diffMode) editor.startDiffMode();
+    if (follow) editor.startFollow(0);
     editor.run();
 
     return 0;
@@ -0,0 +1,187 @@
+#!/bin/bash
+# Headless regression checks: each case types keys (--keys) or runs an
+# ex script (-s) on a small file and compares the file written back.
+#   tests/keys.sh [path/to/pbedit]
+# Without a path the editor is built into a temporary directory first.
+
+cd "$(dirname "$0")/.." || exit 1
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+editor=$1
+if [ -z "$editor" ]; then
+    editor=$work/pbedit
+    g++ -std=c++17 -O2 pbedit-vi-fix2.cpp -o "$editor" -lncurses -pthread || exit 1
+fi
+
+passed=0
+failed=0
+
+# check <name> <input> <expected> <editor arguments...>
+# The input and expected text are given with printf escapes; the file is
+# passed as the last argument.
+check() {
+    local name=$1 input=$2 expected=$3
+    shift 3
+    printf "$input" > "$work/file"
+    timeout 20 "$editor" "$@" "$work/file" > "$work/out" 2>&1
+    local status=$?
+    if [ $status -gt 1 ]; then
+        echo "FAIL $name: exit status $status"
+        cat "$work/out"
+        failed=$((failed + 1))
+    elif [ "$(cat "$work/file"; echo .)" != "$(printf "$expected"; echo .)" ]; then
+        echo "FAIL $name"
+        printf "  expected: %q\n" "$(printf "$expected")"
+        printf "  got:      %q\n" "$(cat "$work/file")"
+        failed=$((failed + 1))
+    else
+        passed=$((passed + 1))
+    fi
+}
+
+# check_script <name> <input> <expected> <ex commands>
+check_script() {
+    printf "$4" > "$work/script.ex"
+    check "$1" "$2" "$3" -s "$work/script.ex"
+}
+
+# Keys typed with --keys go through recording like the terminal's
+check "record and replay" 'abc\nabc\nabc\nabc\n' 'bc\nbc\nbc\nbc\n' --keys 'qaxjq3@a'
+check "replay last macro" 'abc\nabc\nabc\n' 'bc\nbc\nbc\n' --keys 'qaxjq@a@@'
+check "macro calling itself" 'abcdef\nx\n' '\nx\n' --keys 'qa0x@aq@a'
+check "empty recording" 'abc\n' 'abc\n' --keys 'qaq@a'
+check "dot after insert" 'abc\nabc\n' 'Xabc\nXabc\n' --keys 'iX\ej0.'
+
+# :sort, :uniq and filters through a shell command
+check_script "sort" 'c\na\nb\n' 'a\nb\nc\n' ':sort\n:w\n'
+check_script "sort numeric reversed" '10\n9\n100\n' '100\n10\n9\n' ':sort! n\n:w\n'
+check_script "uniq" 'a\na\nb\na\n' 'a\nb\na\n' ':uniq\n:w\n'
+check_script "filter a range" 'c\nb\na\nz\n' 'a\nb\nc\nz\n' ':1,3!sort\n:w\n'
+check "empty filter command" 'a\nb\n' 'a\nb\n' --keys ':%!\n:w\n'
+check "blank read command" 'a\nb\n' 'a\nb\n' --keys ':r ! \n:w\n'
+check_script "filter that outlives its output" 'b\na\n' 'a\nb\n' ':%%!sort; exec >&- 2>&-; sleep 60\n:w\n'
+
+# A missing last newline is kept, also after the file is read again
+check "no newline at end" 'a\nb' 'a\nbc' --keys 'jAc\e'
+check_script "newline after reload" 'a\nb' 'x\ny\n' ":!printf 'x\\\\ny\\\\n' > $work/file\n:follow\n:nofollow\n:w\n"
+check_script "no newline after reload" 'a\nb\n' 'x\ny' ":!printf 'x\\\\ny' > $work/file\n:follow\n:nofollow\n:w\n"
+
+# Multi-cursor newline and backspace (user-032)
+check "cursors split lines" 'a,b\nc,d\ne\n' 'a\n,b\nc\n,d\ne\n' --keys ':cursors ,\ni\n\e:w\n'
+check "cursors erase" 'a,b\nc,d\ne\n' 'b\nd\ne\n' --keys ':cursors ,\na\b\b\e:w\n'
+check "cursors join lines" 'xa\nxb\nxc\n' 'XxaXxbXxc\n' --keys ':cursors x\ni\bX\e:w\n'
+check "cursors split and join" 'xa\nxb\n' 'xa\nxb\n' --keys ':cursors x\ni\n\b\e:w\n'
+
+# Folds (user-050): the cursor lands inside the fold's first line
+check "fold from a longer line" 'a\n  bbbbbbbb\n' 'aE\n  bbbbbbbb\n' --keys 'j$zfkiE\e:w\n'
+check "indent folds from a longer line" 'a\n  bbbbbbbb\n' 'aE\n  bbbbbbbb\n' --keys 'j$:set fdm=indent\niE\e:w\n'
+check "delete a closed fold" 'a\nb\nc\nd\n' 'a\nd\n' --keys 'jzfjdd:w\n'
+check "folds after :g deletes" 'a\nb\nc\nx\nd\n' 'b\nx\nd\n' --keys 'jzfj:g/a/d\njdd:w\n'
+check "folds move with :m" 'a\nb\nc\nx\nd\n' 'x\na\nd\n' --keys 'jzfj:4m0\n:3\nzcdd:w\n'
+check "bracket folds skip strings" 'f() {\n  s = "{";\n}\ng\n' 'g\n' --keys ':set fdm=bracket\nggdd:w\n'
+check "bracket folds skip comments" 'f() {\n  /* } */ x;\n  y; // }\n}\ng\n' 'g\n' --keys ':set fdm=bracket\nggdd:w\n'
+
+# Hex mode
+check "hex replace" 'abc' 'Abc' -b --keys 'r41'
+check "hex delete" 'abc' 'ac' -b --keys 'lx'
+check "hex insert" 'abc' 'aBbc' -b --keys 'li42\e'
+check "hex text column" 'abcd' 'aXYd' -b --keys '\tlRXY\e'
+
+# Search (user-026), with and without the trigram index
+check "search next" 'foo\nbar\nbaz\nbar\n' 'foo\nbar\nbaz\nar\n' --keys '/bar\nnx'
+check "search wraps back" 'foo\nbar\nbaz\nbar\n' 'foo\nbar\nbaz\nar\n' --keys '/bar\nNx'
+check "search with trigrams" 'foo\nbar\nbaz\nbar\n' 'foo\nbar\nbaz\nar\n' --keys ':set trigram\n/bar\nnx'
+
+# % over the bracket index (user-028)
+check "match bracket on the line" 'f(a, (b)) x\n' 'f(a, (b) x\n' --keys '%x'
+check "match brace lines below" 'if (a) {\n  x;\n}\ny\n' 'if (a) {\n  x;\n\ny\n' --keys '$h%x'
+check "match skips strings" 'f("(", a)\n' 'f("(", a\n' --keys '%x'
+
+# Word motions (user-029)
+check "w and b" 'one two.three four\n' 'one wo.three four\n' --keys 'wwbx'
+check "W" 'one two.three four\n' 'one two.three our\n' --keys 'WWx'
+check "e and E" 'one two.three four\n' 'one two.thre four\n' --keys 'eEx'
+check "B" 'one two.three four\n' 'one wo.three four\n' --keys '$BBx'
+
+# Counts go to the operation (user-030)
+check "count dd" 'a\nb\nc\nd\ne\n' 'd\ne\n' --keys '3dd'
+check "count x" 'abcdef\n' 'def\n' --keys '3x'
+check "count past the end" 'a\nb\n' '\n' --keys '9dd'
+check "block paste past the end, filtered" 'abc\ndef\nghi\n' 'abc\ndef\nghiab\n' --keys $'\x16jly:g/h/\nGp'
+
+# Marks follow their lines (user-031)
+check "exact mark" 'a\nb\nc\nd\ne\n' '\nb\nd\ne\n' --keys 'majjdd`ax'
+check "mark line after a delete above" 'a\nb\nc\nd\n' 'b\n\nd\n' --keys "jjmaggdd'ax"
+
+# Shifting line ranges (user-033)
+check "visual shift" 'a\nb\nc\n' '    a\n    b\nc\n' --keys 'Vj>'
+check "visual unshift" '        a\n    b\nc\n' '    a\nb\nc\n' --keys 'Vj<'
+check "retab" 'a\n\tb\n' 'a\n        b\n' --keys ':set et\n:retab\n'
+
+# Named registers (user-034)
+check "named registers" 'a\nb\nc\n' 'a\nb\nc\na\nb\n' --keys '"ayyj"byyG"ap"bp'
+check "appending register" 'a\nb\nc\n' 'a\nb\na\nb\nc\n' --keys '"ayyj"Ayy"ap'
+
+# Buffers (user-038)
+check "yank across buffers" 'a\n' 'a\nother\n' --keys ":!printf 'other\\\\n' > $work/other\n:e $work/other\nyy:bn\np"
+
+# Split windows share the buffer (user-039)
+check "edit in a split" 'ab\ncd\n' 'b\nd\n' --keys ':sp\nx:q\njx'
+
+# Diff mode (user-042)
+check "next hunk" 'a\nX\nc\nd\nY\n' 'a\n\nc\nd\n\n' --keys ":!printf 'a\\\\nb\\\\nc\\\\nd\\\\ne\\\\n' > $work/other\n:e $work/other\n:diffthis\n:bn\n:diffthis\n]cx]cx"
+
+# Filtered view (user-045)
+check "delete in a filtered view" 'a1\nb\na2\nc\na3\n' 'a1\nb\nc\na3\n' --keys ':g/a/\njdd'
+check "filter off" 'a1\nb\na2\nc\na3\n' 'a1\nb\na2\n' --keys ':g/a/\nGdd:nofilter\nGdd'
+
+# Ex ranges and :g (user-046)
+check_script ":g delete" 'a1\nb\na2\nc\n' 'b\nc\n' ':g/a/d\n:w\n'
+check_script ":v delete" 'a1\nb\na2\nc\n' 'a1\na2\n' ':v/a/d\n:w\n'
+check_script ":g move" 'a\nb\nc\n' 'b\nc\na\n' ':g/a/m$\n:w\n'
+check_script ":m" 'a\nb\nc\n' 'b\nc\na\n' ':1m$\n:w\n'
+check_script ":t" 'a\nb\nc\n' 'a\nb\nc\na\nb\n' ':1,2t$\n:w\n'
+check_script ":normal" 'a\nb\nc\n' 'ax\nbx\ncx\n' ':%%normal Ax\n:w\n'
+check_script ":g normal" 'a\nb\nc\n' 'a\nc\n' ':g/b/normal dd\n:w\n'
+
+# Timestamp navigation (user-047)
+check "time" '2026-10-16T10:00:00 a\n2026-10-16T11:00:00 b\n2026-10-16T12:00:00 c\n' '2026-10-16T10:00:00 a\n2026-10-16T12:00:00 c\n' --keys ':time 2026-10-16T10:30\ndd'
+check "time of day" '[2026-10-16 10:00:00] a\n[2026-10-16 11:00:00] b\n[2026-10-16 12:00:00] c\n' '[2026-10-16 10:00:00] a\n[2026-10-16 12:00:00] c\n' --keys 'G:time 11:00\ndd'
+
+# Column mode (user-048)
+check "delete a column" 'a,b,c\nd,e,f\n' 'a,c\nd,f\n' --keys ':csv\n:delcol 2\n'
+check "delete the last column" 'a,b,c\nd,e,f\n' 'a,b\nd,e\n' --keys ':csv\n:delcol 3\n'
+check "sort by column" 'x,3\ny,1\nz,2\n' 'y,1\nz,2\nx,3\n' --keys ':csv\n:sort 2\n'
+
+# :grep and the quickfix list (user-027)
+check "grep a file" 'a\nxb\nc\n' 'a\nx\nc\n' --keys ":grep b $work/file\nx"
+check "grep a directory" 'a\nxb\nc\n' 'a\nx\nc\n' --keys ":grep xb $work\n:cc\nlx"
+check "grep a missing path" 'a\nb\n' '\nb\n' --keys ":grep a $work/missing\nx"
+grep -q "Can't search" "$work/out" || { echo "FAIL grep a missing path: no error"; failed=$((failed + 1)); }
+
+# A write past the file size limit fails the run and leaves the file whole (user-037)
+printf '%03000d\n' 0 > "$work/file"
+(ulimit -f 2; timeout 20 "$editor" --keys 'x' "$work/file" > "$work/out" 2>&1)
+status=$?
+if [ $status -eq 1 ] && [ "$(wc -c < "$work/file")" -eq 3001 ]; then
+    passed=$((passed + 1))
+else
+    echo "FAIL write past the size limit: exit status $status, $(wc -c < "$work/file") bytes"
+    failed=$((failed + 1))
+fi
+
+# A failed run reports its first error, not a later message (user-037)
+for mode in "" -b; do
+    printf 'a\n' > "$work/file"
+    timeout 20 "$editor" $mode --keys ':bogus\n:w\n' "$work/file" > "$work/out" 2>&1
+    if grep -q "Not an editor command: bogus" "$work/out"; then
+        passed=$((passed + 1))
+    else
+        echo "FAIL first error $mode: $(cat "$work/out")"
+        failed=$((failed + 1))
+    fi
+done
+
+echo "$passed passed, $failed failed"
+[ $failed -eq 0 ]